@@ -172,6 +172,15 @@ bool kvm_has_free_slot(MachineState *ms)
     return false;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+void kvm_cleanup(void)
+{
+}
+
 void kvm_init_cpu_signals(CPUState *cpu)
 {
     abort();
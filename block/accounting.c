@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -280,3 +281,141 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 
     return (double) sum / elapsed;
 }
+
+BlockNodeLatencyStats *block_node_latency_stats_new(void)
+{
+    BlockNodeLatencyStats *stats = g_new0(BlockNodeLatencyStats, 1);
+
+    qemu_mutex_init(&stats->lock);
+    if (qtest_enabled()) {
+        clock_type = QEMU_CLOCK_VIRTUAL;
+    }
+    return stats;
+}
+
+void block_node_latency_stats_free(BlockNodeLatencyStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+    qemu_mutex_destroy(&stats->lock);
+    g_free(stats);
+}
+
+/*
+ * Return the start timestamp for a request on a node with latency stats
+ * @stats, or 0 if latency tracking is disabled for the node.
+ */
+int64_t block_node_latency_start(BlockNodeLatencyStats *stats)
+{
+    if (!stats) {
+        return 0;
+    }
+    return qemu_clock_get_ns(clock_type);
+}
+
+void block_node_latency_done(BlockNodeLatencyStats *stats,
+                             enum BlockAcctType type, int64_t start_ns)
+{
+    int64_t now;
+
+    if (!stats) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(clock_type);
+    block_node_latency_account(stats, type, MAX(now - start_ns, 0));
+}
+
+unsigned block_latency_log_bucket(uint64_t value)
+{
+    unsigned shift;
+
+    if (value < BLOCK_LAT_SUB_BUCKETS) {
+        return value;
+    }
+
+    value = MIN(value, (1ULL << (BLOCK_LAT_MAX_BITS + 1)) - 1);
+    shift = 63 - clz64(value) - BLOCK_LAT_SUB_BITS;
+
+    return (shift + 1) * BLOCK_LAT_SUB_BUCKETS +
+           (value >> shift) - BLOCK_LAT_SUB_BUCKETS;
+}
+
+/* Return the largest value that is accounted into bucket @idx */
+uint64_t block_latency_log_bucket_upper(unsigned idx)
+{
+    unsigned shift;
+
+    assert(idx < BLOCK_LAT_NR_BUCKETS);
+
+    if (idx < BLOCK_LAT_SUB_BUCKETS) {
+        return idx;
+    }
+
+    shift = idx / BLOCK_LAT_SUB_BUCKETS - 1;
+    return ((uint64_t)(idx % BLOCK_LAT_SUB_BUCKETS + BLOCK_LAT_SUB_BUCKETS)
+            << shift) + (1ULL << shift) - 1;
+}
+
+void block_node_latency_account(BlockNodeLatencyStats *stats,
+                                enum BlockAcctType type, uint64_t latency_ns)
+{
+    BlockLatencyLogHistogram *hist;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    hist = &stats->hist[type];
+
+    qemu_mutex_lock(&stats->lock);
+    if (!hist->count || latency_ns < hist->min_ns) {
+        hist->min_ns = latency_ns;
+    }
+    if (latency_ns > hist->max_ns) {
+        hist->max_ns = latency_ns;
+    }
+    hist->count++;
+    hist->sum_ns += latency_ns;
+    hist->buckets[block_latency_log_bucket(latency_ns)]++;
+    qemu_mutex_unlock(&stats->lock);
+}
+
+void block_node_latency_snapshot(BlockNodeLatencyStats *stats,
+                                 enum BlockAcctType type,
+                                 BlockLatencyLogHistogram *hist)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->lock);
+    *hist = stats->hist[type];
+    qemu_mutex_unlock(&stats->lock);
+}
+
+/*
+ * Return an upper estimate of the @per_mille'th per-mille of @hist, i.e. a
+ * value that at least @per_mille / 1000 of all accounted requests did not
+ * exceed.  The estimate is clamped to the observed minimum and maximum, so
+ * it is exact at both ends of the distribution.
+ */
+uint64_t block_latency_log_percentile(const BlockLatencyLogHistogram *hist,
+                                      unsigned per_mille)
+{
+    uint64_t rank, seen = 0;
+    unsigned i;
+
+    assert(per_mille <= 1000);
+
+    if (!hist->count) {
+        return 0;
+    }
+
+    rank = MAX(DIV_ROUND_UP(hist->count * per_mille, 1000), 1);
+    for (i = 0; i < BLOCK_LAT_NR_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = block_latency_log_bucket_upper(i);
+            return MIN(MAX(upper, hist->min_ns), hist->max_ns);
+        }
+    }
+
+    return hist->max_ns;
+}
@@ -2375,6 +2375,30 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+#ifdef CONFIG_SENDFILE
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int64_t bytes, int out_fd)
+{
+    int ret;
+    BlockDriverState *bs;
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    /* Call blk_bs() only after waiting, the graph may have changed */
+    bs = blk_bs(blk);
+    bytes = MIN(bytes, BDRV_REQUEST_MAX_BYTES);
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret == 0) {
+        ret = bdrv_co_sendfile(bs, offset, bytes, out_fd);
+    }
+
+    blk_dec_in_flight(blk);
+    return ret;
+}
+#endif
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     return blk->root;
@@ -0,0 +1,730 @@
+/*
+ * Content hash block filter
+ *
+ * Keeps a hash of every block of the data passed through it in a sidecar
+ * node, so that tools can tell that two images contain the same data
+ * without reading it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "crypto/hash.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "sidecar.h"
+#include "trace.h"
+
+/*
+ * On-disk format of the hash node
+ *
+ * The hash node is a sidecar node (see sidecar.h) whose layout is described
+ * by the ContentHashLayout below.  The hash table follows the sidecar header
+ * at @table_offset: one entry of @hash_size bytes per block of the origin,
+ * holding the first bytes of the SHA-256 digest of the block, or all zeroes
+ * if the hash is not known.  The last block is hashed without padding if the
+ * origin size is not a multiple of the block size.
+ *
+ * All fields are big-endian.
+ */
+
+#define CONTENT_HASH_MAGIC          0x5143484153484553ULL /* "QCHASHES" */
+#define CONTENT_HASH_VERSION        1
+
+typedef struct ContentHashLayout {
+    uint32_t block_size;
+    uint32_t hash_size;
+    uint64_t table_offset;
+} QEMU_PACKED ContentHashLayout;
+
+/* End of disk format structures. */
+
+#define CONTENT_HASH_DEFAULT_BLOCK_SIZE (64 * KiB)
+#define CONTENT_HASH_MIN_BLOCK_SIZE     (4 * KiB)
+#define CONTENT_HASH_MAX_BLOCK_SIZE     (16 * MiB)
+
+/* Limits the memory used for the table, which is kept in memory */
+#define CONTENT_HASH_MAX_TABLE_SIZE     (256 * MiB)
+
+#define CONTENT_HASH_OPT_BLOCK_SIZE     "block-size"
+
+/* A write to the origin that is in flight */
+typedef struct ContentHashWrite {
+    uint64_t offset;
+    uint64_t bytes;
+    /*
+     * Set if another write overlapped this one while both were in flight;
+     * the order in which they hit the origin is unknown, so neither of them
+     * may record a hash.
+     */
+    bool conflict;
+    QLIST_ENTRY(ContentHashWrite) next;
+} ContentHashWrite;
+
+typedef struct BDRVContentHashState {
+    BlockSidecar sidecar;
+
+    uint32_t block_size;
+    int block_bits;
+    uint64_t nb_blocks;
+    uint64_t table_offset;
+    uint64_t origin_size;
+
+    /* nb_blocks entries of BDRV_CONTENT_HASH_SIZE bytes */
+    uint8_t *table;
+    /* Hash of a whole block of zeroes */
+    uint8_t zero_hash[BDRV_CONTENT_HASH_SIZE];
+
+    QLIST_HEAD(, ContentHashWrite) writes;
+    /* Bumped when a write starts or ends, so that reads can detect races */
+    uint64_t write_gen;
+} BDRVContentHashState;
+
+static QemuOptsList runtime_opts = {
+    .name = "content-hash",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = CONTENT_HASH_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the hashes",
+        },
+        { /* end of list */ }
+    },
+};
+
+static inline uint8_t *content_hash_entry(BDRVContentHashState *s,
+                                          uint64_t block)
+{
+    return s->table + block * BDRV_CONTENT_HASH_SIZE;
+}
+
+static void content_hash_invalidate(BDRVContentHashState *s, uint64_t offset,
+                                    uint64_t bytes)
+{
+    uint64_t first, last;
+
+    if (!bytes || !s->nb_blocks) {
+        return;
+    }
+
+    first = offset >> s->block_bits;
+    last = MIN((offset + bytes - 1) >> s->block_bits, s->nb_blocks - 1);
+    if (first <= last) {
+        memset(content_hash_entry(s, first), 0,
+               (last - first + 1) * BDRV_CONTENT_HASH_SIZE);
+    }
+}
+
+/*
+ * Return the range of whole blocks in [offset, offset + bytes) in @first
+ * and @end (exclusive).  The last block of the origin counts as whole if
+ * the range extends to the end of the origin.
+ */
+static bool content_hash_whole_blocks(BDRVContentHashState *s,
+                                      uint64_t offset, uint64_t bytes,
+                                      uint64_t *first, uint64_t *end)
+{
+    uint64_t end_offset = offset + bytes;
+
+    *first = DIV_ROUND_UP(offset, s->block_size);
+    if (end_offset >= s->origin_size) {
+        *end = s->nb_blocks;
+    } else {
+        *end = end_offset >> s->block_bits;
+    }
+
+    return *first < *end;
+}
+
+static bool content_hash_write_overlaps(BDRVContentHashState *s,
+                                        uint64_t offset, uint64_t bytes)
+{
+    ContentHashWrite *w;
+
+    QLIST_FOREACH(w, &s->writes, next) {
+        if (offset < w->offset + w->bytes && w->offset < offset + bytes) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void content_hash_write_begin(BDRVContentHashState *s,
+                                     ContentHashWrite *req,
+                                     uint64_t offset, uint64_t bytes)
+{
+    ContentHashWrite *w;
+
+    *req = (ContentHashWrite) {
+        .offset = offset,
+        .bytes  = bytes,
+    };
+
+    QLIST_FOREACH(w, &s->writes, next) {
+        if (offset < w->offset + w->bytes && w->offset < offset + bytes) {
+            w->conflict = true;
+            req->conflict = true;
+        }
+    }
+    QLIST_INSERT_HEAD(&s->writes, req, next);
+
+    s->write_gen++;
+    content_hash_invalidate(s, offset, bytes);
+}
+
+static void content_hash_write_end(BDRVContentHashState *s,
+                                   ContentHashWrite *req)
+{
+    QLIST_REMOVE(req, next);
+    s->write_gen++;
+}
+
+typedef struct ContentHashTask {
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    uint64_t bytes;
+    uint32_t block_size;
+    uint8_t *hashes;
+} ContentHashTask;
+
+static int content_hash_task_func(void *opaque)
+{
+    ContentHashTask *t = opaque;
+    uint64_t done;
+
+    for (done = 0; done < t->bytes; done += t->block_size) {
+        QEMUIOVector slice;
+        g_autofree uint8_t *digest = NULL;
+        size_t digest_len = 0;
+        int ret;
+
+        qemu_iovec_init_slice(&slice, t->qiov, t->qiov_offset + done,
+                              MIN(t->block_size, t->bytes - done));
+        ret = qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256, slice.iov,
+                                  slice.niov, &digest, &digest_len, NULL);
+        qemu_iovec_destroy(&slice);
+        if (ret < 0) {
+            return -EIO;
+        }
+
+        memcpy(t->hashes, digest, BDRV_CONTENT_HASH_SIZE);
+        t->hashes += BDRV_CONTENT_HASH_SIZE;
+    }
+
+    return 0;
+}
+
+/*
+ * Hash the blocks [first, end) whose data is at @qiov_offset in @qiov into
+ * @hashes.  The work is done in a worker thread.
+ */
+static int coroutine_fn content_hash_co_compute(BlockDriverState *bs,
+                                                uint64_t first, uint64_t end,
+                                                QEMUIOVector *qiov,
+                                                size_t qiov_offset,
+                                                uint8_t *hashes)
+{
+    BDRVContentHashState *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ContentHashTask task = {
+        .qiov           = qiov,
+        .qiov_offset    = qiov_offset,
+        .bytes          = MIN(end << s->block_bits, s->origin_size) -
+                          (first << s->block_bits),
+        .block_size     = s->block_size,
+        .hashes         = hashes,
+    };
+
+    return thread_pool_submit_co(pool, content_hash_task_func, &task);
+}
+
+/*
+ * Hash the whole blocks covered by a request for [offset, offset + bytes)
+ * with data in @qiov and store the hashes, unless @valid returns false by
+ * the time they are computed.
+ */
+static void coroutine_fn content_hash_co_update(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov,
+                                                size_t qiov_offset,
+                                                bool (*valid)(void *),
+                                                void *opaque)
+{
+    BDRVContentHashState *s = bs->opaque;
+    g_autofree uint8_t *hashes = NULL;
+    uint64_t first, end;
+
+    if (!content_hash_whole_blocks(s, offset, bytes, &first, &end)) {
+        return;
+    }
+
+    hashes = g_try_malloc((end - first) * BDRV_CONTENT_HASH_SIZE);
+    if (!hashes ||
+        content_hash_co_compute(bs, first, end, qiov,
+                                qiov_offset + (first << s->block_bits) - offset,
+                                hashes) < 0 ||
+        !valid(opaque))
+    {
+        return;
+    }
+
+    trace_content_hash_update(s, first, end);
+    memcpy(content_hash_entry(s, first), hashes,
+           (end - first) * BDRV_CONTENT_HASH_SIZE);
+}
+
+static void content_hash_reset(BlockDriverState *bs)
+{
+    BDRVContentHashState *s = bs->opaque;
+
+    memset(s->table, 0, s->nb_blocks * BDRV_CONTENT_HASH_SIZE);
+}
+
+static int content_hash_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVContentHashState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_pread(s->sidecar.child, s->table_offset, s->table,
+                     s->nb_blocks * BDRV_CONTENT_HASH_SIZE);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read hash table");
+        return ret;
+    }
+
+    trace_content_hash_load(s, s->nb_blocks);
+    return 0;
+}
+
+/* Write the in-memory table back to the hash node */
+static int content_hash_store(BlockDriverState *bs)
+{
+    BDRVContentHashState *s = bs->opaque;
+
+    return bdrv_pwrite(s->sidecar.child, s->table_offset, s->table,
+                       s->nb_blocks * BDRV_CONTENT_HASH_SIZE);
+}
+
+static const BlockSidecarDriver content_hash_sidecar = {
+    .child_name     = "hash-file",
+    .desc           = "hash table",
+    .magic          = CONTENT_HASH_MAGIC,
+    .version        = CONTENT_HASH_VERSION,
+    .reset          = content_hash_reset,
+    .load           = content_hash_load,
+    .store          = content_hash_store,
+};
+
+static int content_hash_open(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVContentHashState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    g_autofree uint8_t *zeroes = NULL;
+    ContentHashLayout layout;
+    struct iovec iov;
+    uint64_t block_size;
+    int64_t origin_size;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    /* Open the origin */
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    /* Hashes are recorded even if the origin is only read */
+    ret = block_sidecar_open(bs, &s->sidecar, &content_hash_sidecar, options,
+                             errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    block_size = qemu_opt_get_size(opts, CONTENT_HASH_OPT_BLOCK_SIZE,
+                                   CONTENT_HASH_DEFAULT_BLOCK_SIZE);
+    if (!is_power_of_2(block_size) ||
+        block_size < CONTENT_HASH_MIN_BLOCK_SIZE ||
+        block_size > CONTENT_HASH_MAX_BLOCK_SIZE)
+    {
+        ret = -EINVAL;
+        error_setg(errp, "Hash block size must be a power of two between "
+                   "%u and %u", (unsigned) CONTENT_HASH_MIN_BLOCK_SIZE,
+                   (unsigned) CONTENT_HASH_MAX_BLOCK_SIZE);
+        goto fail;
+    }
+
+    origin_size = bdrv_getlength(bs->file->bs);
+    if (origin_size < 0) {
+        ret = origin_size;
+        error_setg_errno(errp, -ret, "Could not get the size of the origin");
+        goto fail;
+    }
+
+    s->block_size = block_size;
+    s->block_bits = ctz32(block_size);
+    s->nb_blocks = DIV_ROUND_UP(origin_size, block_size);
+    if (s->nb_blocks > CONTENT_HASH_MAX_TABLE_SIZE / BDRV_CONTENT_HASH_SIZE) {
+        ret = -EFBIG;
+        error_setg(errp, "Too many hash blocks, use a larger block-size");
+        goto fail;
+    }
+    s->table_offset = BLOCK_SIDECAR_HEADER_SIZE;
+    s->origin_size = origin_size;
+    QLIST_INIT(&s->writes);
+
+    s->table = g_try_malloc0(MAX(s->nb_blocks, 1) * BDRV_CONTENT_HASH_SIZE);
+    zeroes = g_try_malloc0(s->block_size);
+    if (!s->table || !zeroes) {
+        ret = -ENOMEM;
+        error_setg(errp, "Could not allocate hash table");
+        goto fail;
+    }
+
+    iov = (struct iovec) { .iov_base = zeroes, .iov_len = s->block_size };
+    {
+        g_autofree uint8_t *digest = NULL;
+        size_t digest_len = 0;
+
+        if (qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256, &iov, 1, &digest,
+                                &digest_len, errp) < 0)
+        {
+            ret = -EINVAL;
+            goto fail;
+        }
+        memcpy(s->zero_hash, digest, BDRV_CONTENT_HASH_SIZE);
+    }
+
+    layout = (ContentHashLayout) {
+        .block_size     = cpu_to_be32(s->block_size),
+        .hash_size      = cpu_to_be32(BDRV_CONTENT_HASH_SIZE),
+        .table_offset   = cpu_to_be64(s->table_offset),
+    };
+    block_sidecar_set_layout(bs, &s->sidecar, origin_size, &layout,
+                             sizeof(layout));
+
+    if (!(flags & BDRV_O_INACTIVE)) {
+        ret = block_sidecar_activate(bs, &s->sidecar, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        g_free(s->table);
+        s->table = NULL;
+        bdrv_unref_child(bs, s->sidecar.child);
+        s->sidecar.child = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int content_hash_inactivate(BlockDriverState *bs)
+{
+    BDRVContentHashState *s = bs->opaque;
+
+    return block_sidecar_inactivate(bs, &s->sidecar);
+}
+
+static void coroutine_fn content_hash_co_invalidate_cache(BlockDriverState *bs,
+                                                          Error **errp)
+{
+    BDRVContentHashState *s = bs->opaque;
+
+    block_sidecar_activate(bs, &s->sidecar, errp);
+}
+
+static void content_hash_close(BlockDriverState *bs)
+{
+    BDRVContentHashState *s = bs->opaque;
+
+    block_sidecar_close(bs, &s->sidecar);
+    g_free(s->table);
+}
+
+static int64_t content_hash_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void content_hash_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                    const BdrvChildRole *role,
+                                    BlockReopenQueue *ro_q,
+                                    uint64_t perm, uint64_t shrd,
+                                    uint64_t *nperm, uint64_t *nshrd)
+{
+    if (!c) {
+        *nperm = perm & DEFAULT_PERM_PASSTHROUGH;
+        *nshrd = (shrd & DEFAULT_PERM_PASSTHROUGH) | DEFAULT_PERM_UNCHANGED;
+        return;
+    }
+
+    if (!strcmp(c->name, content_hash_sidecar.child_name)) {
+        block_sidecar_child_perm(bs, nperm, nshrd);
+    } else {
+        bdrv_filter_default_perms(bs, c, role, ro_q, perm, shrd, nperm, nshrd);
+
+        /*
+         * Hashes are only correct if every write to the origin goes through
+         * this node
+         */
+        *nshrd &= ~BLK_PERM_WRITE;
+    }
+}
+
+static int content_hash_reopen_prepare(BDRVReopenState *reopen_state,
+                                       BlockReopenQueue *queue, Error **errp)
+{
+    BDRVContentHashState *s = reopen_state->bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    int ret = 0;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, reopen_state->options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* The hash table would have to be recomputed */
+    if (qemu_opt_get_size(opts, CONTENT_HASH_OPT_BLOCK_SIZE,
+                          CONTENT_HASH_DEFAULT_BLOCK_SIZE) != s->block_size)
+    {
+        error_setg(errp, "Cannot change the block size of a content-hash "
+                   "node");
+        ret = -EINVAL;
+    }
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int content_hash_get_content_hash(BlockDriverState *bs, int64_t offset,
+                                         uint8_t *hash, int64_t *pnum)
+{
+    BDRVContentHashState *s = bs->opaque;
+    uint8_t *entry;
+
+    if (offset >= s->origin_size || !QEMU_IS_ALIGNED(offset, s->block_size)) {
+        return -EINVAL;
+    }
+
+    entry = content_hash_entry(s, offset >> s->block_bits);
+    if (buffer_is_zero(entry, BDRV_CONTENT_HASH_SIZE)) {
+        return -ENOENT;
+    }
+
+    memcpy(hash, entry, BDRV_CONTENT_HASH_SIZE);
+    *pnum = MIN(s->block_size, s->origin_size - offset);
+    return 0;
+}
+
+typedef struct ContentHashReadCheck {
+    BDRVContentHashState *s;
+    uint64_t write_gen;
+} ContentHashReadCheck;
+
+static bool content_hash_read_valid(void *opaque)
+{
+    ContentHashReadCheck *check = opaque;
+
+    return check->s->write_gen == check->write_gen;
+}
+
+static bool content_hash_write_valid(void *opaque)
+{
+    ContentHashWrite *req = opaque;
+
+    return !req->conflict;
+}
+
+static bool content_hash_unknown(BDRVContentHashState *s, uint64_t offset,
+                                 uint64_t bytes)
+{
+    uint64_t first, end, block;
+
+    if (!content_hash_whole_blocks(s, offset, bytes, &first, &end)) {
+        return false;
+    }
+
+    for (block = first; block < end; block++) {
+        if (buffer_is_zero(content_hash_entry(s, block),
+                           BDRV_CONTENT_HASH_SIZE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int coroutine_fn content_hash_co_preadv_part(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    size_t qiov_offset,
+                                                    int flags)
+{
+    BDRVContentHashState *s = bs->opaque;
+    ContentHashReadCheck check = {
+        .s          = s,
+        .write_gen  = s->write_gen,
+    };
+    bool fill;
+    int ret;
+
+    /* Hashes of data read while it is being written would be meaningless */
+    fill = !(bs->open_flags & BDRV_O_INACTIVE) &&
+           content_hash_unknown(s, offset, bytes) &&
+           !content_hash_write_overlaps(s, offset, bytes);
+
+    ret = bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                              flags);
+    if (ret < 0 || !fill) {
+        return ret;
+    }
+
+    content_hash_co_update(bs, offset, bytes, qiov, qiov_offset,
+                           content_hash_read_valid, &check);
+    return 0;
+}
+
+static int coroutine_fn content_hash_co_pwritev_part(BlockDriverState *bs,
+                                                     uint64_t offset,
+                                                     uint64_t bytes,
+                                                     QEMUIOVector *qiov,
+                                                     size_t qiov_offset,
+                                                     int flags)
+{
+    BDRVContentHashState *s = bs->opaque;
+    ContentHashWrite req;
+    int ret;
+
+    content_hash_write_begin(s, &req, offset, bytes);
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    if (ret >= 0) {
+        content_hash_co_update(bs, offset, bytes, qiov, qiov_offset,
+                               content_hash_write_valid, &req);
+    }
+    content_hash_write_end(s, &req);
+
+    return ret;
+}
+
+static int coroutine_fn content_hash_co_pwrite_zeroes(BlockDriverState *bs,
+                                                      int64_t offset, int bytes,
+                                                      BdrvRequestFlags flags)
+{
+    BDRVContentHashState *s = bs->opaque;
+    ContentHashWrite req;
+    uint64_t first, end, block;
+    int ret;
+
+    content_hash_write_begin(s, &req, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    if (ret >= 0 && !req.conflict &&
+        content_hash_whole_blocks(s, offset, bytes, &first, &end))
+    {
+        /* zero_hash only applies to blocks of full size */
+        if (end << s->block_bits > s->origin_size) {
+            end--;
+        }
+        for (block = first; block < end; block++) {
+            memcpy(content_hash_entry(s, block), s->zero_hash,
+                   BDRV_CONTENT_HASH_SIZE);
+        }
+    }
+    content_hash_write_end(s, &req);
+
+    return ret;
+}
+
+static int coroutine_fn content_hash_co_pdiscard(BlockDriverState *bs,
+                                                 int64_t offset, int bytes)
+{
+    BDRVContentHashState *s = bs->opaque;
+    ContentHashWrite req;
+    int ret;
+
+    /* Discarded data may read back as anything, so its hash is unknown */
+    content_hash_write_begin(s, &req, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    content_hash_write_end(s, &req);
+
+    return ret;
+}
+
+static int coroutine_fn content_hash_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static const char *const content_hash_strong_runtime_opts[] = {
+    CONTENT_HASH_OPT_BLOCK_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_content_hash = {
+    .format_name            = "content-hash",
+    .instance_size          = sizeof(BDRVContentHashState),
+
+    .bdrv_open              = content_hash_open,
+    .bdrv_close             = content_hash_close,
+    .bdrv_getlength         = content_hash_getlength,
+    .bdrv_child_perm        = content_hash_child_perm,
+    .bdrv_reopen_prepare    = content_hash_reopen_prepare,
+    .bdrv_inactivate        = content_hash_inactivate,
+    .bdrv_co_invalidate_cache = content_hash_co_invalidate_cache,
+    .bdrv_get_content_hash  = content_hash_get_content_hash,
+
+    .bdrv_co_preadv_part    = content_hash_co_preadv_part,
+    .bdrv_co_pwritev_part   = content_hash_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes  = content_hash_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = content_hash_co_pdiscard,
+    .bdrv_co_flush          = content_hash_co_flush,
+    .bdrv_co_block_status   = bdrv_co_block_status_from_file,
+
+    .is_filter              = true,
+    .strong_runtime_opts    = content_hash_strong_runtime_opts,
+};
+
+static void bdrv_content_hash_init(void)
+{
+    bdrv_register(&bdrv_content_hash);
+}
+
+block_init(bdrv_content_hash_init);
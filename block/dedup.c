@@ -0,0 +1,1301 @@
+/*
+ * Deduplicating block driver
+ *
+ * Stores every cluster of guest data only once: clusters with the same
+ * content share one host cluster, which is found through an index of
+ * content fingerprints.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "block/thread-pool.h"
+#include "crypto/hash.h"
+#include "migration/blocker.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "trace.h"
+
+/*
+ * On-disk format
+ *
+ * Data clusters are stored in the file child, which is nothing but an array
+ * of host clusters.  The map-file child starts with a header of
+ * DEDUP_HEADER_SIZE bytes (the DedupHeader below, zero padded), followed by
+ * the map at @map_offset: one entry per guest cluster, holding the index of
+ * the host cluster that stores its data plus one, or 0 if the guest cluster
+ * reads as zeroes.
+ *
+ * Reference counts are not stored; they are the number of map entries that
+ * point to a host cluster and are counted when the image is opened.  Host
+ * clusters without a reference are free.
+ *
+ * The size in the header is only updated on flush.  Map entries beyond it
+ * are written by requests that grew the image, so the size is extended to
+ * cover them when the image is opened.
+ *
+ * All fields are big-endian.
+ */
+
+#define DEDUP_MAGIC                 0x5144454455504d50ULL /* "QDEDUPMP" */
+#define DEDUP_VERSION               1
+#define DEDUP_HEADER_SIZE           4096
+
+typedef struct DedupHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t size;
+    uint64_t map_offset;
+} QEMU_PACKED DedupHeader;
+
+/* End of disk format structures. */
+
+#define DEDUP_DEFAULT_CLUSTER_SIZE  (64 * KiB)
+#define DEDUP_MIN_CLUSTER_SIZE      (4 * KiB)
+#define DEDUP_MAX_CLUSTER_SIZE      (2 * MiB)
+
+/* Limits the memory used for the map, which is kept in memory */
+#define DEDUP_MAX_MAP_ENTRIES       (128 * MiB)
+
+#define DEDUP_HASH_SIZE             32
+
+/* Fingerprint index entries are grouped into sets of this many */
+#define DEDUP_INDEX_WAYS            8
+#define DEDUP_DEFAULT_INDEX_SIZE    (64 * 1024)
+#define DEDUP_MAX_INDEX_SIZE        (64 * 1024 * 1024)
+
+#define DEDUP_NO_SLOT               UINT32_MAX
+
+#define DEDUP_OPT_CLUSTER_SIZE      "cluster-size"
+#define DEDUP_OPT_INDEX_SIZE        "index-size"
+
+typedef struct DedupIndexEntry {
+    uint8_t hash[DEDUP_HASH_SIZE];
+    /* Host cluster plus one, or 0 if the entry is unused */
+    uint64_t host_cluster;
+    /* Time of the last hit, for eviction */
+    uint64_t stamp;
+} DedupIndexEntry;
+
+typedef struct BDRVDedupState {
+    BdrvChild *map_file;
+
+    uint32_t cluster_size;
+    int cluster_bits;
+    uint64_t size;
+    bool header_dirty;
+    uint64_t map_offset;
+
+    /* Guest cluster -> host cluster plus one, nb_clusters entries */
+    uint64_t *map;
+    uint64_t nb_clusters;
+
+    /* Per host cluster, nb_host_clusters entries */
+    uint32_t *refcount;
+    uint32_t *index_slot;
+    /* Reads from the host cluster that are in flight */
+    uint32_t *readers;
+    uint64_t nb_host_clusters;
+    uint64_t host_clusters_alloc;
+
+    /*
+     * Unreferenced host clusters.  Clusters that lost their last reference
+     * are kept in pending_free until the map change is stable on disk, and
+     * then in busy_free until the last read that may still use them is done.
+     */
+    GArray *free_clusters;
+    GArray *pending_free;
+    GArray *busy_free;
+
+    /* Bounded fingerprint index: hash -> host cluster */
+    DedupIndexEntry *index;
+    uint32_t index_sets;
+    uint64_t index_clock;
+
+    uint8_t zero_hash[DEDUP_HASH_SIZE];
+
+    /* Protects all of the metadata across yields */
+    CoMutex lock;
+
+    Error *migration_blocker;
+} BDRVDedupState;
+
+static QemuOptsList runtime_opts = {
+    .name = "dedup",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = DEDUP_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Deduplication granularity of a new image",
+        },
+        {
+            .name = DEDUP_OPT_INDEX_SIZE,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of fingerprints kept in memory",
+        },
+        { /* end of list */ }
+    },
+};
+
+static DedupIndexEntry *dedup_index_set(BDRVDedupState *s,
+                                        const uint8_t *hash)
+{
+    return &s->index[(ldq_he_p(hash) & (s->index_sets - 1)) *
+                     DEDUP_INDEX_WAYS];
+}
+
+static void dedup_index_remove(BDRVDedupState *s, uint64_t host_cluster)
+{
+    uint32_t slot = s->index_slot[host_cluster];
+
+    if (slot != DEDUP_NO_SLOT) {
+        s->index[slot].host_cluster = 0;
+        s->index_slot[host_cluster] = DEDUP_NO_SLOT;
+    }
+}
+
+/* Returns the host cluster plus one that holds data with @hash, or 0 */
+static uint64_t dedup_index_lookup(BDRVDedupState *s, const uint8_t *hash)
+{
+    DedupIndexEntry *set = dedup_index_set(s, hash);
+    int i;
+
+    for (i = 0; i < DEDUP_INDEX_WAYS; i++) {
+        if (set[i].host_cluster &&
+            !memcmp(set[i].hash, hash, DEDUP_HASH_SIZE))
+        {
+            set[i].stamp = ++s->index_clock;
+            return set[i].host_cluster;
+        }
+    }
+    return 0;
+}
+
+/* Record that @host_cluster holds data with @hash, evicting the LRU entry */
+static void dedup_index_insert(BDRVDedupState *s, const uint8_t *hash,
+                               uint64_t host_cluster)
+{
+    DedupIndexEntry *set = dedup_index_set(s, hash);
+    DedupIndexEntry *victim = &set[0];
+    int i;
+
+    dedup_index_remove(s, host_cluster);
+
+    for (i = 0; i < DEDUP_INDEX_WAYS; i++) {
+        if (!set[i].host_cluster) {
+            victim = &set[i];
+            break;
+        }
+        if (set[i].stamp < victim->stamp) {
+            victim = &set[i];
+        }
+    }
+
+    if (victim->host_cluster) {
+        trace_dedup_index_evict(s, victim->host_cluster - 1);
+        s->index_slot[victim->host_cluster - 1] = DEDUP_NO_SLOT;
+    }
+
+    memcpy(victim->hash, hash, DEDUP_HASH_SIZE);
+    victim->host_cluster = host_cluster + 1;
+    victim->stamp = ++s->index_clock;
+    s->index_slot[host_cluster] = victim - s->index;
+}
+
+static int dedup_grow_host_clusters(BDRVDedupState *s, uint64_t nb)
+{
+    uint64_t alloc = s->host_clusters_alloc;
+    uint32_t *refcount, *index_slot, *readers;
+
+    if (nb <= alloc) {
+        return 0;
+    }
+
+    alloc = MAX(nb, alloc * 2);
+    refcount = g_try_renew(uint32_t, s->refcount, alloc);
+    if (!refcount) {
+        return -ENOMEM;
+    }
+    s->refcount = refcount;
+    index_slot = g_try_renew(uint32_t, s->index_slot, alloc);
+    if (!index_slot) {
+        return -ENOMEM;
+    }
+    s->index_slot = index_slot;
+    readers = g_try_renew(uint32_t, s->readers, alloc);
+    if (!readers) {
+        return -ENOMEM;
+    }
+    s->readers = readers;
+
+    memset(s->refcount + s->host_clusters_alloc, 0,
+           (alloc - s->host_clusters_alloc) * sizeof(uint32_t));
+    memset(s->readers + s->host_clusters_alloc, 0,
+           (alloc - s->host_clusters_alloc) * sizeof(uint32_t));
+    memset(s->index_slot + s->host_clusters_alloc, 0xff,
+           (alloc - s->host_clusters_alloc) * sizeof(uint32_t));
+    s->host_clusters_alloc = alloc;
+
+    return 0;
+}
+
+static int dedup_grow_map(BDRVDedupState *s, uint64_t nb_clusters)
+{
+    uint64_t *map;
+
+    if (nb_clusters <= s->nb_clusters) {
+        return 0;
+    }
+    if (nb_clusters > DEDUP_MAX_MAP_ENTRIES) {
+        return -EFBIG;
+    }
+
+    map = g_try_renew(uint64_t, s->map, nb_clusters);
+    if (!map) {
+        return -ENOMEM;
+    }
+    memset(map + s->nb_clusters, 0,
+           (nb_clusters - s->nb_clusters) * sizeof(uint64_t));
+    s->map = map;
+    s->nb_clusters = nb_clusters;
+
+    return 0;
+}
+
+/* Returns a host cluster with no references */
+static int dedup_alloc_cluster(BDRVDedupState *s, uint64_t *host_cluster)
+{
+    int ret;
+
+    if (s->free_clusters->len) {
+        *host_cluster = g_array_index(s->free_clusters, uint64_t,
+                                      s->free_clusters->len - 1);
+        g_array_set_size(s->free_clusters, s->free_clusters->len - 1);
+        return 0;
+    }
+
+    ret = dedup_grow_host_clusters(s, s->nb_host_clusters + 1);
+    if (ret < 0) {
+        return ret;
+    }
+    *host_cluster = s->nb_host_clusters++;
+    return 0;
+}
+
+static void dedup_unref_cluster(BDRVDedupState *s, uint64_t host_cluster)
+{
+    assert(s->refcount[host_cluster] > 0);
+    if (--s->refcount[host_cluster] == 0) {
+        dedup_index_remove(s, host_cluster);
+        g_array_append_val(s->pending_free, host_cluster);
+    }
+}
+
+/*
+ * Whether @host_cluster may be overwritten in place: only one guest cluster
+ * maps to it, and no read is using it.  Reads look up s->map without
+ * s->lock, so a read of a guest cluster that shared @host_cluster until
+ * recently may still be in flight and must not see the new data.
+ */
+static bool dedup_can_overwrite(BDRVDedupState *s, uint64_t host_cluster)
+{
+    return s->refcount[host_cluster] == 1 && !s->readers[host_cluster];
+}
+
+/*
+ * Make @host_cluster available for allocation if it is unreferenced on disk
+ * and no read uses it any more.
+ */
+static void dedup_release_busy_cluster(BDRVDedupState *s,
+                                       uint64_t host_cluster)
+{
+    guint i;
+
+    for (i = 0; i < s->busy_free->len; i++) {
+        if (g_array_index(s->busy_free, uint64_t, i) == host_cluster) {
+            g_array_remove_index_fast(s->busy_free, i);
+            g_array_append_val(s->free_clusters, host_cluster);
+            return;
+        }
+    }
+}
+
+static int coroutine_fn dedup_co_write_map_entries(BlockDriverState *bs,
+                                                   uint64_t first,
+                                                   uint64_t nb)
+{
+    BDRVDedupState *s = bs->opaque;
+    g_autofree uint64_t *buf = g_new(uint64_t, nb);
+    uint64_t i;
+
+    for (i = 0; i < nb; i++) {
+        buf[i] = cpu_to_be64(s->map[first + i]);
+    }
+
+    return bdrv_co_pwrite(s->map_file, s->map_offset + first * sizeof(*buf),
+                          nb * sizeof(*buf), buf, 0);
+}
+
+/*
+ * Point guest cluster @cluster to @new (a host cluster plus one, or 0) and
+ * drop the reference to the host cluster it used before.  The caller must
+ * have taken the reference to @new.
+ */
+static int coroutine_fn dedup_co_set_map(BlockDriverState *bs,
+                                         uint64_t cluster, uint64_t new)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t old = s->map[cluster];
+    int ret;
+
+    s->map[cluster] = new;
+    ret = dedup_co_write_map_entries(bs, cluster, 1);
+    if (ret < 0) {
+        s->map[cluster] = old;
+        return ret;
+    }
+
+    if (old) {
+        dedup_unref_cluster(s, old - 1);
+    }
+    return 0;
+}
+
+typedef struct DedupHashTask {
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    size_t bytes;
+    uint8_t *hash;
+} DedupHashTask;
+
+static int dedup_hash_task_func(void *opaque)
+{
+    DedupHashTask *t = opaque;
+    QEMUIOVector slice;
+    g_autofree uint8_t *digest = NULL;
+    size_t digest_len = 0;
+    int ret;
+
+    qemu_iovec_init_slice(&slice, t->qiov, t->qiov_offset, t->bytes);
+    ret = qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256, slice.iov, slice.niov,
+                              &digest, &digest_len, NULL);
+    qemu_iovec_destroy(&slice);
+    if (ret < 0) {
+        return -EIO;
+    }
+
+    memcpy(t->hash, digest, DEDUP_HASH_SIZE);
+    return 0;
+}
+
+/* Hash one cluster of data at @qiov_offset in @qiov in a worker thread */
+static int coroutine_fn dedup_co_hash(BlockDriverState *bs,
+                                      QEMUIOVector *qiov, size_t qiov_offset,
+                                      uint8_t *hash)
+{
+    BDRVDedupState *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    DedupHashTask task = {
+        .qiov           = qiov,
+        .qiov_offset    = qiov_offset,
+        .bytes          = s->cluster_size,
+        .hash           = hash,
+    };
+
+    return thread_pool_submit_co(pool, dedup_hash_task_func, &task);
+}
+
+/*
+ * Store a whole cluster of data with @hash from @qiov at @qiov_offset as
+ * guest cluster @cluster: drop it if it is all zeroes, share a host cluster
+ * with the same content, overwrite the current host cluster if nothing else
+ * uses it (see dedup_can_overwrite()), or allocate a new one.  Called with
+ * s->lock held.
+ */
+static int coroutine_fn dedup_co_store_cluster(BlockDriverState *bs,
+                                               uint64_t cluster,
+                                               const uint8_t *hash,
+                                               QEMUIOVector *qiov,
+                                               size_t qiov_offset)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t old = s->map[cluster];
+    uint64_t host_cluster, dup;
+    int ret;
+
+    if (!memcmp(hash, s->zero_hash, DEDUP_HASH_SIZE)) {
+        trace_dedup_store(s, cluster, 0, "zero");
+        return old ? dedup_co_set_map(bs, cluster, 0) : 0;
+    }
+
+    dup = dedup_index_lookup(s, hash);
+    if (dup && s->refcount[dup - 1] < UINT32_MAX) {
+        trace_dedup_store(s, cluster, dup - 1, "shared");
+        if (dup == old) {
+            return 0;
+        }
+        s->refcount[dup - 1]++;
+        ret = dedup_co_set_map(bs, cluster, dup);
+        if (ret < 0) {
+            dedup_unref_cluster(s, dup - 1);
+        }
+        return ret;
+    }
+
+    if (old && dedup_can_overwrite(s, old - 1)) {
+        host_cluster = old - 1;
+        trace_dedup_store(s, cluster, host_cluster, "in place");
+
+        dedup_index_remove(s, host_cluster);
+        ret = bdrv_co_pwritev_part(bs->file,
+                                   host_cluster << s->cluster_bits,
+                                   s->cluster_size, qiov, qiov_offset, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        dedup_index_insert(s, hash, host_cluster);
+        return 0;
+    }
+
+    ret = dedup_alloc_cluster(s, &host_cluster);
+    if (ret < 0) {
+        return ret;
+    }
+    trace_dedup_store(s, cluster, host_cluster, "new");
+
+    ret = bdrv_co_pwritev_part(bs->file, host_cluster << s->cluster_bits,
+                               s->cluster_size, qiov, qiov_offset, 0);
+    if (ret >= 0) {
+        s->refcount[host_cluster] = 1;
+        ret = dedup_co_set_map(bs, cluster, host_cluster + 1);
+        if (ret < 0) {
+            s->refcount[host_cluster] = 0;
+        }
+    }
+    if (ret < 0) {
+        /* Never referenced on disk, so it can be reused right away */
+        g_array_append_val(s->free_clusters, host_cluster);
+        return ret;
+    }
+
+    dedup_index_insert(s, hash, host_cluster);
+    return 0;
+}
+
+/*
+ * Write @bytes at @offset_in_cluster of guest cluster @cluster.  Partial
+ * writes to a host cluster that may be overwritten go straight to it; other
+ * partial writes merge the old content into a bounce buffer first.
+ */
+static int coroutine_fn dedup_co_write_cluster(BlockDriverState *bs,
+                                               uint64_t cluster,
+                                               uint64_t offset_in_cluster,
+                                               uint64_t bytes,
+                                               QEMUIOVector *qiov,
+                                               size_t qiov_offset)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint8_t hash[DEDUP_HASH_SIZE];
+    uint8_t *buf = NULL;
+    QEMUIOVector bounce_qiov;
+    uint64_t old;
+    int ret;
+
+    if (bytes == s->cluster_size) {
+        /* Hash outside of the lock, that's the expensive part */
+        ret = dedup_co_hash(bs, qiov, qiov_offset, hash);
+        if (ret < 0) {
+            return ret;
+        }
+
+        qemu_co_mutex_lock(&s->lock);
+        ret = dedup_co_store_cluster(bs, cluster, hash, qiov, qiov_offset);
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    old = s->map[cluster];
+    if (old && dedup_can_overwrite(s, old - 1)) {
+        dedup_index_remove(s, old - 1);
+        ret = bdrv_co_pwritev_part(bs->file,
+                                   ((old - 1) << s->cluster_bits) +
+                                   offset_in_cluster,
+                                   bytes, qiov, qiov_offset, 0);
+        goto out;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (old) {
+        ret = bdrv_co_pread(bs->file, (old - 1) << s->cluster_bits,
+                            s->cluster_size, buf, 0);
+        if (ret < 0) {
+            goto out;
+        }
+    } else {
+        memset(buf, 0, s->cluster_size);
+    }
+    qemu_iovec_to_buf(qiov, qiov_offset, buf + offset_in_cluster, bytes);
+
+    qemu_iovec_init_buf(&bounce_qiov, buf, s->cluster_size);
+    ret = dedup_co_hash(bs, &bounce_qiov, 0, hash);
+    if (ret >= 0) {
+        ret = dedup_co_store_cluster(bs, cluster, hash, &bounce_qiov, 0);
+    }
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_vfree(buf);
+    return ret;
+}
+
+/* Extend the image to @size if a write goes beyond its end */
+static int coroutine_fn dedup_co_grow(BlockDriverState *bs, uint64_t size)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret;
+
+    if (size <= s->size) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = dedup_grow_map(s, DIV_ROUND_UP(size, s->cluster_size));
+    if (ret >= 0 && size > s->size) {
+        s->size = size;
+        s->header_dirty = true;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn dedup_co_preadv_part(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov,
+                                             size_t qiov_offset, int flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret = 0;
+
+    while (bytes) {
+        uint64_t cluster = offset >> s->cluster_bits;
+        uint64_t offset_in_cluster = offset & (s->cluster_size - 1);
+        uint64_t cur_bytes = MIN(bytes, s->cluster_size - offset_in_cluster);
+        uint64_t host_cluster = 0;
+
+        if (cluster < s->nb_clusters) {
+            host_cluster = s->map[cluster];
+        }
+
+        if (!host_cluster) {
+            qemu_iovec_memset(qiov, qiov_offset, 0, cur_bytes);
+        } else {
+            s->readers[host_cluster - 1]++;
+            BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+            ret = bdrv_co_preadv_part(bs->file,
+                                      ((host_cluster - 1) << s->cluster_bits) +
+                                      offset_in_cluster,
+                                      cur_bytes, qiov, qiov_offset, 0);
+            if (--s->readers[host_cluster - 1] == 0 &&
+                !s->refcount[host_cluster - 1])
+            {
+                dedup_release_busy_cluster(s, host_cluster - 1);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn dedup_co_pwritev_part(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset, int flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret;
+
+    ret = dedup_co_grow(bs, offset + bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (bytes) {
+        uint64_t cluster = offset >> s->cluster_bits;
+        uint64_t offset_in_cluster = offset & (s->cluster_size - 1);
+        uint64_t cur_bytes = MIN(bytes, s->cluster_size - offset_in_cluster);
+
+        ret = dedup_co_write_cluster(bs, cluster, offset_in_cluster,
+                                     cur_bytes, qiov, qiov_offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    return 0;
+}
+
+/*
+ * Make guest clusters [first, end) read as zeroes, updating the map with as
+ * few writes as possible.  Called with s->lock held.
+ */
+static int coroutine_fn dedup_co_unmap_clusters(BlockDriverState *bs,
+                                                uint64_t first, uint64_t end)
+{
+    BDRVDedupState *s = bs->opaque;
+    g_autofree uint64_t *old = NULL;
+    uint64_t i, nb;
+    int ret;
+
+    if (first >= end) {
+        return 0;
+    }
+    while (first < end && !s->map[first]) {
+        first++;
+    }
+    while (end > first && !s->map[end - 1]) {
+        end--;
+    }
+    if (first == end) {
+        return 0;
+    }
+
+    nb = end - first;
+    old = g_try_new(uint64_t, nb);
+    if (!old) {
+        return -ENOMEM;
+    }
+    memcpy(old, s->map + first, nb * sizeof(uint64_t));
+    memset(s->map + first, 0, nb * sizeof(uint64_t));
+
+    ret = dedup_co_write_map_entries(bs, first, nb);
+    if (ret < 0) {
+        memcpy(s->map + first, old, nb * sizeof(uint64_t));
+        return ret;
+    }
+
+    for (i = 0; i < nb; i++) {
+        if (old[i]) {
+            dedup_unref_cluster(s, old[i] - 1);
+        }
+    }
+    return 0;
+}
+
+/* Unmap the whole clusters in [offset, offset + bytes) */
+static int coroutine_fn dedup_co_unmap(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t bytes)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t first = DIV_ROUND_UP(offset, s->cluster_size);
+    uint64_t end = MIN((offset + bytes) >> s->cluster_bits, s->nb_clusters);
+    int ret;
+
+    /* The tail of the last cluster counts if the request reaches EOF */
+    if (offset + bytes >= s->size) {
+        end = s->nb_clusters;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = dedup_co_unmap_clusters(bs, first, end);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn dedup_co_pwrite_zeroes(BlockDriverState *bs,
+                                               int64_t offset, int bytes,
+                                               BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t head, tail;
+    g_autofree uint8_t *zeroes = NULL;
+    QEMUIOVector qiov;
+    int ret;
+
+    ret = dedup_co_grow(bs, offset + bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Whole clusters are dropped, partial ones are written as data */
+    head = MIN(bytes, ROUND_UP(offset, s->cluster_size) - offset);
+    tail = (offset + bytes) & (s->cluster_size - 1);
+    if (head == bytes || offset + bytes >= s->size) {
+        tail = 0;
+    }
+
+    if (head || tail) {
+        zeroes = g_malloc0(s->cluster_size);
+    }
+    if (head) {
+        qemu_iovec_init_buf(&qiov, zeroes, head);
+        ret = dedup_co_pwritev_part(bs, offset, head, &qiov, 0, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (tail) {
+        qemu_iovec_init_buf(&qiov, zeroes, tail);
+        ret = dedup_co_pwritev_part(bs, offset + bytes - tail, tail, &qiov, 0,
+                                    0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return dedup_co_unmap(bs, offset + head, bytes - head - tail);
+}
+
+static int coroutine_fn dedup_co_pdiscard(BlockDriverState *bs,
+                                          int64_t offset, int bytes)
+{
+    /* Discarding only part of a cluster is a no-op */
+    return dedup_co_unmap(bs, offset, bytes);
+}
+
+static int coroutine_fn dedup_co_write_header(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    g_autofree uint8_t *buf = g_malloc0(DEDUP_HEADER_SIZE);
+    DedupHeader *header = (DedupHeader *)buf;
+    int ret;
+
+    *header = (DedupHeader) {
+        .magic          = cpu_to_be64(DEDUP_MAGIC),
+        .version        = cpu_to_be32(DEDUP_VERSION),
+        .cluster_size   = cpu_to_be32(s->cluster_size),
+        .size           = cpu_to_be64(s->size),
+        .map_offset     = cpu_to_be64(s->map_offset),
+    };
+
+    ret = bdrv_co_pwrite(s->map_file, 0, DEDUP_HEADER_SIZE, buf, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->header_dirty = false;
+    return 0;
+}
+
+static int coroutine_fn dedup_co_flush(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t host_cluster;
+    guint i;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    /* The map must not point to data that could still be lost */
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (s->header_dirty) {
+        ret = dedup_co_write_header(bs);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_co_flush(s->map_file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Clusters freed so far are now unreferenced on disk, too */
+    for (i = 0; i < s->pending_free->len; i++) {
+        host_cluster = g_array_index(s->pending_free, uint64_t, i);
+        if (s->readers[host_cluster]) {
+            g_array_append_val(s->busy_free, host_cluster);
+        } else {
+            g_array_append_val(s->free_clusters, host_cluster);
+        }
+    }
+    g_array_set_size(s->pending_free, 0);
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static int coroutine_fn dedup_co_truncate(BlockDriverState *bs, int64_t offset,
+                                          bool exact, PreallocMode prealloc,
+                                          Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t nb_clusters = DIV_ROUND_UP(offset, s->cluster_size);
+    uint64_t tail;
+    int ret;
+
+    if (prealloc != PREALLOC_MODE_OFF) {
+        error_setg(errp, "Unsupported preallocation mode '%s'",
+                   PreallocMode_str(prealloc));
+        return -ENOTSUP;
+    }
+
+    if (offset >= s->size) {
+        ret = dedup_co_grow(bs, offset);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to grow the image");
+        }
+        return ret;
+    }
+
+    /* Whatever is left of the last cluster must read as zeroes if regrown */
+    tail = offset & (s->cluster_size - 1);
+    if (tail) {
+        ret = dedup_co_pwrite_zeroes(bs, offset,
+                                     MIN(s->cluster_size - tail,
+                                         s->size - offset), 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to zero the tail cluster");
+            return ret;
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = dedup_co_unmap_clusters(bs, nb_clusters, s->nb_clusters);
+    if (ret >= 0) {
+        s->nb_clusters = nb_clusters;
+        s->size = offset;
+        ret = dedup_co_write_header(bs);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to shrink the image");
+    }
+    return ret;
+}
+
+static int coroutine_fn dedup_co_block_status(BlockDriverState *bs,
+                                              bool want_zero, int64_t offset,
+                                              int64_t bytes, int64_t *pnum,
+                                              int64_t *map,
+                                              BlockDriverState **file)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t cluster = offset >> s->cluster_bits;
+    uint64_t end = offset + bytes;
+    uint64_t next = (cluster + 1) << s->cluster_bits;
+    bool allocated;
+
+    allocated = cluster < s->nb_clusters && s->map[cluster];
+    for (cluster++; next < end; cluster++, next += s->cluster_size) {
+        if ((cluster < s->nb_clusters && s->map[cluster]) != allocated) {
+            break;
+        }
+    }
+    *pnum = MIN(next, end) - offset;
+
+    /* Shared clusters have no offset that could be written to directly */
+    return allocated ? BDRV_BLOCK_DATA : BDRV_BLOCK_ZERO;
+}
+
+static int dedup_load(BlockDriverState *bs, QemuOpts *opts, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupHeader header;
+    g_autofree uint64_t *entries = NULL;
+    int64_t map_file_size, file_size;
+    uint64_t cluster_size, nb_entries, i;
+    int ret;
+
+    map_file_size = bdrv_getlength(s->map_file->bs);
+    if (map_file_size < 0) {
+        error_setg_errno(errp, -map_file_size, "Could not get map size");
+        return map_file_size;
+    }
+
+    /* An empty (or zeroed) map file is a new image */
+    ret = bdrv_pread(s->map_file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read map header");
+        return ret;
+    }
+
+    if (!header.magic) {
+        cluster_size = qemu_opt_get_size(opts, DEDUP_OPT_CLUSTER_SIZE,
+                                         DEDUP_DEFAULT_CLUSTER_SIZE);
+        if (!is_power_of_2(cluster_size) ||
+            cluster_size < DEDUP_MIN_CLUSTER_SIZE ||
+            cluster_size > DEDUP_MAX_CLUSTER_SIZE)
+        {
+            error_setg(errp, "Cluster size must be a power of two between "
+                       "%u and %u", (unsigned) DEDUP_MIN_CLUSTER_SIZE,
+                       (unsigned) DEDUP_MAX_CLUSTER_SIZE);
+            return -EINVAL;
+        }
+        s->cluster_size = cluster_size;
+        s->map_offset = DEDUP_HEADER_SIZE;
+        s->header_dirty = bdrv_is_writable(bs);
+        nb_entries = 0;
+    } else {
+        if (be64_to_cpu(header.magic) != DEDUP_MAGIC) {
+            error_setg(errp, "Map file is not a dedup map");
+            return -EINVAL;
+        }
+        if (be32_to_cpu(header.version) != DEDUP_VERSION) {
+            error_setg(errp, "Unsupported dedup map version %" PRIu32,
+                       be32_to_cpu(header.version));
+            return -ENOTSUP;
+        }
+
+        cluster_size = be32_to_cpu(header.cluster_size);
+        s->map_offset = be64_to_cpu(header.map_offset);
+        s->size = be64_to_cpu(header.size);
+        if (!is_power_of_2(cluster_size) ||
+            cluster_size < DEDUP_MIN_CLUSTER_SIZE ||
+            cluster_size > DEDUP_MAX_CLUSTER_SIZE ||
+            s->map_offset < DEDUP_HEADER_SIZE ||
+            !QEMU_IS_ALIGNED(s->map_offset, sizeof(uint64_t)))
+        {
+            error_setg(errp, "Corrupt dedup map header");
+            return -EINVAL;
+        }
+        if (qemu_opt_get(opts, DEDUP_OPT_CLUSTER_SIZE) &&
+            qemu_opt_get_size(opts, DEDUP_OPT_CLUSTER_SIZE, 0) != cluster_size)
+        {
+            error_setg(errp, "Image has a cluster size of %" PRIu64,
+                       cluster_size);
+            return -EINVAL;
+        }
+        s->cluster_size = cluster_size;
+
+        nb_entries = map_file_size > s->map_offset ?
+                     (map_file_size - s->map_offset) / sizeof(uint64_t) : 0;
+        nb_entries = MAX(nb_entries, DIV_ROUND_UP(s->size, cluster_size));
+    }
+    s->cluster_bits = ctz32(s->cluster_size);
+
+    file_size = bdrv_getlength(bs->file->bs);
+    if (file_size < 0) {
+        error_setg_errno(errp, -file_size, "Could not get data file size");
+        return file_size;
+    }
+    s->nb_host_clusters = DIV_ROUND_UP(file_size, s->cluster_size);
+    ret = dedup_grow_host_clusters(s, MAX(s->nb_host_clusters, 1));
+    if (ret < 0) {
+        error_setg(errp, "Could not allocate reference counts");
+        return ret;
+    }
+
+    ret = dedup_grow_map(s, nb_entries);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not allocate the map");
+        return ret;
+    }
+
+    if (nb_entries) {
+        entries = g_try_new(uint64_t, nb_entries);
+        if (!entries) {
+            error_setg(errp, "Could not allocate the map");
+            return -ENOMEM;
+        }
+        /* Entries beyond the end of the map file read as zeroes */
+        ret = bdrv_pread(s->map_file, s->map_offset, entries,
+                         nb_entries * sizeof(uint64_t));
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the map");
+            return ret;
+        }
+    }
+
+    for (i = 0; i < nb_entries; i++) {
+        uint64_t host_cluster = be64_to_cpu(entries[i]);
+
+        if (!host_cluster) {
+            continue;
+        }
+        if (host_cluster > s->nb_host_clusters ||
+            s->refcount[host_cluster - 1] == UINT32_MAX)
+        {
+            error_setg(errp, "Invalid map entry for cluster %" PRIu64, i);
+            return -EINVAL;
+        }
+        s->map[i] = host_cluster;
+        s->refcount[host_cluster - 1]++;
+
+        /* Writes that grew the image may not have updated the size */
+        if (i >= DIV_ROUND_UP(s->size, s->cluster_size)) {
+            s->size = (i + 1) << s->cluster_bits;
+        }
+    }
+
+    /* Allocate from the start of the data file first */
+    for (i = s->nb_host_clusters; i > 0; i--) {
+        if (!s->refcount[i - 1]) {
+            uint64_t host_cluster = i - 1;
+            g_array_append_val(s->free_clusters, host_cluster);
+        }
+    }
+
+    trace_dedup_load(s, nb_entries, s->nb_host_clusters,
+                     s->free_clusters->len);
+    return 0;
+}
+
+static int dedup_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    g_autofree uint8_t *zeroes = NULL;
+    g_autofree uint8_t *digest = NULL;
+    size_t digest_len = 0;
+    struct iovec iov;
+    uint64_t index_size;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    s->map_file = bdrv_open_child(NULL, options, "map-file", bs, &child_file,
+                                  false, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    index_size = qemu_opt_get_number(opts, DEDUP_OPT_INDEX_SIZE,
+                                     DEDUP_DEFAULT_INDEX_SIZE);
+    if (index_size < DEDUP_INDEX_WAYS || index_size > DEDUP_MAX_INDEX_SIZE) {
+        ret = -EINVAL;
+        error_setg(errp, "Index size must be between %d and %d",
+                   DEDUP_INDEX_WAYS, DEDUP_MAX_INDEX_SIZE);
+        goto fail;
+    }
+    s->index_sets = pow2floor(index_size / DEDUP_INDEX_WAYS);
+    s->index = g_try_new0(DedupIndexEntry,
+                          s->index_sets * DEDUP_INDEX_WAYS);
+    if (!s->index) {
+        ret = -ENOMEM;
+        error_setg(errp, "Could not allocate the fingerprint index");
+        goto fail;
+    }
+
+    s->free_clusters = g_array_new(false, false, sizeof(uint64_t));
+    s->pending_free = g_array_new(false, false, sizeof(uint64_t));
+    s->busy_free = g_array_new(false, false, sizeof(uint64_t));
+    qemu_co_mutex_init(&s->lock);
+
+    ret = dedup_load(bs, opts, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    zeroes = g_try_malloc0(s->cluster_size);
+    if (!zeroes) {
+        ret = -ENOMEM;
+        error_setg(errp, "Could not allocate memory");
+        goto fail;
+    }
+    iov = (struct iovec) { .iov_base = zeroes, .iov_len = s->cluster_size };
+    if (qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256, &iov, 1, &digest,
+                            &digest_len, errp) < 0)
+    {
+        ret = -EINVAL;
+        goto fail;
+    }
+    memcpy(s->zero_hash, digest, DEDUP_HASH_SIZE);
+
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
+
+    /* The map is kept in memory and not reloaded on the destination */
+    error_setg(&s->migration_blocker, "The dedup format used by node '%s' "
+               "does not support live migration",
+               bdrv_get_device_or_node_name(bs));
+    ret = migrate_add_blocker(s->migration_blocker, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        error_free(s->migration_blocker);
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        if (s->free_clusters) {
+            g_array_free(s->free_clusters, true);
+            g_array_free(s->pending_free, true);
+            g_array_free(s->busy_free, true);
+        }
+        g_free(s->index);
+        g_free(s->map);
+        g_free(s->refcount);
+        g_free(s->index_slot);
+        g_free(s->readers);
+        bdrv_unref_child(bs, s->map_file);
+        s->map_file = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void dedup_close(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+
+    g_array_free(s->free_clusters, true);
+    g_array_free(s->pending_free, true);
+    g_array_free(s->busy_free, true);
+    g_free(s->index);
+    g_free(s->map);
+    g_free(s->refcount);
+    g_free(s->index_slot);
+    g_free(s->readers);
+
+    bdrv_unref_child(bs, s->map_file);
+    s->map_file = NULL;
+}
+
+static int64_t dedup_getlength(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    return s->size;
+}
+
+static int dedup_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bdi->cluster_size = s->cluster_size;
+    bdi->unallocated_blocks_are_zero = true;
+    return 0;
+}
+
+static void dedup_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bs->bl.pdiscard_alignment = s->cluster_size;
+    bs->bl.pwrite_zeroes_alignment = s->cluster_size;
+}
+
+static int dedup_reopen_prepare(BDRVReopenState *reopen_state,
+                                BlockReopenQueue *queue, Error **errp)
+{
+    BDRVDedupState *s = reopen_state->bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t cluster_size, index_size;
+    int ret = 0;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, reopen_state->options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* The cluster size is a property of the image */
+    cluster_size = qemu_opt_get_size(opts, DEDUP_OPT_CLUSTER_SIZE,
+                                     s->cluster_size);
+    if (cluster_size != s->cluster_size) {
+        error_setg(errp, "Cannot change the cluster size of a dedup node");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* The index is not resized on the fly */
+    index_size = qemu_opt_get_number(opts, DEDUP_OPT_INDEX_SIZE,
+                                     DEDUP_DEFAULT_INDEX_SIZE);
+    if (index_size < DEDUP_INDEX_WAYS ||
+        pow2floor(index_size / DEDUP_INDEX_WAYS) != s->index_sets)
+    {
+        error_setg(errp, "Cannot change the index size of a dedup node");
+        ret = -EINVAL;
+    }
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static const char *const dedup_strong_runtime_opts[] = {
+    DEDUP_OPT_CLUSTER_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_dedup = {
+    .format_name            = "dedup",
+    .instance_size          = sizeof(BDRVDedupState),
+
+    .bdrv_file_open         = dedup_open,
+    .bdrv_close             = dedup_close,
+    .bdrv_getlength         = dedup_getlength,
+    .bdrv_get_info          = dedup_get_info,
+    .bdrv_refresh_limits    = dedup_refresh_limits,
+    .bdrv_child_perm        = bdrv_format_default_perms,
+    .bdrv_reopen_prepare    = dedup_reopen_prepare,
+
+    .bdrv_co_preadv_part    = dedup_co_preadv_part,
+    .bdrv_co_pwritev_part   = dedup_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes  = dedup_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = dedup_co_pdiscard,
+    .bdrv_co_flush          = dedup_co_flush,
+    .bdrv_co_truncate       = dedup_co_truncate,
+    .bdrv_co_block_status   = dedup_co_block_status,
+
+    .strong_runtime_opts    = dedup_strong_runtime_opts,
+};
+
+static void bdrv_dedup_init(void)
+{
+    bdrv_register(&bdrv_dedup);
+}
+
+block_init(bdrv_dedup_init);
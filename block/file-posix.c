@@ -157,11 +157,16 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool io_uring_fixed:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring instance that @fd is registered with, if any */
+    LuringState *luring_fixed;
+#endif
     struct {
         uint64_t discard_nb_ok;
         uint64_t discard_nb_failed;
@@ -447,6 +452,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native, io_uring)",
         },
+        {
+            .name = "io-uring-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "use io_uring registered files and buffers "
+                    "(default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -475,6 +486,68 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Register s->fd with the io_uring instance of the node's AioContext, if
+ * fixed files were requested or the instance cannot work without them.  In
+ * the latter case, a failure makes the node fall back to the thread pool.
+ */
+static void raw_luring_register(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    Error *local_err = NULL;
+    LuringState *aio;
+
+    if (!s->use_linux_io_uring || s->fd < 0) {
+        return;
+    }
+    aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    if (!s->io_uring_fixed && !luring_needs_fixed_files(aio)) {
+        return;
+    }
+
+    if (luring_register_file(aio, s->fd, &local_err) < 0) {
+        if (luring_needs_fixed_files(aio)) {
+            /* A plain fd does not work with this SQPOLL ring */
+            error_reportf_err(local_err, "Unable to use linux io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        } else {
+            warn_reportf_err(local_err,
+                             "Not using an io_uring registered file: ");
+        }
+        return;
+    }
+    if (s->io_uring_fixed) {
+        luring_register_ram(aio);
+    }
+    s->luring_fixed = aio;
+}
+
+/* Must be called before s->fd is closed or the AioContext changes */
+static void raw_luring_unregister(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (!s->luring_fixed) {
+        return;
+    }
+    luring_unregister_file(s->luring_fixed, s->fd);
+    if (s->io_uring_fixed) {
+        luring_unregister_ram(s->luring_fixed);
+    }
+    s->luring_fixed = NULL;
+}
+#else
+static void raw_luring_register(BlockDriverState *bs)
+{
+}
+
+static void raw_luring_unregister(BlockDriverState *bs)
+{
+}
+#endif
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -527,6 +600,12 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
 #endif
+    s->io_uring_fixed = qemu_opt_get_bool(opts, "io-uring-fixed", false);
+    if (s->io_uring_fixed && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-fixed requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -618,6 +697,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
         }
+        raw_luring_register(bs);
     }
 #else
     if (s->use_linux_io_uring) {
@@ -1052,8 +1132,10 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+    raw_luring_unregister(state->bs);
     qemu_close(s->fd);
     s->fd = rs->fd;
+    raw_luring_register(state->bs);
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -2038,15 +2120,22 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
         }
+        raw_luring_register(bs);
     }
 #endif
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    raw_luring_unregister(bs);
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
     if (s->fd >= 0) {
+        raw_luring_unregister(bs);
         qemu_close(s->fd);
         s->fd = -1;
     }
@@ -3008,9 +3097,11 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_luring_unregister(bs);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+        raw_luring_register(bs);
     }
     s->perm_change_fd = 0;
 
@@ -3080,6 +3171,20 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
 }
 
+static int raw_get_host_fd(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, int64_t *host_offset)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* Reading through the page cache would defeat cache.direct=on */
+    if (s->needs_alignment || s->fd < 0) {
+        return -ENOTSUP;
+    }
+
+    *host_offset = offset;
+    return s->fd;
+}
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
@@ -3107,10 +3212,12 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3525,10 +3632,12 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3653,6 +3762,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3785,6 +3895,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
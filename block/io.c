@@ -29,12 +29,17 @@
 #include "block/blockjob.h"
 #include "block/blockjob_int.h"
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "qemu/cutils.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "sysemu/replay.h"
 
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
 /* Maximum bounce buffer for copy-on-read and write zeroes, in bytes */
@@ -1699,6 +1704,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     BlockDriverState *bs = child->bs;
     BdrvTrackedRequest req;
     BdrvRequestPadding pad;
+    int64_t lat_start;
     int ret;
 
     trace_bdrv_co_preadv(bs, offset, bytes, flags);
@@ -1729,11 +1735,13 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
 
     bdrv_pad_request(bs, &qiov, &qiov_offset, &offset, &bytes, &pad);
 
+    lat_start = block_node_latency_start(bs->latency_stats);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
     ret = bdrv_aligned_preadv(child, &req, offset, bytes,
                               bs->bl.request_alignment,
                               qiov, qiov_offset, flags);
     tracked_request_end(&req);
+    block_node_latency_done(bs->latency_stats, BLOCK_ACCT_READ, lat_start);
     bdrv_dec_in_flight(bs);
 
     bdrv_padding_destroy(&pad);
@@ -2110,6 +2118,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     BdrvTrackedRequest req;
     uint64_t align = bs->bl.request_alignment;
     BdrvRequestPadding pad;
+    int64_t lat_start;
     int ret;
 
     trace_bdrv_co_pwritev(child->bs, offset, bytes, flags);
@@ -2143,6 +2152,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    lat_start = block_node_latency_start(bs->latency_stats);
     /*
      * Align write if necessary by performing a read-modify-write cycle.
      * Pad qiov with the read parts and be sure to have a tracked request not
@@ -2167,6 +2177,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
 
 out:
     tracked_request_end(&req);
+    block_node_latency_done(bs->latency_stats, BLOCK_ACCT_WRITE, lat_start);
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -2778,6 +2789,7 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 {
     int current_gen;
+    int64_t lat_start;
     int ret = 0;
 
     bdrv_inc_in_flight(bs);
@@ -2787,6 +2799,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         goto early_exit;
     }
 
+    lat_start = block_node_latency_start(bs->latency_stats);
     qemu_co_mutex_lock(&bs->reqs_lock);
     current_gen = atomic_read(&bs->write_gen);
 
@@ -2881,6 +2894,7 @@ out:
     /* Return value is ignored - it's ok if wait queue is empty */
     qemu_co_queue_next(&bs->flush_queue);
     qemu_co_mutex_unlock(&bs->reqs_lock);
+    block_node_latency_done(bs->latency_stats, BLOCK_ACCT_FLUSH, lat_start);
 
 early_exit:
     bdrv_dec_in_flight(bs);
@@ -2927,6 +2941,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
     BdrvTrackedRequest req;
     int max_pdiscard, ret;
     int head, tail, align;
+    int64_t lat_start;
     BlockDriverState *bs = child->bs;
 
     if (!bs || !bs->drv || !bdrv_is_inserted(bs)) {
@@ -2961,6 +2976,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
     tail = (offset + bytes) % align;
 
     bdrv_inc_in_flight(bs);
+    lat_start = block_node_latency_start(bs->latency_stats);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_DISCARD);
 
     ret = bdrv_co_write_req_prepare(child, offset, bytes, &req, 0);
@@ -3031,6 +3047,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
 out:
     bdrv_co_write_req_finish(child, req.offset, req.bytes, &req, ret);
     tracked_request_end(&req);
+    block_node_latency_done(bs->latency_stats, BLOCK_ACCT_UNMAP, lat_start);
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -3321,6 +3338,100 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
                                    bytes, read_flags, write_flags);
 }
 
+int bdrv_get_host_fd(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     int64_t *host_offset)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv || !drv->bdrv_get_host_fd || bs->encrypted ||
+        atomic_read(&bs->copy_on_read) ||
+        atomic_read(&bs->serialising_in_flight) || bs->latency_stats)
+    {
+        return -ENOTSUP;
+    }
+    if (offset < 0 || bytes < 0 || offset > INT64_MAX - bytes) {
+        return -EINVAL;
+    }
+
+    return drv->bdrv_get_host_fd(bs, offset, bytes, host_offset);
+}
+
+#ifdef CONFIG_SENDFILE
+typedef struct BdrvSendfileData {
+    int out_fd;
+    int in_fd;
+    off_t offset;
+    size_t bytes;
+} BdrvSendfileData;
+
+static int bdrv_sendfile_worker(void *opaque)
+{
+    BdrvSendfileData *data = opaque;
+    ssize_t ret;
+
+    do {
+        ret = sendfile(data->out_fd, data->in_fd, &data->offset, data->bytes);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+int coroutine_fn bdrv_co_sendfile(BlockDriverState *bs, int64_t offset,
+                                  int64_t bytes, int out_fd)
+{
+    BdrvTrackedRequest req;
+    BdrvSendfileData data;
+    int64_t host_offset;
+    int ret;
+
+    bytes = MIN(bytes, BDRV_REQUEST_MAX_BYTES);
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_wait_serialising_requests(&req);
+
+    ret = bdrv_get_host_fd(bs, offset, bytes, &host_offset);
+    if (ret < 0) {
+        goto out;
+    }
+
+    data = (BdrvSendfileData) {
+        .out_fd = out_fd,
+        .in_fd  = ret,
+        .offset = host_offset,
+        .bytes  = bytes,
+    };
+
+    /* Reading the host file may block on page cache misses */
+    ret = thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                                bdrv_sendfile_worker, &data);
+
+out:
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+#endif
+
+int bdrv_get_content_hash(BlockDriverState *bs, int64_t offset, uint8_t *hash,
+                          int64_t *pnum)
+{
+    while (bs && bs->drv) {
+        if (bs->drv->bdrv_get_content_hash) {
+            if (offset < 0) {
+                return -EINVAL;
+            }
+            return bs->drv->bdrv_get_content_hash(bs, offset, hash, pnum);
+        }
+        if (!bs->drv->is_filter || !bs->file) {
+            break;
+        }
+        bs = bs->file->bs;
+    }
+
+    return -ENOTSUP;
+}
+
 static void bdrv_parent_cb_resize(BlockDriverState *bs)
 {
     BdrvChild *c;
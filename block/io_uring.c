@@ -16,12 +16,22 @@
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
+#include "exec/cpu-common.h"
+#include "exec/ramlist.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the registered file table, see luring_register_file() */
+#define MAX_FIXED_FILES 64
+
+/* The kernel refuses to register buffers larger than this */
+#define MAX_FIXED_BUF_SIZE (1 * GiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -56,6 +66,36 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /* The ring was created with IORING_SETUP_SQPOLL */
+    bool sqpoll;
+    /* io_uring_params.features reported by the kernel */
+    uint32_t features;
+
+    /*
+     * Registered file table, -1 for unused slots.  Sparse so that files can
+     * be added and removed one at a time.  Protected by AioContext lock.
+     */
+    int *fixed_files;
+    unsigned int nr_fixed_files;
+
+    /*
+     * Guest RAM registered as fixed buffers, split in chunks of at most
+     * MAX_FIXED_BUF_SIZE.  The kernel only allows replacing the whole set,
+     * so it is registered again whenever a RAMBlock comes or goes.
+     *
+     * The buffer index of a chunk is its slot in @fixed_bufs and stays the
+     * same for as long as the RAMBlock exists, so that requests which were
+     * prepared before the set changed still refer to the right memory.  The
+     * slots of removed RAMBlocks point to @fixed_buf_hole until they are
+     * reused.  Protected by AioContext lock.
+     */
+    RAMBlockNotifier ram_notifier;
+    unsigned int ram_users;
+    struct iovec *fixed_bufs;
+    unsigned int nr_fixed_bufs;
+    void *fixed_buf_hole;
+    bool fixed_bufs_registered;
 } LuringState;
 
 /**
@@ -89,7 +129,7 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     trace_luring_resubmit_short_read(s, luringcb, nread);
 
     /* Update read position */
-    luringcb->total_read = nread;
+    luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
     /* Shorten qiov */
@@ -103,9 +143,14 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
                       remaining);
 
     /* Update sqe */
-    luringcb->sqeq.off = nread;
+    luringcb->sqeq.off += nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* The remainder is described by resubmit_qiov, not a fixed buffer */
+        luringcb->sqeq.opcode = IORING_OP_READV;
+        luringcb->sqeq.buf_index = 0;
+    }
 
     luring_resubmit(s, luringcb);
 }
@@ -315,6 +360,39 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/* Return the registered file table slot of @fd, or -1 */
+static int luring_find_fixed_file(LuringState *s, int fd)
+{
+    int i;
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Return the index of the fixed buffer that contains @iov entirely, or -1 */
+static int luring_find_fixed_buf(LuringState *s, const struct iovec *iov)
+{
+    uintptr_t start = (uintptr_t)iov->iov_base;
+    int i;
+
+    for (i = 0; i < s->nr_fixed_bufs; i++) {
+        uintptr_t buf = (uintptr_t)s->fixed_bufs[i].iov_base;
+
+        if (s->fixed_bufs[i].iov_base == s->fixed_buf_hole) {
+            continue;
+        }
+        if (start >= buf &&
+            start + iov->iov_len <= buf + s->fixed_bufs[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -331,15 +409,30 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    struct iovec *iov = luringcb->qiov ? luringcb->qiov->iov : NULL;
+    int file = s->nr_fixed_files ? luring_find_fixed_file(s, fd) : -1;
+    int buf = -1;
+
+    if (s->fixed_bufs_registered && iov && luringcb->qiov->niov == 1) {
+        buf = luring_find_fixed_buf(s, iov);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, iov->iov_base, iov->iov_len,
+                                      offset, buf);
+        } else {
+            io_uring_prep_writev(sqes, fd, iov, luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, iov->iov_base, iov->iov_len,
+                                     offset, buf);
+        } else {
+            io_uring_prep_readv(sqes, fd, iov, luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -349,6 +442,10 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (file >= 0) {
+        sqes->fd = file;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -405,7 +502,232 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+/**
+ * luring_register_file:
+ * @s: AIO state
+ * @fd: file descriptor
+ * @errp: error object
+ *
+ * Add @fd to the registered file table, so that requests on @fd skip the
+ * per-request file lookup in the kernel.  Requests that are already queued
+ * keep using the plain file descriptor.  @fd must be unregistered with
+ * luring_unregister_file() before it is closed.
+ *
+ * Returns: 0 on success, -errno on failure.
+ */
+int luring_register_file(LuringState *s, int fd, Error **errp)
+{
+    int slot, ret, i;
+
+    if (!s->fixed_files) {
+        s->fixed_files = g_new(int, MAX_FIXED_FILES);
+        for (i = 0; i < MAX_FIXED_FILES; i++) {
+            s->fixed_files[i] = -1;
+        }
+        ret = io_uring_register_files(&s->ring, s->fixed_files,
+                                      MAX_FIXED_FILES);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to register io_uring files");
+            g_free(s->fixed_files);
+            s->fixed_files = NULL;
+            return ret;
+        }
+    }
+
+    slot = luring_find_fixed_file(s, -1);
+    if (slot < 0) {
+        error_setg(errp, "Too many files registered with io_uring");
+        return -ENOSPC;
+    }
+    ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to register io_uring file");
+        return ret;
+    }
+
+    s->fixed_files[slot] = fd;
+    s->nr_fixed_files++;
+    trace_luring_register_file(s, fd, slot);
+    return 0;
+}
+
+void luring_unregister_file(LuringState *s, int fd)
+{
+    int unused = -1;
+    int slot;
+
+    if (!s->nr_fixed_files) {
+        return;
+    }
+    slot = luring_find_fixed_file(s, fd);
+    if (slot < 0) {
+        return;
+    }
+    io_uring_register_files_update(&s->ring, slot, &unused, 1);
+    s->fixed_files[slot] = -1;
+    s->nr_fixed_files--;
+    trace_luring_unregister_file(s, fd, slot);
+}
+
+/* Whether the ring can only be used with registered files */
+bool luring_needs_fixed_files(LuringState *s)
+{
+#ifdef IORING_FEAT_SQPOLL_NONFIXED
+    if (s->features & IORING_FEAT_SQPOLL_NONFIXED) {
+        return false;
+    }
+#endif
+    return s->sqpoll;
+}
+
+static void luring_update_fixed_bufs(LuringState *s)
+{
+    int ret;
+
+    if (s->fixed_bufs_registered) {
+        io_uring_unregister_buffers(&s->ring);
+        s->fixed_bufs_registered = false;
+    }
+    if (!s->nr_fixed_bufs) {
+        return;
+    }
+
+    ret = io_uring_register_buffers(&s->ring, s->fixed_bufs,
+                                    s->nr_fixed_bufs);
+    trace_luring_register_buffers(s, s->nr_fixed_bufs, ret);
+    if (ret < 0) {
+        warn_report("io_uring: cannot register guest RAM (%s), "
+                    "using non-fixed buffers", strerror(-ret));
+        return;
+    }
+    s->fixed_bufs_registered = true;
+}
+
+/* Return a free slot in s->fixed_bufs, growing the table if there is none */
+static unsigned int luring_alloc_fixed_buf(LuringState *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nr_fixed_bufs; i++) {
+        if (s->fixed_bufs[i].iov_base == s->fixed_buf_hole) {
+            return i;
+        }
+    }
+    s->fixed_bufs = g_renew(struct iovec, s->fixed_bufs, s->nr_fixed_bufs + 1);
+    return s->nr_fixed_bufs++;
+}
+
+static void luring_add_fixed_bufs(LuringState *s, void *host, size_t size)
+{
+    while (size) {
+        size_t len = MIN(size, MAX_FIXED_BUF_SIZE);
+
+        s->fixed_bufs[luring_alloc_fixed_buf(s)] = (struct iovec) {
+            .iov_base = host,
+            .iov_len = len,
+        };
+        host += len;
+        size -= len;
+    }
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    aio_context_acquire(s->aio_context);
+    luring_add_fixed_bufs(s, host, size);
+    luring_update_fixed_bufs(s);
+    aio_context_release(s->aio_context);
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+    unsigned int i;
+
+    if (!host) {
+        return;
+    }
+
+    aio_context_acquire(s->aio_context);
+
+    /* Do not move the other chunks, their buffer index must not change */
+    for (i = 0; i < s->nr_fixed_bufs; i++) {
+        void *base = s->fixed_bufs[i].iov_base;
+
+        if (base != s->fixed_buf_hole && base >= host && base < host + size) {
+            s->fixed_bufs[i] = (struct iovec) {
+                .iov_base = s->fixed_buf_hole,
+                .iov_len = qemu_real_host_page_size,
+            };
+        }
+    }
+    while (s->nr_fixed_bufs &&
+           s->fixed_bufs[s->nr_fixed_bufs - 1].iov_base == s->fixed_buf_hole) {
+        s->nr_fixed_bufs--;
+    }
+
+    luring_update_fixed_bufs(s);
+    aio_context_release(s->aio_context);
+}
+
+static int luring_add_ram_block(RAMBlock *rb, void *opaque)
+{
+    LuringState *s = opaque;
+    void *host = qemu_ram_get_host_addr(rb);
+
+    if (host) {
+        luring_add_fixed_bufs(s, host, qemu_ram_get_used_length(rb));
+    }
+    return 0;
+}
+
+/**
+ * luring_register_ram:
+ * @s: AIO state
+ *
+ * Register guest RAM as fixed buffers and keep the registration up to date
+ * as RAMBlocks are added and removed.  Single-segment requests that fall in
+ * guest RAM then use IORING_OP_READ_FIXED/IORING_OP_WRITE_FIXED, which saves
+ * pinning the pages on every request.  Calls are reference counted.
+ *
+ * Registered buffers are pinned, so guest RAM must fit in RLIMIT_MEMLOCK;
+ * if it does not, requests keep using non-fixed buffers.
+ */
+void luring_register_ram(LuringState *s)
+{
+    if (s->ram_users++) {
+        return;
+    }
+    /* The kernel does not accept empty buffers, holes use a private page */
+    s->fixed_buf_hole = qemu_memalign(qemu_real_host_page_size,
+                                      qemu_real_host_page_size);
+    s->ram_notifier.ram_block_added = luring_ram_block_added;
+    s->ram_notifier.ram_block_removed = luring_ram_block_removed;
+    ram_block_notifier_add(&s->ram_notifier);
+    qemu_ram_foreach_block(luring_add_ram_block, s);
+    luring_update_fixed_bufs(s);
+}
+
+void luring_unregister_ram(LuringState *s)
+{
+    assert(s->ram_users);
+    if (--s->ram_users) {
+        return;
+    }
+    ram_block_notifier_remove(&s->ram_notifier);
+    g_free(s->fixed_bufs);
+    s->fixed_bufs = NULL;
+    s->nr_fixed_bufs = 0;
+    luring_update_fixed_bufs(s);
+    qemu_vfree(s->fixed_buf_hole);
+    s->fixed_buf_hole = NULL;
+}
+
+LuringState *luring_init(bool sqpoll, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
@@ -413,11 +735,29 @@ LuringState *luring_init(Error **errp)
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
-    if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
-        g_free(s);
-        return NULL;
+    if (sqpoll) {
+        struct io_uring_params p = {
+            .flags = IORING_SETUP_SQPOLL,
+        };
+
+        /* Needs CAP_SYS_ADMIN before Linux 5.11 */
+        rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &p);
+        if (rc == 0) {
+            s->sqpoll = true;
+            s->features = p.features;
+        } else {
+            warn_report("io_uring: cannot use a submission queue polling "
+                        "thread (%s)", strerror(-rc));
+        }
+    }
+
+    if (!s->sqpoll) {
+        rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+        if (rc < 0) {
+            error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+            g_free(s);
+            return NULL;
+        }
     }
 
     ioq_init(&s->io_q);
@@ -427,7 +767,13 @@ LuringState *luring_init(Error **errp)
 
 void luring_cleanup(LuringState *s)
 {
+    if (s->ram_users) {
+        ram_block_notifier_remove(&s->ram_notifier);
+    }
     io_uring_queue_exit(&s->ring);
+    g_free(s->fixed_bufs);
+    qemu_vfree(s->fixed_buf_hole);
+    g_free(s->fixed_files);
     g_free(s);
     trace_luring_cleanup_state(s);
 }
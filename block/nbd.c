@@ -45,6 +45,7 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -86,14 +87,25 @@ typedef struct BDRVNBDState {
 
     /* Connection parameters */
     uint32_t reconnect_delay;
+    uint32_t multi_conn;
     SocketAddress *saddr;
     char *export, *tlscredsid;
     QCryptoTLSCreds *tlscreds;
     const char *hostname;
     char *x_dirty_bitmap;
+
+    /*
+     * Connections that requests are spread across.  conns[0] is the state
+     * in bs->opaque itself.  Additional connections are only opened if the
+     * server advertises NBD_FLAG_CAN_MULTI_CONN; their states share the
+     * connection parameters above with conns[0], which owns them.
+     */
+    struct BDRVNBDState *conns[MAX_NBD_CONNECTIONS];
+    int nb_conns;
+    int next_conn;
 } BDRVNBDState;
 
-static int nbd_client_connect(BlockDriverState *bs, Error **errp);
+static int nbd_client_connect(BDRVNBDState *s, Error **errp);
 
 static void nbd_clear_bdrvstate(BDRVNBDState *s)
 {
@@ -136,17 +148,27 @@ static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
     }
 }
 
+static void nbd_conn_detach_aio_context(BDRVNBDState *s)
+{
+    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+}
+
 static void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i]->ioc) {
+            nbd_conn_detach_aio_context(s->conns[i]);
+        }
+    }
 }
 
 static void nbd_client_attach_aio_context_bh(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = opaque;
+    BlockDriverState *bs = s->bs;
 
     /*
      * The node is still drained, so we know the coroutine has yielded in
@@ -162,49 +184,71 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
                                           AioContext *new_context)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    /*
-     * s->connection_co is either yielded from nbd_receive_reply or from
-     * nbd_co_reconnect_loop()
-     */
-    if (s->state == NBD_CLIENT_CONNECTED) {
-        qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
-    }
+    for (i = 0; i < s->nb_conns; i++) {
+        BDRVNBDState *conn = s->conns[i];
 
-    bdrv_inc_in_flight(bs);
+        if (!conn->connection_co) {
+            /* This connection has failed for good */
+            continue;
+        }
 
-    /*
-     * Need to wait here for the BH to run because the BH must run while the
-     * node is still drained.
-     */
-    aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh, bs);
+        /*
+         * conn->connection_co is either yielded from nbd_receive_reply or
+         * from nbd_co_reconnect_loop()
+         */
+        if (conn->state == NBD_CLIENT_CONNECTED) {
+            qio_channel_attach_aio_context(QIO_CHANNEL(conn->ioc),
+                                           new_context);
+        }
+
+        bdrv_inc_in_flight(bs);
+
+        /*
+         * Need to wait here for the BH to run because the BH must run while
+         * the node is still drained.
+         */
+        aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh,
+                            conn);
+    }
 }
 
 static void coroutine_fn nbd_client_co_drain_begin(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    s->drained = true;
-    if (s->connection_co_sleep_ns_state) {
-        qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
+    for (i = 0; i < s->nb_conns; i++) {
+        BDRVNBDState *conn = s->conns[i];
+
+        conn->drained = true;
+        if (conn->connection_co_sleep_ns_state) {
+            qemu_co_sleep_wake(conn->connection_co_sleep_ns_state);
+        }
     }
 }
 
 static void coroutine_fn nbd_client_co_drain_end(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    s->drained = false;
-    if (s->wait_drained_end) {
-        s->wait_drained_end = false;
-        aio_co_wake(s->connection_co);
+    for (i = 0; i < s->nb_conns; i++) {
+        BDRVNBDState *conn = s->conns[i];
+
+        conn->drained = false;
+        if (conn->wait_drained_end) {
+            conn->wait_drained_end = false;
+            aio_co_wake(conn->connection_co);
+        }
     }
 }
 
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(BDRVNBDState *s)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BlockDriverState *bs = s->bs;
 
     if (s->state == NBD_CLIENT_CONNECTED) {
         /* finish any pending coroutines */
@@ -239,8 +283,17 @@ static bool nbd_client_connecting_wait(BDRVNBDState *s)
     return s->state == NBD_CLIENT_CONNECTING_WAIT;
 }
 
+/* Requests may only be spread across connections to the same export */
+static bool nbd_client_same_export(BDRVNBDState *s, BDRVNBDState *conn)
+{
+    return conn->info.size == s->info.size &&
+           conn->info.flags == s->info.flags;
+}
+
 static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
 {
+    NBDRequest disc = { .type = NBD_CMD_DISC };
+    BDRVNBDState *primary;
     Error *local_err = NULL;
 
     if (!nbd_client_connecting(s)) {
@@ -273,14 +326,14 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
 
     /* Finalize previous connection if any */
     if (s->ioc) {
-        nbd_client_detach_aio_context(s->bs);
+        nbd_conn_detach_aio_context(s);
         object_unref(OBJECT(s->sioc));
         s->sioc = NULL;
         object_unref(OBJECT(s->ioc));
         s->ioc = NULL;
     }
 
-    s->connect_status = nbd_client_connect(s->bs, &local_err);
+    s->connect_status = nbd_client_connect(s, &local_err);
     error_free(s->connect_err);
     s->connect_err = NULL;
     error_propagate(&s->connect_err, local_err);
@@ -290,6 +343,20 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
         return;
     }
 
+    /*
+     * The export may have changed while an additional connection was down.
+     * Drop the connection for good if it no longer matches the first one.
+     */
+    primary = s->bs->opaque;
+    if (s != primary && !nbd_client_same_export(primary, s)) {
+        trace_nbd_client_multi_conn_fail(s->export,
+                                         "export changed on reconnect");
+        nbd_send_request(s->ioc, &disc);
+        s->state = NBD_CLIENT_QUIT;
+        qemu_co_queue_restart_all(&s->free_sema);
+        return;
+    }
+
     /* successfully connected */
     s->state = NBD_CLIENT_CONNECTED;
     qemu_co_queue_restart_all(&s->free_sema);
@@ -410,7 +477,7 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
 
     s->connection_co = NULL;
     if (s->ioc) {
-        nbd_client_detach_aio_context(s->bs);
+        nbd_conn_detach_aio_context(s);
         object_unref(OBJECT(s->sioc));
         s->sioc = NULL;
         object_unref(OBJECT(s->ioc));
@@ -423,11 +490,43 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/*
+ * Pick the connection for a new request: the connected one with the fewest
+ * requests in flight.  The search starts after the connection that was
+ * picked last, so that equally busy connections are used in turn.  If no
+ * connection is up, the first one is returned so that the request goes
+ * through its reconnect logic.
+ */
+static BDRVNBDState *nbd_client_pick_conn(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *best = NULL;
+    int i, best_idx = 0;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        int idx = (s->next_conn + i) % s->nb_conns;
+        BDRVNBDState *conn = s->conns[idx];
+
+        if (conn->state == NBD_CLIENT_CONNECTED &&
+            (!best || conn->in_flight < best->in_flight)) {
+            best = conn;
+            best_idx = idx;
+        }
+    }
+
+    if (!best) {
+        return s;
+    }
+
+    trace_nbd_client_pick_conn(s->export, best_idx, best->in_flight);
+    s->next_conn = (best_idx + 1) % s->nb_conns;
+    return best;
+}
+
+static int nbd_co_send_request(BDRVNBDState *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     int rc, i = -1;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -1128,7 +1227,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_client_pick_conn(bs);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -1139,7 +1238,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     }
 
     do {
-        ret = nbd_co_send_request(bs, request, write_qiov);
+        ret = nbd_co_send_request(s, request, write_qiov);
         if (ret < 0) {
             continue;
         }
@@ -1165,7 +1264,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_client_pick_conn(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -1198,7 +1297,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     }
 
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        ret = nbd_co_send_request(s, &request, NULL);
         if (ret < 0) {
             continue;
         }
@@ -1284,6 +1383,14 @@ static int nbd_client_co_flush(BlockDriverState *bs)
         return 0;
     }
 
+    /*
+     * The block layer only sends a flush after the writes it must cover
+     * have completed.  With several connections open the server has
+     * advertised NBD_FLAG_CAN_MULTI_CONN, which guarantees that a flush on
+     * any connection covers the writes completed on all of them, so it
+     * is enough to send it on one.
+     */
+
     request.from = 0;
     request.len = 0;
 
@@ -1314,7 +1421,7 @@ static int coroutine_fn nbd_client_co_block_status(
 {
     int ret, request_ret;
     NBDExtent extent = { 0 };
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_client_pick_conn(bs);
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -1352,7 +1459,7 @@ static int coroutine_fn nbd_client_co_block_status(
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        ret = nbd_co_send_request(s, &request, NULL);
         if (ret < 0) {
             continue;
         }
@@ -1399,12 +1506,25 @@ static void nbd_client_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (s->ioc) {
-        nbd_send_request(s->ioc, &request);
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i]->ioc) {
+            nbd_send_request(s->conns[i]->ioc, &request);
+        }
+    }
+
+    for (i = 0; i < s->nb_conns; i++) {
+        nbd_teardown_connection(s->conns[i]);
     }
 
-    nbd_teardown_connection(bs);
+    /* The additional connections do not own their connection parameters */
+    for (i = 1; i < s->nb_conns; i++) {
+        error_free(s->conns[i]->connect_err);
+        g_free(s->conns[i]);
+        s->conns[i] = NULL;
+    }
+    s->nb_conns = 1;
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -1428,9 +1548,9 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
     return sioc;
 }
 
-static int nbd_client_connect(BlockDriverState *bs, Error **errp)
+static int nbd_client_connect(BDRVNBDState *s, Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BlockDriverState *bs = s->bs;
     AioContext *aio_context = bdrv_get_aio_context(bs);
     int ret;
 
@@ -1829,6 +1949,12 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server supports "
+                    "multiple connections. Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -1839,6 +1965,7 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     BDRVNBDState *s = bs->opaque;
     QemuOpts *opts;
     Error *local_err = NULL;
+    uint64_t multi_conn;
     int ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
@@ -1888,6 +2015,14 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (multi_conn < 1 || multi_conn > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+    s->multi_conn = multi_conn;
+
     ret = 0;
 
  error:
@@ -1898,6 +2033,71 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+static void nbd_client_start_conn(BDRVNBDState *s)
+{
+    s->state = NBD_CLIENT_CONNECTED;
+
+    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
+    bdrv_inc_in_flight(s->bs);
+    aio_co_schedule(bdrv_get_aio_context(s->bs), s->connection_co);
+}
+
+/*
+ * Open the additional connections requested with multi-conn.  Failing to
+ * open one is not fatal, requests are then spread across the connections
+ * that could be opened.
+ */
+static void nbd_client_open_extra_conns(BDRVNBDState *s)
+{
+    NBDRequest disc = { .type = NBD_CMD_DISC };
+
+    if (s->multi_conn > 1 && !(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        trace_nbd_client_multi_conn_unsupported(s->export);
+    }
+
+    while (s->nb_conns < s->multi_conn &&
+           (s->info.flags & NBD_FLAG_CAN_MULTI_CONN))
+    {
+        BDRVNBDState *conn = g_new0(BDRVNBDState, 1);
+        Error *local_err = NULL;
+
+        conn->bs = s->bs;
+        conn->reconnect_delay = s->reconnect_delay;
+        conn->saddr = s->saddr;
+        conn->export = s->export;
+        conn->tlscreds = s->tlscreds;
+        conn->hostname = s->hostname;
+        conn->x_dirty_bitmap = s->x_dirty_bitmap;
+        qemu_co_mutex_init(&conn->send_mutex);
+        qemu_co_queue_init(&conn->free_sema);
+
+        if (nbd_client_connect(conn, &local_err) < 0) {
+            trace_nbd_client_multi_conn_fail(s->export,
+                                             error_get_pretty(local_err));
+            error_free(local_err);
+            g_free(conn);
+            break;
+        }
+
+        if (!nbd_client_same_export(s, conn)) {
+            trace_nbd_client_multi_conn_fail(s->export,
+                                             "export changed between "
+                                             "connections");
+            nbd_send_request(conn->ioc, &disc);
+            nbd_conn_detach_aio_context(conn);
+            object_unref(OBJECT(conn->sioc));
+            object_unref(OBJECT(conn->ioc));
+            g_free(conn);
+            break;
+        }
+
+        nbd_client_start_conn(conn);
+        s->conns[s->nb_conns++] = conn;
+    }
+
+    trace_nbd_client_multi_conn(s->export, s->nb_conns);
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
@@ -1910,20 +2110,22 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->bs = bs;
+    s->conns[0] = s;
+    s->nb_conns = 1;
     qemu_co_mutex_init(&s->send_mutex);
     qemu_co_queue_init(&s->free_sema);
 
-    ret = nbd_client_connect(bs, errp);
+    ret = nbd_client_connect(s, errp);
     if (ret < 0) {
         nbd_clear_bdrvstate(s);
         return ret;
     }
     /* successfully connected */
-    s->state = NBD_CLIENT_CONNECTED;
+    nbd_client_start_conn(s);
 
-    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
-    bdrv_inc_in_flight(bs);
-    aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
+    if (s->multi_conn > 1) {
+        nbd_client_open_extra_conns(s);
+    }
 
     return 0;
 }
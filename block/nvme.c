@@ -32,6 +32,7 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+#define NVME_MAX_IO_QUEUES 64
 
 typedef struct {
     int32_t  head, tail;
@@ -44,6 +45,8 @@ typedef struct {
 typedef struct {
     BlockCompletionFunc *cb;
     void *opaque;
+    /* If not NULL, receives DW0 of the completion queue entry */
+    uint32_t *result;
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
@@ -99,6 +102,8 @@ typedef struct {
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    /* Round-robin cursor over the I/O queues, see nvme_next_io_queue() */
+    unsigned next_io_queue;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -127,6 +132,9 @@ typedef struct {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_QUEUES "queues"
+#define NVME_BLOCK_OPT_IRQ_COALESCE_THRESHOLD "irq-coalesce-threshold"
+#define NVME_BLOCK_OPT_IRQ_COALESCE_TIME "irq-coalesce-time"
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -142,6 +150,22 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs (default: 1)",
+        },
+        {
+            .name = NVME_BLOCK_OPT_IRQ_COALESCE_THRESHOLD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Completions aggregated per interrupt (default: 1)",
+        },
+        {
+            .name = NVME_BLOCK_OPT_IRQ_COALESCE_TIME,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum interrupt delay in 100 microsecond units "
+                    "(default: 0)",
+        },
         { /* end of list */ }
     },
 };
@@ -342,8 +366,12 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         preq->busy = false;
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, nvme_translate_error(c));
         qemu_mutex_lock(&q->lock);
@@ -403,8 +431,9 @@ static void nvme_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
-                         NvmeCmd *cmd)
+/* Like nvme_cmd_sync(), but also return DW0 of the completion in @result */
+static int nvme_cmd_sync_result(BlockDriverState *bs, NVMeQueuePair *q,
+                                NvmeCmd *cmd, uint32_t *result)
 {
     NVMeRequest *req;
     BDRVNVMeState *s = bs->opaque;
@@ -413,12 +442,19 @@ static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(s, q, req, cmd, nvme_cmd_sync_cb, &ret);
 
     BDRV_POLL_WHILE(bs, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
+                         NvmeCmd *cmd)
+{
+    return nvme_cmd_sync_result(bs, q, cmd, NULL);
+}
+
 static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -512,7 +548,18 @@ static bool nvme_poll_queues(BDRVNVMeState *s)
 
     for (i = 0; i < s->nr_queues; i++) {
         NVMeQueuePair *q = s->queues[i];
+        NvmeCqe *c;
+
+        /* Check the phase bit first so that idle queues are skipped quickly.
+         * The head and phase are updated by nvme_process_completion(), which
+         * also runs on submission, so they must be read under q->lock.
+         */
         qemu_mutex_lock(&q->lock);
+        c = (NvmeCqe *)&q->cq.queue[q->cq.head * NVME_CQ_ENTRY_BYTES];
+        if ((le16_to_cpu(c->status) & 0x1) == q->cq_phase) {
+            qemu_mutex_unlock(&q->lock);
+            continue;
+        }
         while (nvme_process_completion(s, q)) {
             /* Keep polling */
             progress = true;
@@ -568,9 +615,19 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
     s->nr_queues++;
+    trace_nvme_add_io_queue(s, n);
     return true;
 }
 
+/* Pick the I/O queue pair for a new request, spreading them round-robin */
+static NVMeQueuePair *nvme_next_io_queue(BDRVNVMeState *s)
+{
+    unsigned n = atomic_fetch_inc(&s->next_io_queue);
+
+    assert(s->nr_queues > 1);
+    return s->queues[1 + n % (s->nr_queues - 1)];
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -583,13 +640,15 @@ static bool nvme_poll_cb(void *opaque)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
-    int ret;
+    NvmeCmd cmd;
+    int i, ret;
     uint64_t cap;
     uint64_t timeout_ms;
     uint64_t deadline, now;
+    uint32_t granted;
     Error *local_err = NULL;
 
     qemu_co_mutex_init(&s->dma_map_lock);
@@ -628,6 +687,13 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     s->page_size = MAX(4096, 1 << (12 + ((cap >> 48) & 0xF)));
     s->doorbell_scale = (4 << (((cap >> 32) & 0xF))) / sizeof(uint32_t);
     bs->bl.opt_mem_alignment = s->page_size;
+    if ((2 * queues + 2) * s->doorbell_scale * sizeof(uint32_t) >
+        NVME_BAR_SIZE - offsetof(NVMeRegs, doorbells)) {
+        error_setg(errp, "Too many I/O queues for the doorbell stride of "
+                   "this controller");
+        ret = -EINVAL;
+        goto out;
+    }
     timeout_ms = MIN(500 * ((cap >> 24) & 0xFF), 30000);
 
     /* Reset device to get a clean state. */
@@ -689,9 +755,40 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
-    /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    /* Ask for one I/O queue pair per requested queue.  The controller may
+     * grant fewer; only as many as it allocated can be created.
+     */
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((queues - 1) << 16) | (queues - 1)),
+    };
+    if (nvme_cmd_sync_result(bs, s->queues[0], &cmd, &granted)) {
+        error_setg(errp, "Failed to set the number of I/O queues");
         ret = -EIO;
+        goto out;
+    }
+    /* Submission queues in bits 15:0, completion queues in 31:16, 0's based */
+    granted = MIN(granted & 0xffff, granted >> 16) + 1;
+    if (granted < queues) {
+        warn_report("NVMe controller allocated %" PRIu32 " of %d I/O queues",
+                    granted, queues);
+        queues = granted;
+    }
+
+    /* Set up command queues. */
+    for (i = 0; i < queues; i++) {
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            if (s->nr_queues == 1) {
+                error_propagate(errp, local_err);
+                ret = -EIO;
+                goto out;
+            }
+            warn_reportf_err(local_err, "Using %d of %d NVMe I/O queues: ",
+                             s->nr_queues - 1, queues);
+            local_err = NULL;
+            break;
+        }
     }
 out:
     /* Cleaning up is done in nvme_file_open() upon error. */
@@ -734,6 +831,28 @@ static void nvme_parse_filename(const char *filename, QDict *options,
     }
 }
 
+/* Aggregate up to @threshold completions, or wait at most @time * 100 us,
+ * before raising an interrupt.  The admin queue is never coalesced.
+ */
+static int nvme_set_irq_coalescing(BlockDriverState *bs, int threshold,
+                                   int time, Error **errp)
+{
+    int ret;
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_INTERRUPT_COALESCING),
+        .cdw11 = cpu_to_le32((time << 8) | (threshold - 1)),
+    };
+
+    trace_nvme_set_irq_coalescing(s, threshold, time);
+    ret = nvme_cmd_sync(bs, s->queues[0], &cmd);
+    if (ret) {
+        error_setg(errp, "Failed to configure NVMe interrupt coalescing");
+    }
+    return ret;
+}
+
 static int nvme_enable_disable_write_cache(BlockDriverState *bs, bool enable,
                                            Error **errp)
 {
@@ -777,6 +896,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int64_t queues, irq_threshold, irq_time;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -792,11 +912,41 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_QUEUES, 1);
+    irq_threshold = qemu_opt_get_number(opts,
+                                        NVME_BLOCK_OPT_IRQ_COALESCE_THRESHOLD,
+                                        1);
+    irq_time = qemu_opt_get_number(opts, NVME_BLOCK_OPT_IRQ_COALESCE_TIME, 0);
+    if (queues < 1 || queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_QUEUES "' must be between 1 "
+                   "and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    if (irq_threshold < 1 || irq_threshold > 256) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IRQ_COALESCE_THRESHOLD
+                   "' must be between 1 and 256");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    if (irq_time < 0 || irq_time > 255) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IRQ_COALESCE_TIME
+                   "' must be between 0 and 255");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    ret = nvme_init(bs, device, namespace, queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
     }
+    if (irq_threshold > 1 || irq_time) {
+        ret = nvme_set_irq_coalescing(bs, irq_threshold, irq_time, errp);
+        if (ret) {
+            goto fail;
+        }
+    }
     if (flags & BDRV_O_NOCACHE) {
         if (!s->write_cache_supported) {
             error_setg(errp,
@@ -963,7 +1113,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_next_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1078,7 +1228,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_next_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1109,7 +1259,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_next_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1162,7 +1312,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_next_io_queue(s);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
@@ -655,6 +655,108 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
     return head;
 }
 
+static void bdrv_node_latency_set(BlockDriverState *bs, bool enable)
+{
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    BlockNodeLatencyStats *old;
+
+    aio_context_acquire(ctx);
+    bdrv_drained_begin(bs);
+    old = bs->latency_stats;
+    bs->latency_stats = enable ? block_node_latency_stats_new() : NULL;
+    bdrv_drained_end(bs);
+    aio_context_release(ctx);
+
+    block_node_latency_stats_free(old);
+}
+
+void qmp_block_node_latency_histogram_set(bool has_node_name,
+                                          const char *node_name,
+                                          bool enable, Error **errp)
+{
+    BlockDriverState *bs;
+
+    if (has_node_name) {
+        bs = bdrv_find_node(node_name);
+        if (!bs) {
+            error_setg(errp, "Cannot find node %s", node_name);
+            return;
+        }
+        bdrv_node_latency_set(bs, enable);
+        return;
+    }
+
+    for (bs = bdrv_next_node(NULL); bs; bs = bdrv_next_node(bs)) {
+        bdrv_node_latency_set(bs, enable);
+    }
+}
+
+static BlockLatencyPercentiles *
+bdrv_query_latency_percentiles(BlockNodeLatencyStats *stats,
+                               enum BlockAcctType type)
+{
+    BlockLatencyLogHistogram *hist = g_new(BlockLatencyLogHistogram, 1);
+    BlockLatencyPercentiles *info = NULL;
+
+    block_node_latency_snapshot(stats, type, hist);
+    if (hist->count) {
+        info = g_new0(BlockLatencyPercentiles, 1);
+        info->count = hist->count;
+        info->min_ns = hist->min_ns;
+        info->max_ns = hist->max_ns;
+        info->mean_ns = hist->sum_ns / hist->count;
+        info->p50_ns = block_latency_log_percentile(hist, 500);
+        info->p99_ns = block_latency_log_percentile(hist, 990);
+        info->p999_ns = block_latency_log_percentile(hist, 999);
+    }
+    g_free(hist);
+
+    return info;
+}
+
+BlockNodeLatencyInfoList *qmp_query_block_node_latency(Error **errp)
+{
+    BlockNodeLatencyInfoList *head = NULL, **p_next = &head;
+    BlockDriverState *bs;
+
+    for (bs = bdrv_next_node(NULL); bs; bs = bdrv_next_node(bs)) {
+        BlockNodeLatencyInfoList *elem;
+        BlockNodeLatencyInfo *info;
+        AioContext *ctx = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(ctx);
+        if (!bs->latency_stats) {
+            aio_context_release(ctx);
+            continue;
+        }
+
+        info = g_new0(BlockNodeLatencyInfo, 1);
+        info->node_name = g_strdup(bdrv_get_node_name(bs));
+        info->driver = g_strdup(bdrv_get_format_name(bs) ?: "");
+        info->read = bdrv_query_latency_percentiles(bs->latency_stats,
+                                                    BLOCK_ACCT_READ);
+        info->write = bdrv_query_latency_percentiles(bs->latency_stats,
+                                                     BLOCK_ACCT_WRITE);
+        info->flush = bdrv_query_latency_percentiles(bs->latency_stats,
+                                                     BLOCK_ACCT_FLUSH);
+        info->discard = bdrv_query_latency_percentiles(bs->latency_stats,
+                                                       BLOCK_ACCT_UNMAP);
+        aio_context_release(ctx);
+
+        info->has_read = !!info->read;
+        info->has_write = !!info->write;
+        info->has_flush = !!info->flush;
+        info->has_discard = !!info->discard;
+
+        elem = g_new0(BlockNodeLatencyInfoList, 1);
+        elem->value = info;
+        *p_next = elem;
+        p_next = &elem->next;
+    }
+
+    return head;
+}
+
 void bdrv_snapshot_dump(QEMUSnapshotInfo *sn)
 {
     char date_buf[128], clock_buf[128];
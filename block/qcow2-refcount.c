@@ -1062,6 +1062,77 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocates up to *nb_clusters data clusters for guest_offset from the
+ * allocation extent that serves its guest region.
+ *
+ * If *host_offset is INV_OFFSET, an empty extent is refilled first, so at
+ * least one cluster is returned on success.  Otherwise, clusters are only
+ * taken if the extent continues exactly at *host_offset, and *nb_clusters is
+ * set to 0 if it does not.
+ *
+ * On success, *host_offset and *nb_clusters describe the allocated range.
+ * Returns 0 on success and -errno on failure.
+ */
+int qcow2_alloc_extent_clusters(BlockDriverState *bs, uint64_t guest_offset,
+                                uint64_t *host_offset, uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t extent_size = s->alloc_extent_clusters << s->cluster_bits;
+    Qcow2AllocExtent *ext;
+    int i;
+
+    assert(s->nb_alloc_extents > 0 && extent_size > 0);
+    i = (guest_offset / extent_size) % s->nb_alloc_extents;
+    ext = &s->alloc_extents[i];
+
+    if (*host_offset != INV_OFFSET) {
+        if (ext->nb_clusters == 0 || ext->offset != *host_offset) {
+            *nb_clusters = 0;
+            return 0;
+        }
+    } else if (ext->nb_clusters == 0) {
+        int64_t offset = qcow2_alloc_clusters(bs, extent_size);
+        if (offset < 0) {
+            return offset;
+        }
+        trace_qcow2_alloc_extent_refill(qemu_coroutine_self(), i, offset,
+                                        s->alloc_extent_clusters);
+        ext->offset = offset;
+        ext->nb_clusters = s->alloc_extent_clusters;
+    }
+
+    *nb_clusters = MIN(*nb_clusters, ext->nb_clusters);
+    *host_offset = ext->offset;
+    ext->offset += *nb_clusters << s->cluster_bits;
+    ext->nb_clusters -= *nb_clusters;
+
+    return 0;
+}
+
+/*
+ * Frees the unused clusters of all allocation extents.  This must be done
+ * before anything that requires all allocated clusters to be referenced
+ * (closing or inactivating the image, checking or rebuilding refcounts,
+ * shrinking it).
+ */
+void qcow2_release_alloc_extents(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_alloc_extents; i++) {
+        Qcow2AllocExtent *ext = &s->alloc_extents[i];
+
+        if (ext->nb_clusters) {
+            qcow2_free_clusters(bs, ext->offset,
+                                ext->nb_clusters << s->cluster_bits,
+                                QCOW2_DISCARD_NEVER);
+            ext->nb_clusters = 0;
+        }
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1254,7 +1325,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
@@ -1310,7 +1381,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     uint64_t cluster_index;
                     uint64_t offset;
 
-                    entry = be64_to_cpu(l2_slice[j]);
+                    entry = get_l2_entry(s, l2_slice, j);
                     old_entry = entry;
                     entry &= ~QCOW_OFLAG_COPIED;
                     offset = entry & L2E_OFFSET_MASK;
@@ -1384,7 +1455,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                                        s->refcount_block_cache);
                         }
-                        l2_slice[j] = cpu_to_be64(entry);
+                        set_l2_entry(s, l2_slice, j, entry);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache,
                                                      l2_slice);
                     }
@@ -1605,7 +1676,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int i, l2_size, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->l2_size * l2_entry_size(s);
     l2_table = g_malloc(l2_size);
 
     ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
@@ -1617,7 +1688,21 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+            bool compressed = l2_entry & QCOW_OFLAG_COMPRESSED;
+
+            if ((compressed && l2_bitmap) ||
+                qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, 0) ==
+                QCOW2_SUBCLUSTER_INVALID) {
+                fprintf(stderr, "ERROR invalid subcluster bitmap %#" PRIx64
+                        " (L2 offset: %#" PRIx64 ", L2 index: %#x)\n",
+                        l2_bitmap, l2_offset, i);
+                res->corruptions++;
+            }
+        }
 
         switch (qcow2_get_cluster_type(bs, l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1681,12 +1766,12 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             offset);
                     if (fix & BDRV_FIX_ERRORS) {
                         uint64_t l2e_offset =
-                            l2_offset + (uint64_t)i * sizeof(uint64_t);
+                            l2_offset + (uint64_t)i * l2_entry_size(s);
                         int ign = active ? QCOW2_OL_ACTIVE_L2 :
                                            QCOW2_OL_INACTIVE_L2;
 
                         l2_entry = QCOW_OFLAG_ZERO;
-                        l2_table[i] = cpu_to_be64(l2_entry);
+                        set_l2_entry(s, l2_table, i, l2_entry);
                         ret = qcow2_pre_write_overlap_check(bs, ign,
                                 l2e_offset, sizeof(uint64_t), false);
                         if (ret < 0) {
@@ -1698,7 +1783,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
-                                               &l2_table[i], sizeof(uint64_t));
+                                               &l2_table[i * l2_entry_size(s) /
+                                                         sizeof(uint64_t)],
+                                               sizeof(uint64_t));
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Failed to overwrite L2 "
                                     "table entry: %s\n", strerror(-ret));
@@ -1905,7 +1992,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1914,7 +2001,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
 
@@ -1937,9 +2024,10 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
                             repair ? "Repairing" : "ERROR", l2_entry, refcount);
                     if (repair) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j,
+                                     refcount == 1 ?
+                                     l2_entry |  QCOW_OFLAG_COPIED :
+                                     l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty++;
                     }
                 }
@@ -3121,6 +3209,8 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     assert(s->qcow_version >= 3);
     assert(refcount_order >= 0 && refcount_order <= 6);
 
+    qcow2_release_alloc_extents(bs);
+
     /* see qcow2_open() */
     new_refblock_size = 1 << (s->cluster_bits - (refcount_order - 3));
 
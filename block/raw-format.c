@@ -505,6 +505,18 @@ static int raw_probe_geometry(BlockDriverState *bs, HDGeometry *geo)
     return bdrv_probe_geometry(bs->file->bs, geo);
 }
 
+static int raw_get_host_fd(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, int64_t *host_offset)
+{
+    int ret;
+
+    ret = raw_adjust_offset(bs, (uint64_t *)&offset, bytes, false);
+    if (ret) {
+        return ret;
+    }
+    return bdrv_get_host_fd(bs->file->bs, offset, bytes, host_offset);
+}
+
 static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
                                                BdrvChild *src,
                                                uint64_t src_offset,
@@ -566,6 +578,7 @@ BlockDriver bdrv_raw = {
     .bdrv_co_pdiscard     = &raw_co_pdiscard,
     .bdrv_co_block_status = &raw_co_block_status,
     .bdrv_co_copy_range_from = &raw_co_copy_range_from,
+    .bdrv_get_host_fd     = &raw_get_host_fd,
     .bdrv_co_copy_range_to  = &raw_co_copy_range_to,
     .bdrv_co_truncate     = &raw_co_truncate,
     .bdrv_getlength       = &raw_getlength,
@@ -0,0 +1,736 @@
+/*
+ * Persistent read cache block filter
+ *
+ * Keeps a local copy of the blocks that have been read from a (typically
+ * remote) node in a cache node, so that they do not have to be fetched
+ * again, not even after a restart.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "sidecar.h"
+#include "trace.h"
+
+/*
+ * On-disk format of the cache node
+ *
+ * The cache node is a sidecar node (see sidecar.h) whose layout is described
+ * by the ReadCacheLayout below.  The index follows the sidecar header at
+ * @index_offset: one 64-bit entry per slot, holding the origin block number
+ * plus one, or 0 for an empty slot.  The data of slot i lives at
+ * @data_offset + i * @block_size.
+ *
+ * All fields are big-endian.
+ */
+
+#define READ_CACHE_MAGIC        0x5152444341434845ULL /* "QRDCACHE" */
+#define READ_CACHE_VERSION      1
+
+typedef struct ReadCacheLayout {
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t nb_slots;
+    uint64_t index_offset;
+    uint64_t data_offset;
+} QEMU_PACKED ReadCacheLayout;
+
+/* End of disk format structures. */
+
+#define READ_CACHE_DEFAULT_BLOCK_SIZE   (64 * KiB)
+#define READ_CACHE_MAX_BLOCK_SIZE       (16 * MiB)
+#define READ_CACHE_DEFAULT_SIZE         (1 * GiB)
+
+#define READ_CACHE_OPT_CACHE_SIZE       "cache-size"
+#define READ_CACHE_OPT_BLOCK_SIZE       "block-size"
+
+/* Block number of a slot that does not cache anything */
+#define READ_CACHE_NO_BLOCK             UINT64_MAX
+
+typedef struct ReadCacheSlot {
+    /* Origin block cached in this slot, or READ_CACHE_NO_BLOCK */
+    uint64_t block;
+    /* Set on every hit, cleared when the clock hand passes */
+    bool referenced;
+    /* The slot is being filled from the origin */
+    bool filling;
+    /* Number of requests currently reading from this slot */
+    unsigned readers;
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    BlockSidecar sidecar;
+
+    uint32_t block_size;
+    int block_bits;
+    uint64_t nb_slots;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    uint64_t origin_size;
+
+    ReadCacheSlot *slots;
+    /* Maps origin block numbers (keys point into @slots) to slots */
+    GHashTable *map;
+    /* Slots that have never been used since the cache was opened */
+    uint64_t *free_slots;
+    uint64_t nb_free_slots;
+    uint64_t clock_hand;
+
+    /*
+     * Incremented before and after each write to the origin.  A fill that
+     * sees a different value when it completes may have cached stale data.
+     * Fills that complete while a write is still running are caught by
+     * invalidating the written range again once the write is done.
+     */
+    uint64_t write_gen;
+} BDRVReadCacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of data kept in the cache",
+        },
+        {
+            .name = READ_CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the cache",
+        },
+        { /* end of list */ }
+    },
+};
+
+static inline uint64_t read_cache_slot_index(BDRVReadCacheState *s,
+                                             ReadCacheSlot *slot)
+{
+    return slot - s->slots;
+}
+
+static inline uint64_t read_cache_slot_offset(BDRVReadCacheState *s,
+                                              ReadCacheSlot *slot)
+{
+    return s->data_offset + read_cache_slot_index(s, slot) * s->block_size;
+}
+
+static void read_cache_insert(BDRVReadCacheState *s, ReadCacheSlot *slot,
+                              uint64_t block)
+{
+    assert(slot->block == READ_CACHE_NO_BLOCK);
+    slot->block = block;
+    g_hash_table_insert(s->map, &slot->block, slot);
+}
+
+static void read_cache_remove(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    if (slot->block != READ_CACHE_NO_BLOCK) {
+        g_hash_table_remove(s->map, &slot->block);
+        slot->block = READ_CACHE_NO_BLOCK;
+    }
+    slot->referenced = false;
+}
+
+static void read_cache_reset(BDRVReadCacheState *s)
+{
+    uint64_t i;
+
+    g_hash_table_remove_all(s->map);
+    for (i = 0; i < s->nb_slots; i++) {
+        s->slots[i] = (ReadCacheSlot) { .block = READ_CACHE_NO_BLOCK };
+        s->free_slots[i] = s->nb_slots - 1 - i;
+    }
+    s->nb_free_slots = s->nb_slots;
+    s->clock_hand = 0;
+}
+
+/*
+ * Find a slot that can be (re)filled.  Never used slots are handed out first;
+ * once there are none left, a CLOCK sweep evicts a slot that has not been hit
+ * since the hand last passed it.  Slots that are in use by a request are
+ * skipped.  Returns NULL if all slots are busy.
+ */
+static ReadCacheSlot *read_cache_get_slot(BDRVReadCacheState *s)
+{
+    uint64_t i;
+
+    if (s->nb_free_slots) {
+        return &s->slots[s->free_slots[--s->nb_free_slots]];
+    }
+
+    for (i = 0; i < 2 * s->nb_slots; i++) {
+        ReadCacheSlot *slot = &s->slots[s->clock_hand];
+
+        s->clock_hand = (s->clock_hand + 1) % s->nb_slots;
+        if (slot->filling || slot->readers) {
+            continue;
+        }
+        if (slot->block != READ_CACHE_NO_BLOCK) {
+            if (slot->referenced) {
+                slot->referenced = false;
+                continue;
+            }
+            trace_read_cache_evict(s, slot->block,
+                                   read_cache_slot_index(s, slot));
+            read_cache_remove(s, slot);
+        }
+        return slot;
+    }
+
+    return NULL;
+}
+
+static void read_cache_invalidate(BDRVReadCacheState *s, uint64_t offset,
+                                  uint64_t bytes)
+{
+    uint64_t block, last;
+
+    if (!bytes) {
+        return;
+    }
+
+    last = (offset + bytes - 1) >> s->block_bits;
+    for (block = offset >> s->block_bits; block <= last; block++) {
+        ReadCacheSlot *slot = g_hash_table_lookup(s->map, &block);
+
+        /* Fills in flight are caught by write_gen */
+        if (slot && !slot->filling) {
+            read_cache_remove(s, slot);
+        }
+    }
+}
+
+static int read_cache_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t *index = NULL;
+    uint64_t i;
+    int ret;
+
+    index = g_try_new(uint64_t, s->nb_slots);
+    if (!index) {
+        error_setg(errp, "Could not allocate cache index");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->sidecar.child, s->index_offset, index,
+                     s->nb_slots * sizeof(uint64_t));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read cache index");
+        goto out;
+    }
+
+    s->nb_free_slots = 0;
+    for (i = s->nb_slots; i-- > 0;) {
+        uint64_t entry = be64_to_cpu(index[i]);
+        uint64_t block = entry - 1;
+
+        /* Only whole blocks are cached; drop anything else */
+        if (entry && block < s->origin_size >> s->block_bits &&
+            !g_hash_table_contains(s->map, &block))
+        {
+            read_cache_insert(s, &s->slots[i], block);
+        } else {
+            s->free_slots[s->nb_free_slots++] = i;
+        }
+    }
+    trace_read_cache_load(s, g_hash_table_size(s->map));
+    ret = 0;
+
+out:
+    g_free(index);
+    return ret;
+}
+
+/* Write the in-memory index back to the cache node */
+static int read_cache_store(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    g_autofree uint64_t *index = NULL;
+    uint64_t i;
+    int ret;
+
+    index = g_try_new(uint64_t, s->nb_slots);
+    if (!index) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        uint64_t block = s->slots[i].block;
+        index[i] = cpu_to_be64(block == READ_CACHE_NO_BLOCK ? 0 : block + 1);
+    }
+
+    return bdrv_pwrite(s->sidecar.child, s->index_offset, index,
+                       s->nb_slots * sizeof(uint64_t));
+}
+
+static void read_cache_sidecar_reset(BlockDriverState *bs)
+{
+    read_cache_reset(bs->opaque);
+}
+
+static const BlockSidecarDriver read_cache_sidecar = {
+    .child_name     = "cache-file",
+    .desc           = "cache",
+    .magic          = READ_CACHE_MAGIC,
+    .version        = READ_CACHE_VERSION,
+    .reset          = read_cache_sidecar_reset,
+    .load           = read_cache_load,
+    .store          = read_cache_store,
+};
+
+static int read_cache_activate(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = block_sidecar_activate(bs, &s->sidecar, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!g_hash_table_size(s->map)) {
+        /* Drop the data of a discarded cache, it might be larger than now */
+        bdrv_truncate(s->sidecar.child, s->data_offset, false,
+                      PREALLOC_MODE_OFF, NULL);
+    }
+
+    return 0;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    ReadCacheLayout layout;
+    uint64_t cache_size, block_size;
+    int64_t origin_size;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    /* Open the origin */
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    /* The cache is written even if the origin is only read */
+    ret = block_sidecar_open(bs, &s->sidecar, &read_cache_sidecar, options,
+                             errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    block_size = qemu_opt_get_size(opts, READ_CACHE_OPT_BLOCK_SIZE,
+                                   READ_CACHE_DEFAULT_BLOCK_SIZE);
+    if (!is_power_of_2(block_size) || block_size < BDRV_SECTOR_SIZE ||
+        block_size > READ_CACHE_MAX_BLOCK_SIZE)
+    {
+        ret = -EINVAL;
+        error_setg(errp, "Cache block size must be a power of two between "
+                   "%u and %u", (unsigned) BDRV_SECTOR_SIZE,
+                   (unsigned) READ_CACHE_MAX_BLOCK_SIZE);
+        goto fail;
+    }
+
+    cache_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CACHE_SIZE,
+                                   READ_CACHE_DEFAULT_SIZE);
+    if (cache_size < block_size) {
+        ret = -EINVAL;
+        error_setg(errp, "Cache size must be at least one block "
+                   "(%" PRIu64 " bytes)", block_size);
+        goto fail;
+    }
+
+    origin_size = bdrv_getlength(bs->file->bs);
+    if (origin_size < 0) {
+        ret = origin_size;
+        error_setg_errno(errp, -ret, "Could not get the size of the origin");
+        goto fail;
+    }
+
+    s->block_size = block_size;
+    s->block_bits = ctz32(block_size);
+    s->nb_slots = cache_size >> s->block_bits;
+    s->index_offset = BLOCK_SIDECAR_HEADER_SIZE;
+    s->data_offset = ROUND_UP(s->index_offset +
+                              s->nb_slots * sizeof(uint64_t), s->block_size);
+    s->origin_size = origin_size;
+
+    layout = (ReadCacheLayout) {
+        .block_size     = cpu_to_be32(s->block_size),
+        .nb_slots       = cpu_to_be64(s->nb_slots),
+        .index_offset   = cpu_to_be64(s->index_offset),
+        .data_offset    = cpu_to_be64(s->data_offset),
+    };
+    block_sidecar_set_layout(bs, &s->sidecar, origin_size, &layout,
+                             sizeof(layout));
+
+    s->slots = g_try_new(ReadCacheSlot, s->nb_slots);
+    s->free_slots = g_try_new(uint64_t, s->nb_slots);
+    if (!s->slots || !s->free_slots) {
+        ret = -ENOMEM;
+        error_setg(errp, "Could not allocate cache index");
+        goto fail;
+    }
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    read_cache_reset(s);
+
+    if (!(flags & BDRV_O_INACTIVE)) {
+        ret = read_cache_activate(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        if (s->map) {
+            g_hash_table_destroy(s->map);
+            s->map = NULL;
+        }
+        g_free(s->slots);
+        g_free(s->free_slots);
+        s->slots = NULL;
+        s->free_slots = NULL;
+        bdrv_unref_child(bs, s->sidecar.child);
+        s->sidecar.child = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int read_cache_inactivate(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    return block_sidecar_inactivate(bs, &s->sidecar);
+}
+
+static void coroutine_fn read_cache_co_invalidate_cache(BlockDriverState *bs,
+                                                        Error **errp)
+{
+    read_cache_activate(bs, errp);
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    block_sidecar_close(bs, &s->sidecar);
+
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+    g_free(s->free_slots);
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  const BdrvChildRole *role,
+                                  BlockReopenQueue *ro_q,
+                                  uint64_t perm, uint64_t shrd,
+                                  uint64_t *nperm, uint64_t *nshrd)
+{
+    if (!c) {
+        *nperm = perm & DEFAULT_PERM_PASSTHROUGH;
+        *nshrd = (shrd & DEFAULT_PERM_PASSTHROUGH) | DEFAULT_PERM_UNCHANGED;
+        return;
+    }
+
+    if (!strcmp(c->name, read_cache_sidecar.child_name)) {
+        block_sidecar_child_perm(bs, nperm, nshrd);
+    } else {
+        bdrv_filter_default_perms(bs, c, role, ro_q, perm, shrd, nperm, nshrd);
+    }
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    BDRVReadCacheState *s = reopen_state->bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t cache_size, block_size;
+    int ret = 0;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, reopen_state->options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Both determine the layout of the cache file */
+    block_size = qemu_opt_get_size(opts, READ_CACHE_OPT_BLOCK_SIZE,
+                                   READ_CACHE_DEFAULT_BLOCK_SIZE);
+    cache_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CACHE_SIZE,
+                                   READ_CACHE_DEFAULT_SIZE);
+    if (block_size != s->block_size ||
+        cache_size >> s->block_bits != s->nb_slots)
+    {
+        error_setg(errp, "Cannot change the cache size or block size of a "
+                   "read-cache node");
+        ret = -EINVAL;
+    }
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+/*
+ * Read a block that is not cached from the origin and try to add it to the
+ * cache.  The whole block is read even if the request covers only a part.
+ */
+static int coroutine_fn read_cache_co_fill(BlockDriverState *bs,
+                                           uint64_t block, uint64_t offset,
+                                           uint64_t bytes, QEMUIOVector *qiov,
+                                           size_t qiov_offset, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t block_offset = block << s->block_bits;
+    uint64_t write_gen = s->write_gen;
+    ReadCacheSlot *slot;
+    QEMUIOVector local_qiov;
+    void *buf = NULL;
+    bool cached = false;
+    int ret;
+
+    if (bytes < s->block_size) {
+        buf = qemu_try_blockalign(s->sidecar.child->bs, s->block_size);
+    }
+
+    /* The cache node cannot be written while the node is inactive */
+    slot = bs->open_flags & BDRV_O_INACTIVE ? NULL : read_cache_get_slot(s);
+    if (!slot || (bytes < s->block_size && !buf)) {
+        qemu_vfree(buf);
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    trace_read_cache_miss(s, block, read_cache_slot_index(s, slot));
+    read_cache_insert(s, slot, block);
+    slot->filling = true;
+
+    if (buf) {
+        qemu_iovec_init_buf(&local_qiov, buf, s->block_size);
+    } else {
+        /* The request covers the whole block, no need for a bounce buffer */
+        qemu_iovec_init_slice(&local_qiov, qiov, qiov_offset, bytes);
+    }
+
+    ret = bdrv_co_preadv(bs->file, block_offset, s->block_size, &local_qiov,
+                         flags);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (buf) {
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            buf + (offset - block_offset), bytes);
+    }
+
+    /* Failing to cache the block is not an error for the guest request */
+    BLKDBG_EVENT(s->sidecar.child, BLKDBG_WRITE_AIO);
+    cached = bdrv_co_pwritev(s->sidecar.child, read_cache_slot_offset(s, slot),
+                             s->block_size, &local_qiov, 0) >= 0 &&
+             s->write_gen == write_gen;
+
+out:
+    qemu_iovec_destroy(&local_qiov);
+    qemu_vfree(buf);
+    slot->filling = false;
+
+    if (cached) {
+        slot->referenced = true;
+    } else {
+        read_cache_remove(s, slot);
+    }
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_preadv_part(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset,
+                                                  int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    int ret;
+
+    while (offset < end) {
+        uint64_t block = offset >> s->block_bits;
+        uint64_t block_offset = block << s->block_bits;
+        uint64_t cur_bytes = MIN(end, block_offset + s->block_size) - offset;
+        ReadCacheSlot *slot;
+
+        if (block_offset + s->block_size > s->origin_size) {
+            /* The tail of the origin is never cached */
+            return bdrv_co_preadv_part(bs->file, offset, end - offset,
+                                       qiov, qiov_offset, flags);
+        }
+
+        slot = g_hash_table_lookup(s->map, &block);
+        if (slot && !slot->filling) {
+            trace_read_cache_hit(s, block, read_cache_slot_index(s, slot));
+            slot->referenced = true;
+            slot->readers++;
+            ret = bdrv_co_preadv_part(s->sidecar.child,
+                                      read_cache_slot_offset(s, slot) +
+                                      (offset - block_offset), cur_bytes,
+                                      qiov, qiov_offset, 0);
+            slot->readers--;
+            if (ret < 0) {
+                /* Forget about the block and get it from the origin */
+                read_cache_remove(s, slot);
+                ret = bdrv_co_preadv_part(bs->file, offset, cur_bytes,
+                                          qiov, qiov_offset, flags);
+            }
+        } else if (slot) {
+            /* Another request is filling this block right now */
+            ret = bdrv_co_preadv_part(bs->file, offset, cur_bytes,
+                                      qiov, qiov_offset, flags);
+        } else {
+            ret = read_cache_co_fill(bs, block, offset, cur_bytes,
+                                     qiov, qiov_offset, flags);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn read_cache_co_pwritev_part(BlockDriverState *bs,
+                                                   uint64_t offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   size_t qiov_offset,
+                                                   int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    s->write_gen++;
+    read_cache_invalidate(s, offset, bytes);
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    s->write_gen++;
+    read_cache_invalidate(s, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    s->write_gen++;
+    read_cache_invalidate(s, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    s->write_gen++;
+    read_cache_invalidate(s, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    s->write_gen++;
+    read_cache_invalidate(s, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    s->write_gen++;
+    read_cache_invalidate(s, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    READ_CACHE_OPT_CACHE_SIZE,
+    READ_CACHE_OPT_BLOCK_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache = {
+    .format_name            = "read-cache",
+    .instance_size          = sizeof(BDRVReadCacheState),
+
+    .bdrv_open              = read_cache_open,
+    .bdrv_close             = read_cache_close,
+    .bdrv_getlength         = read_cache_getlength,
+    .bdrv_child_perm        = read_cache_child_perm,
+    .bdrv_reopen_prepare    = read_cache_reopen_prepare,
+    .bdrv_inactivate        = read_cache_inactivate,
+    .bdrv_co_invalidate_cache = read_cache_co_invalidate_cache,
+
+    .bdrv_co_preadv_part    = read_cache_co_preadv_part,
+    .bdrv_co_pwritev_part   = read_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes  = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = read_cache_co_pdiscard,
+    .bdrv_co_flush          = read_cache_co_flush,
+    .bdrv_co_block_status   = bdrv_co_block_status_from_file,
+
+    .is_filter              = true,
+    .strong_runtime_opts    = read_cache_strong_runtime_opts,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -0,0 +1,198 @@
+/*
+ * Sidecar nodes of block filters
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "sidecar.h"
+#include "trace.h"
+
+int block_sidecar_open(BlockDriverState *bs, BlockSidecar *sc,
+                       const BlockSidecarDriver *drv, QDict *options,
+                       Error **errp)
+{
+    Error *local_err = NULL;
+    char *ro_opt = g_strdup_printf("%s." BDRV_OPT_READ_ONLY, drv->child_name);
+
+    sc->drv = drv;
+
+    qdict_set_default_str(options, ro_opt, "off");
+    g_free(ro_opt);
+
+    sc->child = bdrv_open_child(NULL, options, drv->child_name, bs,
+                                &child_file, false, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+void block_sidecar_set_layout(BlockDriverState *bs, BlockSidecar *sc,
+                              uint64_t origin_size, const void *layout,
+                              size_t layout_len)
+{
+    assert(layout_len <= BLOCK_SIDECAR_MAX_LAYOUT);
+
+    sc->origin_size = origin_size;
+    pstrcpy(sc->origin_name, sizeof(sc->origin_name), bs->file->bs->filename);
+    memcpy(sc->layout, layout, layout_len);
+    sc->layout_len = layout_len;
+}
+
+/*
+ * Return 1 if the sidecar was written back cleanly for the current
+ * configuration, 0 if it must be discarded, or a negative errno.
+ */
+static int block_sidecar_check(BlockSidecar *sc, Error **errp)
+{
+    BlockSidecarHeader header;
+    size_t origin_name_len = strlen(sc->origin_name);
+    g_autofree uint8_t *buf = NULL;
+    int ret;
+
+    if (bdrv_getlength(sc->child->bs) < BLOCK_SIDECAR_HEADER_SIZE) {
+        return 0;
+    }
+
+    buf = g_malloc(BLOCK_SIDECAR_HEADER_SIZE);
+    ret = bdrv_pread(sc->child, 0, buf, BLOCK_SIDECAR_HEADER_SIZE);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read %s header",
+                         sc->drv->desc);
+        return ret;
+    }
+    memcpy(&header, buf, sizeof(header));
+
+    /*
+     * Anything that does not match the current configuration is not an error,
+     * the metadata is simply unknown again.
+     */
+    if (be64_to_cpu(header.magic) != sc->drv->magic ||
+        be32_to_cpu(header.version) != sc->drv->version ||
+        be32_to_cpu(header.flags) & BLOCK_SIDECAR_FLAG_DIRTY ||
+        be64_to_cpu(header.origin_size) != sc->origin_size ||
+        be32_to_cpu(header.layout_len) != sc->layout_len ||
+        memcmp(buf + sizeof(header), sc->layout, sc->layout_len))
+    {
+        trace_block_sidecar_discard(sc, "configuration changed");
+        return 0;
+    }
+
+    if (be32_to_cpu(header.origin_name_len) != origin_name_len ||
+        memcmp(buf + sizeof(header) + sc->layout_len, sc->origin_name,
+               origin_name_len))
+    {
+        trace_block_sidecar_discard(sc, "origin changed");
+        return 0;
+    }
+
+    return 1;
+}
+
+static int block_sidecar_write_header(BlockSidecar *sc, bool dirty)
+{
+    g_autofree uint8_t *buf = g_malloc0(BLOCK_SIDECAR_HEADER_SIZE);
+    BlockSidecarHeader *header = (BlockSidecarHeader *)buf;
+    size_t origin_name_len = strlen(sc->origin_name);
+    int ret;
+
+    *header = (BlockSidecarHeader) {
+        .magic              = cpu_to_be64(sc->drv->magic),
+        .version            = cpu_to_be32(sc->drv->version),
+        .flags              = cpu_to_be32(dirty ? BLOCK_SIDECAR_FLAG_DIRTY
+                                                : 0),
+        .origin_size        = cpu_to_be64(sc->origin_size),
+        .layout_len         = cpu_to_be32(sc->layout_len),
+        .origin_name_len    = cpu_to_be32(origin_name_len),
+    };
+    memcpy(buf + sizeof(*header), sc->layout, sc->layout_len);
+    memcpy(buf + sizeof(*header) + sc->layout_len, sc->origin_name,
+           origin_name_len);
+
+    ret = bdrv_pwrite(sc->child, 0, buf, BLOCK_SIDECAR_HEADER_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_flush(sc->child->bs);
+}
+
+int block_sidecar_activate(BlockDriverState *bs, BlockSidecar *sc,
+                           Error **errp)
+{
+    int ret;
+
+    sc->drv->reset(bs);
+    ret = block_sidecar_check(sc, errp);
+    if (ret > 0) {
+        ret = sc->drv->load(bs, errp);
+        if (ret < 0) {
+            sc->drv->reset(bs);
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Whatever is recorded from now on is only valid after a clean close */
+    ret = block_sidecar_write_header(sc, true);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write %s header",
+                         sc->drv->desc);
+        return ret;
+    }
+
+    return 0;
+}
+
+int block_sidecar_inactivate(BlockDriverState *bs, BlockSidecar *sc)
+{
+    int ret;
+
+    /* The metadata must be stable on disk before the header says so */
+    ret = sc->drv->store(bs);
+    if (ret >= 0) {
+        ret = bdrv_flush(sc->child->bs);
+    }
+    if (ret >= 0) {
+        ret = block_sidecar_write_header(sc, false);
+    }
+    if (ret < 0) {
+        error_report("Failed to write back the %s, it will be discarded: %s",
+                     sc->drv->desc, strerror(-ret));
+    }
+
+    return ret;
+}
+
+void block_sidecar_close(BlockDriverState *bs, BlockSidecar *sc)
+{
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        block_sidecar_inactivate(bs, sc);
+    }
+
+    bdrv_unref_child(bs, sc->child);
+    sc->child = NULL;
+}
+
+void block_sidecar_child_perm(BlockDriverState *bs, uint64_t *nperm,
+                              uint64_t *nshrd)
+{
+    /* The sidecar is private to @bs */
+    *nperm = BLK_PERM_CONSISTENT_READ;
+    *nshrd = BLK_PERM_WRITE_UNCHANGED;
+
+    /* We must not request write permissions for an inactive node */
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        *nperm |= BLK_PERM_WRITE | BLK_PERM_RESIZE;
+    }
+}
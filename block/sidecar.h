@@ -0,0 +1,112 @@
+/*
+ * Sidecar nodes of block filters
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_SIDECAR_H
+#define BLOCK_SIDECAR_H
+
+#include "block/block_int.h"
+
+/*
+ * Some filters keep metadata about the data of their file child (the
+ * origin) in a separate node, the sidecar.  The metadata is kept in memory
+ * while the filter is active and written back when it is inactivated or
+ * closed.
+ *
+ * On-disk format of the sidecar header
+ *
+ * A sidecar node starts with a header of BLOCK_SIDECAR_HEADER_SIZE bytes:
+ * the BlockSidecarHeader below, followed by @layout_len bytes that describe
+ * the layout of the rest of the node (defined by each filter), followed by
+ * the (possibly truncated) filename of the origin.  The header is marked
+ * dirty as long as the metadata on disk may be stale; a dirty sidecar is
+ * discarded when it is opened again, as is one whose layout or origin does
+ * not match the current configuration.
+ *
+ * All fields are big-endian.
+ */
+
+#define BLOCK_SIDECAR_HEADER_SIZE   4096
+#define BLOCK_SIDECAR_MAX_LAYOUT    256
+
+#define BLOCK_SIDECAR_FLAG_DIRTY    (1 << 0)
+
+typedef struct BlockSidecarHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t origin_size;
+    uint32_t layout_len;
+    uint32_t origin_name_len;
+} QEMU_PACKED BlockSidecarHeader;
+
+#define BLOCK_SIDECAR_MAX_ORIGIN_NAME \
+    (BLOCK_SIDECAR_HEADER_SIZE - sizeof(BlockSidecarHeader) - \
+     BLOCK_SIDECAR_MAX_LAYOUT)
+
+/* End of disk format structures. */
+
+typedef struct BlockSidecarDriver {
+    /* Name of the child that holds the sidecar, e.g. "cache-file" */
+    const char *child_name;
+    /* What the sidecar holds, for error messages, e.g. "cache" */
+    const char *desc;
+    uint64_t magic;
+    uint32_t version;
+
+    /* Forget all metadata */
+    void (*reset)(BlockDriverState *bs);
+    /* Read the metadata, only called if the header matches */
+    int (*load)(BlockDriverState *bs, Error **errp);
+    /* Write the metadata back */
+    int (*store)(BlockDriverState *bs);
+} BlockSidecarDriver;
+
+typedef struct BlockSidecar {
+    const BlockSidecarDriver *drv;
+    BdrvChild *child;
+
+    uint64_t origin_size;
+    char origin_name[BLOCK_SIDECAR_MAX_ORIGIN_NAME];
+    uint8_t layout[BLOCK_SIDECAR_MAX_LAYOUT];
+    uint32_t layout_len;
+} BlockSidecar;
+
+/*
+ * Open the sidecar child of @bs described by @drv from @options.  The
+ * sidecar is written even if the origin is only read, so it does not
+ * inherit read-only.
+ */
+int block_sidecar_open(BlockDriverState *bs, BlockSidecar *sc,
+                       const BlockSidecarDriver *drv, QDict *options,
+                       Error **errp);
+
+/*
+ * Set the configuration that a sidecar must match to be used: the size of
+ * the origin @bs->file, and @layout_len bytes of big-endian @layout.
+ */
+void block_sidecar_set_layout(BlockDriverState *bs, BlockSidecar *sc,
+                              uint64_t origin_size, const void *layout,
+                              size_t layout_len);
+
+/*
+ * Load the metadata if the sidecar matches, and mark it dirty so that it is
+ * discarded if it is not written back.
+ */
+int block_sidecar_activate(BlockDriverState *bs, BlockSidecar *sc,
+                           Error **errp);
+
+/* Write the metadata back and mark the sidecar clean */
+int block_sidecar_inactivate(BlockDriverState *bs, BlockSidecar *sc);
+
+/* Write the metadata back if @bs is active, then drop the sidecar child */
+void block_sidecar_close(BlockDriverState *bs, BlockSidecar *sc);
+
+/* Permissions that @bs needs on its sidecar child */
+void block_sidecar_child_perm(BlockDriverState *bs, uint64_t *nperm,
+                              uint64_t *nshrd);
+
+#endif
@@ -62,6 +62,16 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * By default the members of a group with pending requests are served in
+ * round-robin order.  In fair-share mode the next member is instead the
+ * one with the lowest virtual time, a start-time fair queueing scheme:
+ * each request advances its member's virtual time by its cost divided by
+ * the member's weight, so members get a share of the group's I/O
+ * proportional to their weight.  Members that are idle do not compete,
+ * so their share goes to the others, and when they become busy again
+ * their virtual time is brought up to the group's so they cannot use up
+ * credit accumulated while idle.
  */
 typedef struct ThrottleGroup {
     Object parent_obj;
@@ -70,17 +80,24 @@ typedef struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
+    bool fair_share;
+    uint64_t vtime; /* start time of the last request in fair-share mode */
     QEMUClockType clock_type;
 
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
 
+/* Fixed per-request overhead charged in fair-share mode, in bytes */
+#define THROTTLE_FAIR_OP_COST       4096
+/* Writes are charged this many times as much as reads in fair-share mode */
+#define THROTTLE_FAIR_WRITE_FACTOR  2
+
 /* This is protected by the global QEMU mutex */
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
@@ -206,6 +223,61 @@ static inline bool tgm_has_pending_reqs(ThrottleGroupMember *tgm,
     return tgm->pending_reqs[is_write];
 }
 
+/* Return the virtual time at which the next request of a
+ * ThrottleGroupMember would start in fair-share mode.
+ *
+ * This assumes that tg->lock is held.
+ */
+static uint64_t tgm_fair_vtime(ThrottleGroup *tg, ThrottleGroupMember *tgm)
+{
+    return MAX(tgm->vtime, tg->vtime);
+}
+
+/* Charge an I/O request to a ThrottleGroupMember in fair-share mode.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember that performs the I/O
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_fair_charge(ThrottleGroup *tg,
+                                       ThrottleGroupMember *tgm,
+                                       unsigned int bytes, bool is_write)
+{
+    uint64_t cost = (uint64_t)bytes + THROTTLE_FAIR_OP_COST;
+
+    if (is_write) {
+        cost *= THROTTLE_FAIR_WRITE_FACTOR;
+    }
+
+    tg->vtime = tgm_fair_vtime(tg, tgm);
+    tgm->vtime = tg->vtime + cost * THROTTLE_GROUP_MAX_WEIGHT / tgm->weight;
+}
+
+/* Return the ThrottleGroupMember with pending I/O requests and the lowest
+ * virtual time, or NULL if no member has pending requests. Ties are broken
+ * in round-robin order, starting after the current token.
+ *
+ * This assumes that tg->lock is held.
+ */
+static ThrottleGroupMember *throttle_group_fair_next(ThrottleGroup *tg,
+                                                     bool is_write)
+{
+    ThrottleGroupMember *start, *token, *best = NULL;
+
+    start = token = tg->tokens[is_write];
+    do {
+        token = throttle_group_next_tgm(token);
+        if (tgm_has_pending_reqs(token, is_write) &&
+            (!best || tgm_fair_vtime(tg, token) < tgm_fair_vtime(tg, best))) {
+            best = token;
+        }
+    } while (token != start);
+
+    return best;
+}
+
 /* Return the next ThrottleGroupMember in the round-robin sequence with pending
  * I/O requests.
  *
@@ -232,6 +304,11 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
         return tgm;
     }
 
+    if (tg->fair_share) {
+        token = throttle_group_fair_next(tg, is_write);
+        return token ?: tgm;
+    }
+
     start = token = tg->tokens[is_write];
 
     /* get next bs round in round robin style */
@@ -335,8 +412,9 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current tgm */
-        if (qemu_in_coroutine() &&
+        /* Give preference to requests from the current tgm, unless another
+         * member is entitled to go first in fair-share mode */
+        if (qemu_in_coroutine() && (!tg->fair_share || token == tgm) &&
             throttle_group_co_restart_queue(tgm, is_write)) {
             token = tgm;
         } else {
@@ -384,6 +462,9 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, is_write, bytes);
+    if (tg->fair_share) {
+        throttle_group_fair_charge(tg, tgm, bytes, is_write);
+    }
 
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
@@ -459,6 +540,23 @@ void throttle_group_restart_tgm(ThrottleGroupMember *tgm)
     }
 }
 
+/* Set the weight of a ThrottleGroupMember, i.e. its share of the group's
+ * I/O relative to the other members when the group is in fair-share mode.
+ *
+ * @tgm:    a ThrottleGroupMember that is a member of the group
+ * @weight: the new weight, between 1 and THROTTLE_GROUP_MAX_WEIGHT
+ */
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned weight)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    assert(weight > 0 && weight <= THROTTLE_GROUP_MAX_WEIGHT);
+
+    qemu_mutex_lock(&tg->lock);
+    tgm->weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* Update the throttle configuration for a particular group. Similar
  * to throttle_config(), but guarantees atomicity within the
  * throttling group.
@@ -556,6 +654,12 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
 
+    /* New members start with the group's current virtual time */
+    if (!tgm->weight) {
+        tgm->weight = THROTTLE_GROUP_DEFAULT_WEIGHT;
+    }
+    tgm->vtime = tg->vtime;
+
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
                          tg->clock_type,
@@ -934,6 +1038,35 @@ static void throttle_group_get_limits(Object *obj, Visitor *v,
     visit_type_ThrottleLimits(v, name, &argp, errp);
 }
 
+static bool throttle_group_get_fair_share(Object *obj, Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    bool value;
+
+    qemu_mutex_lock(&tg->lock);
+    value = tg->fair_share;
+    qemu_mutex_unlock(&tg->lock);
+
+    return value;
+}
+
+static void throttle_group_set_fair_share(Object *obj, bool value,
+                                          Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    ThrottleGroupMember *tgm;
+
+    qemu_mutex_lock(&tg->lock);
+    if (value && !tg->fair_share) {
+        /* Forget the history from the last time fair-share was enabled */
+        QLIST_FOREACH(tgm, &tg->head, round_robin) {
+            tgm->vtime = tg->vtime;
+        }
+    }
+    tg->fair_share = value;
+    qemu_mutex_unlock(&tg->lock);
+}
+
 static bool throttle_group_can_be_deleted(UserCreatable *uc)
 {
     return OBJECT(uc)->ref == 1;
@@ -965,6 +1098,12 @@ static void throttle_group_obj_class_init(ObjectClass *klass, void *class_data)
                               throttle_group_set_limits,
                               NULL, NULL,
                               &error_abort);
+
+    /* Proportional sharing between the members */
+    object_class_property_add_bool(klass, "fair-share",
+                                   throttle_group_get_fair_share,
+                                   throttle_group_set_fair_share,
+                                   &error_abort);
 }
 
 static const TypeInfo throttle_group_info = {
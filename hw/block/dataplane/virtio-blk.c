@@ -43,8 +43,33 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /* With the "iothreads" property, virtqueue i is serviced by
+     * iothreads[i % num_iothreads] while the BlockBackend stays in the
+     * AioContext of iothreads[0] (@ctx).  Other IOThreads submit their
+     * requests under @ctx's lock, and @vq_lock serializes accesses to
+     * their vring against completions in @ctx.
+     */
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    AioContext **vq_ctx;
+    QemuMutex *vq_lock;             /* NULL if all vqs are serviced in @ctx */
 };
 
+void virtio_blk_data_plane_lock_vq(VirtIOBlockDataPlane *s, VirtQueue *vq)
+{
+    if (s->vq_lock) {
+        qemu_mutex_lock(&s->vq_lock[virtio_get_queue_index(vq)]);
+    }
+}
+
+void virtio_blk_data_plane_unlock_vq(VirtIOBlockDataPlane *s, VirtQueue *vq)
+{
+    if (s->vq_lock) {
+        qemu_mutex_unlock(&s->vq_lock[virtio_get_queue_index(vq)]);
+    }
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
@@ -73,7 +98,9 @@ static void notify_guest_bh(void *opaque)
             unsigned i = j + ctzl(bits);
             VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
+            virtio_blk_data_plane_lock_vq(s, vq);
             virtio_notify_irqfd(s->vdev, vq);
+            virtio_blk_data_plane_unlock_vq(s, vq);
 
             bits &= bits - 1; /* clear right-most bit */
         }
@@ -88,10 +115,28 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    g_auto(GStrv) iothread_ids = NULL;
+    unsigned num_iothreads = 0;
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->iothreads) {
+        error_setg(errp, "iothread and iothreads are mutually exclusive");
+        return false;
+    }
+    if (conf->iothreads) {
+        iothread_ids = g_strsplit(conf->iothreads, ":", -1);
+        num_iothreads = g_strv_length(iothread_ids);
+    }
+    for (i = 0; i < num_iothreads; i++) {
+        if (!iothread_by_id(iothread_ids[i])) {
+            error_setg(errp, "IOThread '%s' not found", iothread_ids[i]);
+            return false;
+        }
+    }
+
+    if (conf->iothread || num_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -120,13 +165,42 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
+    if (num_iothreads) {
+        s->num_iothreads = num_iothreads;
+        s->iothreads = g_new(IOThread *, s->num_iothreads);
+        for (i = 0; i < s->num_iothreads; i++) {
+            s->iothreads[i] = iothread_by_id(iothread_ids[i]);
+            object_ref(OBJECT(s->iothreads[i]));
+        }
+        s->iothread = s->iothreads[0];
+        object_ref(OBJECT(s->iothread));
+        s->ctx = iothread_get_aio_context(s->iothread);
+    } else if (conf->iothread) {
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
     } else {
         s->ctx = qemu_get_aio_context();
     }
+
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        if (s->num_iothreads) {
+            IOThread *iothread = s->iothreads[i % s->num_iothreads];
+
+            s->vq_ctx[i] = iothread_get_aio_context(iothread);
+        } else {
+            s->vq_ctx[i] = s->ctx;
+        }
+        if (s->vq_ctx[i] != s->ctx && !s->vq_lock) {
+            s->vq_lock = g_new(QemuMutex, conf->num_queues);
+        }
+    }
+    if (s->vq_lock) {
+        for (i = 0; i < conf->num_queues; i++) {
+            qemu_mutex_init(&s->vq_lock[i]);
+        }
+    }
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
@@ -139,6 +213,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -148,6 +223,17 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
+    if (s->vq_lock) {
+        for (i = 0; i < s->conf->num_queues; i++) {
+            qemu_mutex_destroy(&s->vq_lock[i]);
+        }
+        g_free(s->vq_lock);
+    }
+    g_free(s->vq_ctx);
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
@@ -165,6 +251,31 @@ static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
     return virtio_blk_handle_vq(s, vq);
 }
 
+static bool virtio_blk_data_plane_handle_output_batched(VirtIODevice *vdev,
+                                                        VirtQueue *vq)
+{
+    VirtIOBlock *s = (VirtIOBlock *)vdev;
+
+    assert(s->dataplane);
+    assert(s->dataplane_started);
+
+    return virtio_blk_handle_vq_batched(s, vq);
+}
+
+/* Return whether @ctx services a virtqueue but has not been seen yet */
+static bool virtio_blk_data_plane_first_vq_ctx(VirtIOBlockDataPlane *s,
+                                               unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (s->vq_ctx[i] == s->vq_ctx[n]) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /* Context: QEMU global mutex held */
 int virtio_blk_data_plane_start(VirtIODevice *vdev)
 {
@@ -228,14 +339,20 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
-
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
-                virtio_blk_data_plane_handle_output);
+        AioContext *ctx = s->vq_ctx[i];
+
+        aio_context_acquire(ctx);
+        if (ctx == s->ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx,
+                    virtio_blk_data_plane_handle_output);
+        } else {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx,
+                    virtio_blk_data_plane_handle_output_batched);
+        }
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -245,19 +362,23 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return -ENOSYS;
 }
 
-/* Stop notifications for new requests from guest.
+/* Stop notifications for new requests from guest on the virtqueues that are
+ * serviced by the current IOThread.
  *
  * Context: BH in IOThread
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_ctx[i] == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -284,6 +405,19 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    /* Stop the IOThreads that submit requests to s->ctx first, so that
+     * no new requests arrive once s->ctx has been drained.
+     */
+    for (i = 0; i < nvqs; i++) {
+        AioContext *ctx = s->vq_ctx[i];
+
+        if (ctx != s->ctx && virtio_blk_data_plane_first_vq_ctx(s, i)) {
+            aio_context_acquire(ctx);
+            aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+            aio_context_release(ctx);
+        }
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
@@ -72,6 +72,25 @@ static void virtio_blk_free_request(VirtIOBlockReq *req)
     g_free(req);
 }
 
+/*
+ * With several IOThreads, a virtqueue is popped in its own IOThread while
+ * requests complete in the BlockBackend's AioContext; the dataplane then
+ * provides a lock that serializes accesses to the vring.
+ */
+static void virtio_blk_vq_lock(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane) {
+        virtio_blk_data_plane_lock_vq(s->dataplane, vq);
+    }
+}
+
+static void virtio_blk_vq_unlock(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane) {
+        virtio_blk_data_plane_unlock_vq(s->dataplane, vq);
+    }
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -80,12 +99,22 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     trace_virtio_blk_req_complete(vdev, req, status);
 
     stb_p(&req->in->status, status);
+    virtio_blk_vq_lock(s, req->vq);
     virtqueue_push(req->vq, &req->elem, req->in_len);
     if (s->dataplane_started && !s->dataplane_disabled) {
         virtio_blk_data_plane_notify(s->dataplane, req->vq);
     } else {
         virtio_notify(vdev, req->vq);
     }
+    virtio_blk_vq_unlock(s, req->vq);
+}
+
+static void virtio_blk_detach_request(VirtIOBlockReq *req)
+{
+    virtio_blk_vq_lock(req->dev, req->vq);
+    virtqueue_detach_element(req->vq, &req->elem, 0);
+    virtio_blk_vq_unlock(req->dev, req->vq);
+    virtio_blk_free_request(req);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -778,8 +807,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         while ((req = virtio_blk_get_request(s, vq))) {
             progress = true;
             if (virtio_blk_handle_request(req, &mrb)) {
-                virtqueue_detach_element(req->vq, &req->elem, 0);
-                virtio_blk_free_request(req);
+                virtio_blk_detach_request(req);
                 break;
             }
         }
@@ -798,6 +826,71 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     return progress;
 }
 
+/*
+ * Service a virtqueue from an IOThread other than the BlockBackend's.  The
+ * vring is walked under the virtqueue lock only, so that several IOThreads
+ * pop their virtqueues concurrently.  The popped requests are then submitted
+ * from this IOThread in one plugged batch, holding the BlockBackend's
+ * AioContext lock just for the submission.
+ */
+bool virtio_blk_handle_vq_batched(VirtIOBlock *s, VirtQueue *vq)
+{
+    VirtIOBlockReq *req, *next, *head = NULL, **tail = &head;
+    MultiReqBuffer mrb = {};
+    bool suppress_notifications = virtio_queue_get_notification(vq);
+    unsigned num_reqs = 0;
+    bool empty;
+
+    do {
+        virtio_blk_vq_lock(s, vq);
+        if (suppress_notifications) {
+            virtio_queue_set_notification(vq, 0);
+        }
+
+        while ((req = virtio_blk_get_request(s, vq))) {
+            *tail = req;
+            tail = &req->next;
+            num_reqs++;
+        }
+
+        if (suppress_notifications) {
+            virtio_queue_set_notification(vq, 1);
+        }
+        empty = virtio_queue_empty(vq);
+        virtio_blk_vq_unlock(s, vq);
+    } while (!empty);
+
+    if (!head) {
+        return false;
+    }
+
+    trace_virtio_blk_handle_vq_batched(s, virtio_get_queue_index(vq),
+                                       num_reqs);
+
+    aio_context_acquire(blk_get_aio_context(s->blk));
+    blk_io_plug(s->blk);
+
+    for (req = head; req; req = next) {
+        next = req->next;
+        if (virtio_blk_handle_request(req, &mrb)) {
+            /* Device is broken, drop the rest of the batch */
+            for (; req; req = next) {
+                next = req->next;
+                virtio_blk_detach_request(req);
+            }
+            break;
+        }
+    }
+
+    if (mrb.num_reqs) {
+        virtio_blk_submit_multireq(s->blk, &mrb);
+    }
+
+    blk_io_unplug(s->blk);
+    aio_context_release(blk_get_aio_context(s->blk));
+    return true;
+}
+
 static void virtio_blk_handle_output_do(VirtIOBlock *s, VirtQueue *vq)
 {
     virtio_blk_handle_vq(s, vq);
@@ -1279,6 +1372,7 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BOOL("seg-max-adjust", VirtIOBlock, conf.seg_max_adjust, true),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_STRING("iothreads", VirtIOBlock, conf.iothreads),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
@@ -93,6 +93,33 @@ struct BlockAcctStats {
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
 };
 
+/*
+ * Per-node latency histograms use a log-linear bucket layout: values below
+ * BLOCK_LAT_SUB_BUCKETS get one bucket each, and every further power of two
+ * is split into BLOCK_LAT_SUB_BUCKETS linear buckets.  This bounds the
+ * relative error of any reported value to 1 / BLOCK_LAT_SUB_BUCKETS while
+ * covering 1 ns up to BLOCK_LAT_MAX_BITS bits (~18 minutes) in a fixed
+ * number of buckets.  Larger values are clamped into the last bucket.
+ */
+#define BLOCK_LAT_SUB_BITS      4
+#define BLOCK_LAT_SUB_BUCKETS   (1 << BLOCK_LAT_SUB_BITS)
+#define BLOCK_LAT_MAX_BITS      40
+#define BLOCK_LAT_NR_BUCKETS \
+    ((BLOCK_LAT_MAX_BITS - BLOCK_LAT_SUB_BITS + 2) * BLOCK_LAT_SUB_BUCKETS)
+
+typedef struct BlockLatencyLogHistogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t buckets[BLOCK_LAT_NR_BUCKETS];
+} BlockLatencyLogHistogram;
+
+typedef struct BlockNodeLatencyStats {
+    QemuMutex lock;
+    BlockLatencyLogHistogram hist[BLOCK_MAX_IOTYPE];
+} BlockNodeLatencyStats;
+
 typedef struct BlockAcctCookie {
     int64_t bytes;
     int64_t start_time_ns;
@@ -120,4 +147,19 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
 
+BlockNodeLatencyStats *block_node_latency_stats_new(void);
+void block_node_latency_stats_free(BlockNodeLatencyStats *stats);
+int64_t block_node_latency_start(BlockNodeLatencyStats *stats);
+void block_node_latency_done(BlockNodeLatencyStats *stats,
+                             enum BlockAcctType type, int64_t start_ns);
+void block_node_latency_account(BlockNodeLatencyStats *stats,
+                                enum BlockAcctType type, uint64_t latency_ns);
+void block_node_latency_snapshot(BlockNodeLatencyStats *stats,
+                                 enum BlockAcctType type,
+                                 BlockLatencyLogHistogram *hist);
+unsigned block_latency_log_bucket(uint64_t value);
+uint64_t block_latency_log_bucket_upper(unsigned idx);
+uint64_t block_latency_log_percentile(const BlockLatencyLogHistogram *hist,
+                                      unsigned per_mille);
+
 #endif
@@ -210,6 +210,9 @@ struct AioContext {
      */
     struct LuringState *linux_io_uring;
 
+    /* Create linux_io_uring with a kernel submission queue polling thread */
+    bool linux_io_uring_sqpoll;
+
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
@@ -491,6 +494,19 @@ struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+/**
+ * aio_context_set_io_uring_sqpoll:
+ * @ctx: the aio context
+ * @sqpoll: whether Linux io_uring requests are submitted by a kernel thread
+ *
+ * Submission queue polling saves the io_uring_enter() system call per batch
+ * of requests, at the cost of a kernel thread that spins while I/O is
+ * submitted.  It only makes sense for an AioContext that is dedicated to
+ * block I/O, and only affects an io_uring instance that has not been set up
+ * yet.
+ */
+void aio_context_set_io_uring_sqpoll(AioContext *ctx, bool sqpoll);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -30,6 +30,11 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if a compressed write may cover several clusters, which the
+     * driver then compresses in parallel
+     */
+    bool compressed_writes_multi_cluster;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -735,4 +740,63 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
                                     BdrvChild *dst, uint64_t dst_offset,
                                     uint64_t bytes, BdrvRequestFlags read_flags,
                                     BdrvRequestFlags write_flags);
+
+/**
+ * bdrv_get_host_fd:
+ *
+ * Find the host file that holds the guest data in [@offset, @offset + @bytes)
+ * of @bs unchanged, so that it can be read with plain system calls, e.g. to
+ * pass it to sendfile(2) without a bounce buffer.  This only works for
+ * drivers that map guest data 1:1 onto a file (raw over file or
+ * host_device, without O_DIRECT), and only as long as the block layer has
+ * nothing to do on reads of @bs (copy-on-read, serialising requests or
+ * latency accounting).
+ *
+ * The descriptor is only valid until the caller yields, since the node may
+ * be reopened in the meantime; call this again after every yield.  The
+ * caller must only read from it.
+ *
+ * Returns: the file descriptor, with the matching file offset stored in
+ * @host_offset, or -ENOTSUP if the data cannot be read directly.
+ **/
+int bdrv_get_host_fd(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     int64_t *host_offset);
+
+#ifdef CONFIG_SENDFILE
+/**
+ * bdrv_co_sendfile:
+ *
+ * Send up to @bytes of guest data at @offset of @bs to the socket @out_fd
+ * with sendfile(2), see bdrv_get_host_fd().  This is a read request like
+ * any other: it is tracked, waits for overlapping serialising requests and
+ * keeps drain waiting until it is done, but like bdrv_co_preadv() it does
+ * not wait for a drained section to end; users of a BlockBackend must call
+ * blk_co_sendfile() instead.  The copy runs in the thread pool.  @out_fd
+ * may be non-blocking.
+ *
+ * Returns: the number of bytes sent, 0 at the end of the host file,
+ * -ENOTSUP if the data cannot be sent directly, -EAGAIN if @out_fd is full
+ * or another negative errno.
+ **/
+int coroutine_fn bdrv_co_sendfile(BlockDriverState *bs, int64_t offset,
+                                  int64_t bytes, int out_fd);
+#endif
+
+#define BDRV_CONTENT_HASH_SIZE 16
+
+/**
+ * bdrv_get_content_hash:
+ *
+ * Look up the hash of the guest data at @offset of @bs, as recorded by a
+ * content-hash filter node at or below @bs.  @offset must be aligned to the
+ * granularity of the hashes.  Data with equal hashes is the same, so callers
+ * can skip comparing or copying it without reading it.
+ *
+ * Returns: 0 with BDRV_CONTENT_HASH_SIZE bytes stored in @hash and the
+ * number of bytes covered by it in @pnum, -ENOENT if the hash is not known
+ * (yet), -EINVAL if @offset is not aligned or beyond the end of @bs, or
+ * -ENOTSUP if @bs does not record hashes.
+ **/
+int bdrv_get_content_hash(BlockDriverState *bs, int64_t offset, uint8_t *hash,
+                          int64_t *pnum);
 #endif
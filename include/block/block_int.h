@@ -57,6 +57,8 @@
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -281,6 +283,24 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /* Map [offset, offset + bytes) onto a host file that contains the data
+     * as is and return its descriptor, or -ENOTSUP.  Filters and formats
+     * that do not change the data call bdrv_get_host_fd() on their child.
+     *
+     * See the comment of bdrv_get_host_fd for the parameter and return
+     * value semantics.
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, int64_t *host_offset);
+
+    /* Look up the recorded hash of the data at @offset without reading it.
+     *
+     * See the comment of bdrv_get_content_hash for the parameter and return
+     * value semantics.
+     */
+    int (*bdrv_get_content_hash)(BlockDriverState *bs, int64_t offset,
+                                 uint8_t *hash, int64_t *pnum);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -890,6 +910,12 @@ struct BlockDriverState {
     uint64_t write_threshold_offset;
     NotifierWithReturn write_threshold_notifier;
 
+    /*
+     * Per-node request latency histograms, NULL unless enabled with
+     * block-node-latency-histogram-set.  Only changed in a drained section.
+     */
+    BlockNodeLatencyStats *latency_stats;
+
     /* Writing to the list requires the BQL _and_ the dirty_bitmap_mutex.
      * Reading from the list can be done with either the BQL or the
      * dirty_bitmap_mutex.  Modifying a bitmap only requires
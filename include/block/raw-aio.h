@@ -60,8 +60,13 @@ void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s);
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
 typedef struct LuringState LuringState;
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(bool sqpoll, Error **errp);
 void luring_cleanup(LuringState *s);
+int luring_register_file(LuringState *s, int fd, Error **errp);
+void luring_unregister_file(LuringState *s, int fd);
+bool luring_needs_fixed_files(LuringState *s);
+void luring_register_ram(LuringState *s);
+void luring_unregister_ram(LuringState *s);
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
                                 uint64_t offset, QEMUIOVector *qiov, int type);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
@@ -56,8 +56,17 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /* Share of the group in fair-share mode, and the virtual time
+     * (weighted cost of the I/O performed so far) used to pick the next
+     * member to be served. */
+    unsigned       weight;
+    uint64_t       vtime;
+
 } ThrottleGroupMember;
 
+#define THROTTLE_GROUP_DEFAULT_WEIGHT 100
+#define THROTTLE_GROUP_MAX_WEIGHT     10000
+
 #define TYPE_THROTTLE_GROUP "throttle-group"
 #define THROTTLE_GROUP(obj) OBJECT_CHECK(ThrottleGroup, (obj), TYPE_THROTTLE_GROUP)
 
@@ -74,6 +83,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
                                 AioContext *ctx);
 void throttle_group_unregister_tgm(ThrottleGroupMember *tgm);
 void throttle_group_restart_tgm(ThrottleGroupMember *tgm);
+void throttle_group_set_weight(ThrottleGroupMember *tgm, unsigned weight);
 
 void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm,
                                                         unsigned int bytes,
@@ -59,6 +59,15 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * With the mapped-ram capability, bitmap of the pages whose data is
+     * stored in the migration file (the others are zero), and where the
+     * bitmap and the page data of this block live in the file.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 #endif
 #endif
@@ -331,6 +331,10 @@ struct qemu_work_item;
  * @opaque: User data.
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: Dirty ring shared with KVM, if the dirty ring is enabled.
+ * @kvm_fetch_index: Index of the next dirty ring entry to collect.
+ * @dirty_pages: Number of pages this vCPU dirtied, as reported by KVM.  Host
+ *               word sized so that it can be read atomically; it may wrap.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate_delayed: Delayed changes to trace_dstate (includes all changes
@@ -410,6 +414,9 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    unsigned long dirty_pages;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -433,6 +440,8 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle applied to this vCPU only, see cpu_throttle_set_vcpu() */
+    int throttle_percentage;
 
     bool ignore_memory_transaction_failures;
 
@@ -831,10 +840,30 @@ CPUState *cpu_by_arch_id(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time, 0 to stop throttling @cpu.
+ *
+ * Like cpu_throttle_set, but only for @cpu.  If all vcpus are throttled
+ * as well, @cpu sleeps for the larger of the two percentages.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vCPU to query.
+ *
+ * Returns: The throttle percentage set by cpu_throttle_set_vcpu for @cpu,
+ * 0 if it is not throttled on its own.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
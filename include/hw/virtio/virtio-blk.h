@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;            /* ':'-separated, assigned round-robin */
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -86,5 +87,6 @@ typedef struct MultiReqBuffer {
 } MultiReqBuffer;
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
+bool virtio_blk_handle_vq_batched(VirtIOBlock *s, VirtQueue *vq);
 
 #endif
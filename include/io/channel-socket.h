@@ -48,6 +48,8 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    size_t zero_copy_queued;
+    size_t zero_copy_sent;
 };
 
 
@@ -94,6 +96,21 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
                                     SocketAddress *addr,
                                     Error **errp);
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Enable SO_ZEROCOPY on the connected socket @ioc, so that it
+ * supports writes with the QIO_CHANNEL_WRITE_FLAG_ZERO_COPY
+ * flag.  This is only worth it for large bulk writes, so it is
+ * not done for every socket.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc,
+                                        Error **errp);
+
 /**
  * qio_channel_socket_connect_async:
  * @ioc: the socket channel object
@@ -262,6 +262,15 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                                    int bytes, BdrvRequestFlags read_flags,
                                    BdrvRequestFlags write_flags);
 
+#ifdef CONFIG_SENDFILE
+/*
+ * Like bdrv_co_sendfile(), but as a request of @blk: waits while @blk is
+ * drained and checks the request against the size of @blk.
+ */
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int64_t bytes, int out_fd);
+#endif
+
 const BdrvChild *blk_root(BlockBackend *blk);
 
 #endif
@@ -206,6 +206,8 @@ typedef struct Notifier Notifier;
 /* external API */
 
 bool kvm_has_free_slot(MachineState *ms);
+bool kvm_dirty_ring_enabled(void);
+void kvm_cleanup(void);
 bool kvm_has_sync_mmu(void);
 int kvm_has_vcpu_events(void);
 int kvm_has_robust_singlestep(void);
@@ -192,6 +192,7 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         iothread->ctx = NULL;
         return;
     }
+    aio_context_set_io_uring_sqpoll(iothread->ctx, iothread->io_uring_sqpoll);
 
     /* This assumes we are called from a thread with useful CPU affinity for us
      * to inherit.
@@ -268,6 +269,24 @@ out:
     error_propagate(errp, local_err);
 }
 
+static bool iothread_get_io_uring_sqpoll(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return iothread->io_uring_sqpoll;
+}
+
+static void iothread_set_io_uring_sqpoll(Object *obj, bool value,
+                                         Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->io_uring_sqpoll = value;
+    if (iothread->ctx) {
+        aio_context_set_io_uring_sqpoll(iothread->ctx, value);
+    }
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -285,6 +304,10 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add_bool(klass, "io-uring-sqpoll",
+                                   iothread_get_io_uring_sqpoll,
+                                   iothread_set_io_uring_sqpoll,
+                                   &error_abort);
 }
 
 static const TypeInfo iothread_info = {
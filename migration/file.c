@@ -0,0 +1,109 @@
+/*
+ * QEMU live migration to and from plain files
+ *
+ * Unlike "exec:cat > path", the file: transport gives the migration
+ * code a seekable channel, so that with the mapped-ram capability every
+ * RAM page is stored at a fixed offset of the file.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+static struct FileOutgoingArgs {
+    /*
+     * Where extra (multifd) channels of the outgoing migration are
+     * opened.  Only set while a file: migration is running.
+     */
+    char *path;
+} outgoing_args;
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_outgoing(path);
+    fioc = qio_channel_file_new_path(path, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    g_free(outgoing_args.path);
+    outgoing_args.path = g_strdup(path);
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL, NULL);
+    object_unref(OBJECT(fioc));
+}
+
+/* Forget the file of the outgoing migration once it is over */
+void file_cleanup_outgoing_migration(void)
+{
+    g_free(outgoing_args.path);
+    outgoing_args.path = NULL;
+}
+
+/*
+ * Open one more channel on the outgoing file for a multifd thread.
+ * Each channel has its own file descriptor, and they only ever write
+ * to disjoint ranges of the file at fixed offsets.  As for sockets, the
+ * channel is only referenced by the task; @f takes its own reference.
+ */
+void file_send_channel_create(QIOTaskFunc f, void *data)
+{
+    QIOChannelFile *fioc = NULL;
+    Error *local_err = NULL;
+    QIOTask *task;
+
+    if (!outgoing_args.path) {
+        error_setg(&local_err, "multifd channels on a file need the "
+                   "file: migration transport");
+    } else {
+        fioc = qio_channel_file_new_path(outgoing_args.path, O_WRONLY, 0,
+                                         &local_err);
+    }
+
+    task = qio_task_new(OBJECT(fioc), f, data, NULL);
+    if (fioc) {
+        object_unref(OBJECT(fioc));
+    }
+    if (local_err) {
+        qio_task_set_error(task, local_err);
+    }
+    qio_task_complete(task);
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(path);
+    fioc = qio_channel_file_new_path(path, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch_full(QIO_CHANNEL(fioc), G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
@@ -20,8 +20,10 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
+#include "sysemu/kvm.h"
 #include "sysemu/sysemu.h"
 #include "rdma.h"
 #include "ram.h"
@@ -49,6 +51,7 @@
 #include "io/channel-buffer.h"
 #include "migration/colo.h"
 #include "hw/boards.h"
+#include "hw/core/cpu.h"
 #include "hw/qdev-properties.h"
 #include "monitor/monitor.h"
 #include "net/announce.h"
@@ -94,6 +97,8 @@
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+/* Place precopy pages in the main incoming thread */
+#define DEFAULT_MIGRATE_LOAD_THREADS 0
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -361,6 +366,13 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
 
+    if (migrate_mapped_ram() && strcmp(uri, "defer") &&
+        !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram requires the file: migration "
+                   "transport");
+        return;
+    }
+
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
@@ -376,6 +388,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -627,8 +641,10 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
         /*
          * Common migration only needs one channel, so we can start
          * right now.  Multifd needs more than one channel, we wait.
+         * With mapped-ram the pages are read from the file itself, so
+         * there are no multifd channels to wait for.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() || migrate_mapped_ram();
     } else {
         /* Multiple connections */
         assert(migrate_use_multifd());
@@ -785,6 +801,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->cpu_throttle_initial = s->parameters.cpu_throttle_initial;
     params->has_cpu_throttle_increment = true;
     params->cpu_throttle_increment = s->parameters.cpu_throttle_increment;
+    params->has_cpu_throttle_adaptive = true;
+    params->cpu_throttle_adaptive = s->parameters.cpu_throttle_adaptive;
+    params->has_cpu_throttle_per_vcpu = true;
+    params->cpu_throttle_per_vcpu = s->parameters.cpu_throttle_per_vcpu;
     params->has_tls_creds = true;
     params->tls_creds = g_strdup(s->parameters.tls_creds);
     params->has_tls_hostname = true;
@@ -808,6 +828,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->multifd_zlib_level = s->parameters.multifd_zlib_level;
     params->has_multifd_zstd_level = true;
     params->multifd_zstd_level = s->parameters.multifd_zstd_level;
+    params->has_load_threads = true;
+    params->load_threads = s->parameters.load_threads;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
     params->has_max_postcopy_bandwidth = true;
@@ -921,6 +943,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_missed_zero_copy =
+        ram_counters.dirty_sync_missed_zero_copy;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -950,6 +974,33 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
     }
 
+    if (migrate_auto_converge() && s->parameters.cpu_throttle_adaptive) {
+        info->adaptive_throttle = ram_adaptive_throttle_info();
+        info->has_adaptive_throttle = !!info->adaptive_throttle;
+    }
+
+    if (migrate_auto_converge() && s->parameters.cpu_throttle_per_vcpu &&
+        kvm_dirty_ring_enabled()) {
+        uint8List **tail = &info->vcpu_throttle_percentage;
+        CPUState *cpu;
+
+        CPU_FOREACH(cpu) {
+            uint8List *entry = g_new0(uint8List, 1);
+
+            entry->value = cpu_throttle_get_vcpu_percentage(cpu);
+            *tail = entry;
+            tail = &entry->next;
+        }
+        info->has_vcpu_throttle_percentage = true;
+    }
+
+    if (migrate_postcopy_ram() &&
+        (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+         s->state == MIGRATION_STATUS_COMPLETED)) {
+        info->has_postcopy_faults = true;
+        info->postcopy_faults = ram_postcopy_fault_stats();
+    }
+
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         info->ram->remaining = ram_bytes_remaining();
         info->ram->dirty_pages_rate = ram_counters.dirty_pages_rate;
@@ -1079,6 +1130,57 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Multifd zero page detection requires multifd");
+        return false;
+    }
+
+#ifdef CONFIG_LINUX
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Zero copy send requires multifd");
+            return false;
+        }
+        if (migrate_get_current()->parameters.multifd_compression !=
+            MULTIFD_COMPRESSION_NONE) {
+            error_setg(errp, "Zero copy send is only available for "
+                       "non-compressed multifd migration");
+            return false;
+        }
+    }
+#endif
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        if (cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Mapped-ram is not compatible with xbzrle "
+                       "or compress");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Mapped-ram is not compatible with postcopy");
+            return false;
+        }
+#ifdef CONFIG_LINUX
+        if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+            error_setg(errp, "Mapped-ram is not compatible with zero copy "
+                       "send");
+            return false;
+        }
+#endif
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Mapped-ram requires multifd");
+            return false;
+        }
+        if (migrate_get_current()->parameters.multifd_compression !=
+            MULTIFD_COMPRESSION_NONE) {
+            error_setg(errp, "Mapped-ram is only available for "
+                       "non-compressed multifd migration");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1238,6 +1340,20 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (migrate_use_zero_copy_send() && params->has_multifd_compression &&
+        params->multifd_compression != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "Zero copy send is only available for "
+                   "non-compressed multifd migration");
+        return false;
+    }
+
+    if (migrate_mapped_ram() && params->has_multifd_compression &&
+        params->multifd_compression != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "Mapped-ram is only available for "
+                   "non-compressed multifd migration");
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1324,6 +1440,14 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
         dest->cpu_throttle_increment = params->cpu_throttle_increment;
     }
 
+    if (params->has_cpu_throttle_adaptive) {
+        dest->cpu_throttle_adaptive = params->cpu_throttle_adaptive;
+    }
+
+    if (params->has_cpu_throttle_per_vcpu) {
+        dest->cpu_throttle_per_vcpu = params->cpu_throttle_per_vcpu;
+    }
+
     if (params->has_tls_creds) {
         assert(params->tls_creds->type == QTYPE_QSTRING);
         dest->tls_creds = g_strdup(params->tls_creds->u.s);
@@ -1352,6 +1476,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_channels) {
         dest->multifd_channels = params->multifd_channels;
     }
+    if (params->has_load_threads) {
+        dest->load_threads = params->load_threads;
+    }
     if (params->has_multifd_compression) {
         dest->multifd_compression = params->multifd_compression;
     }
@@ -1412,6 +1539,14 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.cpu_throttle_increment = params->cpu_throttle_increment;
     }
 
+    if (params->has_cpu_throttle_adaptive) {
+        s->parameters.cpu_throttle_adaptive = params->cpu_throttle_adaptive;
+    }
+
+    if (params->has_cpu_throttle_per_vcpu) {
+        s->parameters.cpu_throttle_per_vcpu = params->cpu_throttle_per_vcpu;
+    }
+
     if (params->has_tls_creds) {
         g_free(s->parameters.tls_creds);
         assert(params->tls_creds->type == QTYPE_QSTRING);
@@ -1455,6 +1590,9 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_channels) {
         s->parameters.multifd_channels = params->multifd_channels;
     }
+    if (params->has_load_threads) {
+        s->parameters.load_threads = params->load_threads;
+    }
     if (params->has_multifd_compression) {
         s->parameters.multifd_compression = params->multifd_compression;
     }
@@ -1505,6 +1643,18 @@ void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
         params->tls_hostname->u.s = strdup("");
     }
 
+    /*
+     * MigrationParameters stores load-threads as uint8, so check the
+     * range before migrate_params_test_apply() truncates it.
+     */
+    if (params->has_load_threads &&
+        (params->load_threads < 0 || params->load_threads > UINT8_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "load_threads",
+                   "is invalid, it should be in the range of 0 to 255");
+        return;
+    }
+
     migrate_params_test_apply(params, &tmp);
 
     if (!migrate_params_check(&tmp, errp)) {
@@ -1608,6 +1758,7 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_mutex_lock_iothread();
 
         multifd_save_cleanup();
+        file_cleanup_outgoing_migration();
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
@@ -2030,6 +2181,13 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     const char *p;
 
+    /* The multifd channels open the file of the migration themselves */
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram requires the file: migration "
+                   "transport");
+        return;
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -2048,6 +2206,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -2174,6 +2334,24 @@ bool migrate_postcopy_blocktime(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME];
 }
 
+bool migrate_postcopy_prefetch(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -2264,6 +2442,26 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE];
+}
+
+#ifdef CONFIG_LINUX
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+#endif
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2310,6 +2508,15 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+int migrate_load_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.load_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -3160,7 +3367,7 @@ static MigThrError migration_detect_error(MigrationState *s)
 /* How many bytes have we transferred since the beginning of the migration */
 static uint64_t migration_total_bytes(MigrationState *s)
 {
-    return qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes;
+    return qemu_file_transferred(s->to_dst_file) + ram_counters.multifd_bytes;
 }
 
 static void migration_calculate_complete(MigrationState *s)
@@ -3594,6 +3801,10 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("x-cpu-throttle-increment", MigrationState,
                       parameters.cpu_throttle_increment,
                       DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT),
+    DEFINE_PROP_BOOL("x-cpu-throttle-adaptive", MigrationState,
+                      parameters.cpu_throttle_adaptive, false),
+    DEFINE_PROP_BOOL("x-cpu-throttle-per-vcpu", MigrationState,
+                      parameters.cpu_throttle_per_vcpu, false),
     DEFINE_PROP_SIZE("x-max-bandwidth", MigrationState,
                       parameters.max_bandwidth, MAX_THROTTLE),
     DEFINE_PROP_UINT64("x-downtime-limit", MigrationState,
@@ -3614,6 +3825,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
                       parameters.multifd_zstd_level,
                       DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_UINT8("x-load-threads", MigrationState,
+                      parameters.load_threads,
+                      DEFAULT_MIGRATE_LOAD_THREADS),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -3649,6 +3863,11 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-multifd-zero-page",
+                        MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE),
+    DEFINE_PROP_MIG_CAP("x-postcopy-prefetch",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREFETCH),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -3700,6 +3919,8 @@ static void migration_instance_init(Object *obj)
     params->has_throttle_trigger_threshold = true;
     params->has_cpu_throttle_initial = true;
     params->has_cpu_throttle_increment = true;
+    params->has_cpu_throttle_adaptive = true;
+    params->has_cpu_throttle_per_vcpu = true;
     params->has_max_bandwidth = true;
     params->has_downtime_limit = true;
     params->has_x_checkpoint_delay = true;
@@ -3708,6 +3929,7 @@ static void migration_instance_init(Object *obj)
     params->has_multifd_compression = true;
     params->has_multifd_zlib_level = true;
     params->has_multifd_zstd_level = true;
+    params->has_load_threads = true;
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
@@ -0,0 +1,534 @@
+/*
+ * Multifd XBZRLE compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "exec/target_page.h"
+#include "exec/ramblock.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "ram.h"
+#include "trace.h"
+#include "multifd.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+
+/*
+ * Each page in the packet is preceded by one byte telling how it was
+ * encoded.  XBZRLE pages are followed by a be16 length and the encoded
+ * data, raw pages by the full page, and nothing follows zero and
+ * unmodified pages.
+ */
+#define MULTIFD_XBZRLE_PAGE_RAW       0
+#define MULTIFD_XBZRLE_PAGE_XBZRLE    1
+#define MULTIFD_XBZRLE_PAGE_ZERO      2
+#define MULTIFD_XBZRLE_PAGE_UNCHANGED 3
+
+/*
+ * The page cache is split in one shard per channel.  The shard of a
+ * page is chosen from its address, not from the channel that sends
+ * it, so the cached copy of a page is always found no matter which
+ * channel sends it next.  Each shard has its own lock, so channels
+ * only contend when they touch pages of the same shard at the same
+ * time.
+ *
+ * Pages are spread over the shards with the low bits of the page number.
+ * The page cache itself is also indexed by the low bits of the address,
+ * so the cache key of a page is its page number divided by the number of
+ * shards; otherwise each shard would only ever use 1/nr_shards of its
+ * slots.
+ */
+typedef struct {
+    QemuMutex lock;
+    PageCache *cache;
+} XBZRLECacheShard;
+
+static struct {
+    XBZRLECacheShard *shards;
+    int nr_shards;
+    /* number of channels using the shards */
+    int users;
+} multifd_xbzrle;
+
+struct xbzrle_data {
+    /* copy of the page being encoded, the guest can change it under us */
+    uint8_t *current_buf;
+    /* buffer with the encoded packet */
+    uint8_t *buf;
+    /* size of the encoded packet buffer */
+    uint32_t buf_len;
+};
+
+static XBZRLECacheShard *xbzrle_shard_for(ram_addr_t addr)
+{
+    uint64_t page = addr / qemu_target_page_size();
+
+    return &multifd_xbzrle.shards[page % multifd_xbzrle.nr_shards];
+}
+
+/* The key of the page at @addr in the cache of its shard */
+static uint64_t xbzrle_shard_key(ram_addr_t addr)
+{
+    size_t page_size = qemu_target_page_size();
+
+    return addr / page_size / multifd_xbzrle.nr_shards * page_size;
+}
+
+/* Size of the cache of each shard for a total cache size of @cache_size */
+static int64_t xbzrle_shard_cache_size(int64_t cache_size, int nr_shards)
+{
+    size_t page_size = qemu_target_page_size();
+    int64_t shard_size = cache_size / nr_shards;
+
+    /* cache_init() wants a power of two number of pages per shard */
+    return pow2floor(MAX(shard_size, page_size) / page_size) * page_size;
+}
+
+static int xbzrle_cache_setup(Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    int nr_shards = migrate_multifd_channels();
+    int64_t shard_size;
+    int i;
+
+    if (multifd_xbzrle.users++) {
+        return 0;
+    }
+
+    shard_size = xbzrle_shard_cache_size(migrate_xbzrle_cache_size(),
+                                         nr_shards);
+
+    multifd_xbzrle.shards = g_new0(XBZRLECacheShard, nr_shards);
+    multifd_xbzrle.nr_shards = nr_shards;
+    for (i = 0; i < nr_shards; i++) {
+        qemu_mutex_init(&multifd_xbzrle.shards[i].lock);
+    }
+    for (i = 0; i < nr_shards; i++) {
+        XBZRLECacheShard *shard = &multifd_xbzrle.shards[i];
+
+        shard->cache = cache_init(shard_size, page_size, errp);
+        if (!shard->cache) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void xbzrle_cache_cleanup(void)
+{
+    int i;
+
+    if (--multifd_xbzrle.users) {
+        return;
+    }
+
+    for (i = 0; i < multifd_xbzrle.nr_shards; i++) {
+        XBZRLECacheShard *shard = &multifd_xbzrle.shards[i];
+
+        if (shard->cache) {
+            cache_fini(shard->cache);
+            shard->cache = NULL;
+        }
+        qemu_mutex_destroy(&shard->lock);
+    }
+    g_free(multifd_xbzrle.shards);
+    multifd_xbzrle.shards = NULL;
+    multifd_xbzrle.nr_shards = 0;
+}
+
+/**
+ * multifd_xbzrle_cache_resize: resize the sharded page cache
+ *
+ * Called with the BQL held when xbzrle-cache-size changes.  The cached
+ * pages are dropped, as for the single cache of the legacy xbzrle path.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @new_size: new total cache size
+ * @errp: pointer to an error
+ */
+int multifd_xbzrle_cache_resize(int64_t new_size, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    int64_t shard_size;
+    PageCache **caches;
+    int i;
+
+    if (!multifd_xbzrle.shards) {
+        return 0;
+    }
+
+    /* Allocate everything first so that failure leaves the old caches */
+    shard_size = xbzrle_shard_cache_size(new_size, multifd_xbzrle.nr_shards);
+    caches = g_new0(PageCache *, multifd_xbzrle.nr_shards);
+    for (i = 0; i < multifd_xbzrle.nr_shards; i++) {
+        caches[i] = cache_init(shard_size, page_size, errp);
+        if (!caches[i]) {
+            while (i--) {
+                cache_fini(caches[i]);
+            }
+            g_free(caches);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < multifd_xbzrle.nr_shards; i++) {
+        XBZRLECacheShard *shard = &multifd_xbzrle.shards[i];
+
+        qemu_mutex_lock(&shard->lock);
+        cache_fini(shard->cache);
+        shard->cache = caches[i];
+        qemu_mutex_unlock(&shard->lock);
+    }
+    g_free(caches);
+    return 0;
+}
+
+/* Multifd xbzrle compression */
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Setup the shared page cache and the buffers of each channel.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct xbzrle_data *x = g_malloc0(sizeof(struct xbzrle_data));
+
+    p->data = x;
+    if (xbzrle_cache_setup(errp) < 0) {
+        return -1;
+    }
+
+    x->current_buf = g_malloc(qemu_target_page_size());
+    /* Worst case every page is sent raw after its encoding byte */
+    x->buf_len = page_count * (qemu_target_page_size() + 1);
+    x->buf = g_try_malloc(x->buf_len);
+    if (!x->buf) {
+        error_setg(errp, "multifd %d: out of memory for xbzrle buffer",
+                   p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Free the buffers, and the page cache when the last channel goes.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+
+    if (!x) {
+        return;
+    }
+    xbzrle_cache_cleanup();
+    g_free(x->current_buf);
+    g_free(x->buf);
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_encode_page: encode one page against its cached copy
+ *
+ * Returns the number of bytes written to @out
+ *
+ * @x: channel data
+ * @addr: ram_addr of the page, used as cache key
+ * @age: dirty bitmap sync generation of the page
+ * @page: the guest page
+ * @out: where to write the encoding byte and the page data
+ */
+static uint32_t xbzrle_encode_page(struct xbzrle_data *x, ram_addr_t addr,
+                                   uint64_t age, uint8_t *page, uint8_t *out)
+{
+    size_t page_size = qemu_target_page_size();
+    XBZRLECacheShard *shard = xbzrle_shard_for(addr);
+    uint64_t key = xbzrle_shard_key(addr);
+    uint8_t *cached;
+    int encoded_len;
+
+    /* Work on a copy, the guest can still write to the page */
+    memcpy(x->current_buf, page, page_size);
+
+    qemu_mutex_lock(&shard->lock);
+
+    if (buffer_is_zero(x->current_buf, page_size)) {
+        /* Keep the cache in sync with what the destination has */
+        cache_insert(shard->cache, key, x->current_buf, age);
+        qemu_mutex_unlock(&shard->lock);
+        out[0] = MULTIFD_XBZRLE_PAGE_ZERO;
+        return 1;
+    }
+
+    if (!cache_is_cached(shard->cache, key, age)) {
+        cache_insert(shard->cache, key, x->current_buf, age);
+        qemu_mutex_unlock(&shard->lock);
+        goto raw;
+    }
+
+    cached = get_cached_data(shard->cache, key);
+    /* leave room for the be16 length */
+    encoded_len = xbzrle_encode_buffer(cached, x->current_buf, page_size,
+                                       out + 3, page_size - 3);
+    memcpy(cached, x->current_buf, page_size);
+    qemu_mutex_unlock(&shard->lock);
+
+    if (encoded_len == 0) {
+        out[0] = MULTIFD_XBZRLE_PAGE_UNCHANGED;
+        return 1;
+    } else if (encoded_len < 0) {
+        goto raw;
+    }
+
+    out[0] = MULTIFD_XBZRLE_PAGE_XBZRLE;
+    stw_be_p(out + 1, encoded_len);
+    return encoded_len + 3;
+
+raw:
+    out[0] = MULTIFD_XBZRLE_PAGE_RAW;
+    memcpy(out + 1, x->current_buf, page_size);
+    return page_size + 1;
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Encode each page against its cached copy in one buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+    MultiFDPages_t *pages = p->pages;
+    RAMBlock *rb = pages->block;
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        out_size += xbzrle_encode_page(x, rb->offset + pages->offset[i],
+                                       p->dirty_sync_count,
+                                       pages->iov[i].iov_base,
+                                       x->buf + out_size);
+    }
+
+    /*
+     * Zero pages found by multifd-zero-page are not encoded, but the
+     * cache still has to know about them.  Don't cache the guest page
+     * itself, it may not be zero anymore.
+     */
+    memset(x->current_buf, 0, qemu_target_page_size());
+    for (i = used; i < used + p->zero_num; i++) {
+        ram_addr_t addr = rb->offset + pages->offset[i];
+        XBZRLECacheShard *shard = xbzrle_shard_for(addr);
+
+        qemu_mutex_lock(&shard->lock);
+        cache_insert(shard->cache, xbzrle_shard_key(addr), x->current_buf,
+                     p->dirty_sync_count);
+        qemu_mutex_unlock(&shard->lock);
+    }
+
+    trace_multifd_xbzrle_send(p->id, used, out_size);
+    p->next_packet_size = out_size;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    return 0;
+}
+
+/**
+ * xbzrle_send_write: do the actual write of the data
+ *
+ * Do the actual write of the encoded buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+
+    return qio_channel_write_all(p->c, (void *)x->buf, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Create the buffer for the encoded data.  The destination applies
+ * the deltas on top of guest memory, so it doesn't need a cache.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct xbzrle_data *x = g_malloc0(sizeof(struct xbzrle_data));
+
+    p->data = x;
+    x->buf_len = page_count * (qemu_target_page_size() + 1);
+    x->buf = g_try_malloc(x->buf_len);
+    if (!x->buf) {
+        error_setg(errp, "multifd %d: out of memory for xbzrle buffer",
+                   p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *x = p->data;
+
+    g_free(x->buf);
+    x->buf = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the encoded buffer, and apply each page to guest memory.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+    size_t page_size = qemu_target_page_size();
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t pos = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > x->buf_len) {
+        error_setg(errp, "multifd %d: packet size %d bigger than %d",
+                   p->id, in_size, x->buf_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)x->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < used; i++) {
+        uint8_t *host = p->pages->iov[i].iov_base;
+        uint16_t len;
+
+        if (pos >= in_size) {
+            goto truncated;
+        }
+
+        switch (x->buf[pos++]) {
+        case MULTIFD_XBZRLE_PAGE_RAW:
+            if (in_size - pos < page_size) {
+                goto truncated;
+            }
+            memcpy(host, x->buf + pos, page_size);
+            pos += page_size;
+            break;
+        case MULTIFD_XBZRLE_PAGE_XBZRLE:
+            if (in_size - pos < 2) {
+                goto truncated;
+            }
+            len = lduw_be_p(x->buf + pos);
+            pos += 2;
+            if (len > page_size || in_size - pos < len) {
+                error_setg(errp, "multifd %d: bad xbzrle length %d",
+                           p->id, len);
+                return -1;
+            }
+            if (xbzrle_decode_buffer(x->buf + pos, len, host,
+                                     page_size) == -1) {
+                error_setg(errp, "multifd %d: failed to decode xbzrle page",
+                           p->id);
+                return -1;
+            }
+            pos += len;
+            break;
+        case MULTIFD_XBZRLE_PAGE_ZERO:
+            if (!buffer_is_zero(host, page_size)) {
+                memset(host, 0, page_size);
+            }
+            break;
+        case MULTIFD_XBZRLE_PAGE_UNCHANGED:
+            break;
+        default:
+            error_setg(errp, "multifd %d: unknown xbzrle page encoding %d",
+                       p->id, x->buf[pos - 1]);
+            return -1;
+        }
+    }
+
+    if (pos != in_size) {
+        error_setg(errp, "multifd %d: packet size received %d size used %d",
+                   p->id, in_size, pos);
+        return -1;
+    }
+    return 0;
+
+truncated:
+    error_setg(errp, "multifd %d: xbzrle packet truncated at page %d",
+               p->id, i);
+    return -1;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .send_write = xbzrle_send_write,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
@@ -12,14 +12,17 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
+#include "io/channel-socket.h"
 #include "ram.h"
 #include "migration.h"
 #include "socket.h"
+#include "file.h"
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
@@ -100,7 +103,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used, NULL, 0,
+                                       p->write_flags, errp);
 }
 
 /**
@@ -258,6 +262,78 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     g_free(pages);
 }
 
+/**
+ * multifd_send_zero_page_detect: split the pages into normal and zero ones
+ *
+ * The pages are reordered in place so that the normal pages are at
+ * the beginning of the arrays and the zero pages at the end.
+ * pages->used is updated to the number of normal pages and
+ * p->zero_num to the number of zero pages.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    RAMBlock *rb = pages->block;
+    size_t page_size = qemu_target_page_size();
+    int i = 0;
+    int j = pages->used - 1;
+
+    while (i <= j) {
+        ram_addr_t offset = pages->offset[i];
+
+        if (!buffer_is_zero(rb->host + offset, page_size)) {
+            i++;
+            continue;
+        }
+        pages->offset[i] = pages->offset[j];
+        pages->iov[i].iov_base = rb->host + pages->offset[j];
+        pages->offset[j] = offset;
+        pages->iov[j].iov_base = rb->host + offset;
+        j--;
+    }
+
+    p->zero_num = pages->used - i;
+    pages->used = i;
+}
+
+/**
+ * multifd_send_account_zero_pages: move zero pages to the duplicate count
+ *
+ * multifd_send_pages() accounts every queued page as a normal page
+ * before the channel had the chance to look at it.  Fix the counters
+ * for the zero pages that the channel found since the last call.
+ *
+ * Must be called from the migration thread with p->mutex held.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_account_zero_pages(MultiFDSendParams *p)
+{
+    uint64_t zero = p->zero_pages_unaccounted;
+    uint64_t bytes = zero * qemu_target_page_size();
+
+    ram_counters.normal -= zero;
+    ram_counters.duplicate += zero;
+    ram_counters.multifd_bytes -= bytes;
+    ram_counters.transferred -= bytes;
+    p->zero_pages_unaccounted = 0;
+}
+
+/**
+ * multifd_send_account_zero_copy: count flushes that fell back to copying
+ *
+ * Must be called from the migration thread with p->mutex held.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_account_zero_copy(MultiFDSendParams *p)
+{
+    ram_counters.dirty_sync_missed_zero_copy += p->zero_copy_missed;
+    p->zero_copy_missed = 0;
+}
+
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
@@ -268,12 +344,13 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < p->pages->used + p->zero_num; i++) {
         /* there are architectures where ram_addr_t is 32 bit */
         uint64_t temp = p->pages->offset[i];
 
@@ -334,10 +411,18 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->zero_num > packet->pages_alloc - p->pages->used) {
+        error_setg(errp, "multifd: received packet "
+                   "with %d zero pages and expected maximum zero pages are %d",
+                   p->zero_num, packet->pages_alloc - p->pages->used);
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->pages->used == 0) {
+    if (p->pages->used + p->zero_num == 0) {
         return 0;
     }
 
@@ -350,7 +435,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < p->pages->used + p->zero_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
         if (offset > (block->used_length - qemu_target_page_size())) {
@@ -435,6 +520,8 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->block);
 
     p->packet_num = multifd_send_state->packet_num++;
+    /* Only the migration thread updates dirty_sync_count */
+    p->dirty_sync_count = ram_counters.dirty_sync_count;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * qemu_target_page_size()
@@ -442,6 +529,7 @@ static int multifd_send_pages(QEMUFile *f)
     qemu_file_update_transfer(f, transferred);
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;;
+    multifd_send_account_zero_pages(p);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 
@@ -561,11 +649,17 @@ void multifd_save_cleanup(void)
     multifd_send_state = NULL;
 }
 
+/* Only migrations have multifd channels, savevm doesn't */
+bool multifd_send_active(void)
+{
+    return multifd_send_state != NULL;
+}
+
 void multifd_send_sync_main(QEMUFile *f)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || !multifd_send_active()) {
         return;
     }
     if (multifd_send_state->pages->used) {
@@ -601,10 +695,62 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account_zero_pages(p);
+        multifd_send_account_zero_copy(p);
+        qemu_mutex_unlock(&p->mutex);
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/**
+ * multifd_send_mapped_ram: write the pages of a job to the migration file
+ *
+ * With mapped-ram nothing but the pages is written: each one goes to
+ * its fixed offset in the file, and the file bitmap of the RAMBlock
+ * records which pages hold data.  Runs of contiguous pages are written
+ * with a single pwritev.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @block: RAMBlock the pages belong to
+ * @used: number of normal pages, at the start of the arrays
+ * @zero_num: number of zero pages, after the normal ones
+ * @errp: pointer to an error
+ */
+static int multifd_send_mapped_ram(MultiFDSendParams *p, RAMBlock *block,
+                                   uint32_t used, uint32_t zero_num,
+                                   Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i, start = 0;
+
+    for (i = used; i < used + zero_num; i++) {
+        clear_bit_atomic(pages->offset[i] / page_size, block->file_bmap);
+    }
+
+    for (i = 1; i <= used; i++) {
+        if (i < used &&
+            pages->offset[i] == pages->offset[i - 1] + page_size) {
+            continue;
+        }
+        if (qio_channel_pwritev_all(p->c, pages->iov + start, i - start,
+                                    block->pages_offset +
+                                    pages->offset[start], errp) < 0) {
+            return -1;
+        }
+        start = i;
+    }
+
+    for (i = 0; i < used; i++) {
+        set_bit_atomic(pages->offset[i] / page_size, block->file_bmap);
+    }
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -615,12 +761,14 @@ static void *multifd_send_thread(void *opaque)
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        ret = -1;
-        goto out;
+    if (!migrate_mapped_ram()) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            ret = -1;
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
         qemu_sem_wait(&p->sem);
@@ -631,11 +779,22 @@ static void *multifd_send_thread(void *opaque)
         qemu_mutex_lock(&p->mutex);
 
         if (p->pending_job) {
-            uint32_t used = p->pages->used;
+            RAMBlock *block = p->pages->block;
+            uint32_t used;
+            uint32_t zero_num = 0;
             uint64_t packet_num = p->packet_num;
             flags = p->flags;
 
-            if (used) {
+            /* mapped-ram must know the zero pages to fill the file bitmap */
+            if (p->pages->used &&
+                (migrate_multifd_zero_page() || migrate_mapped_ram())) {
+                multifd_send_zero_page_detect(p);
+                zero_num = p->zero_num;
+            }
+            used = p->pages->used;
+
+            /* methods that keep state may need to see the zero pages too */
+            if (used || zero_num) {
                 ret = multifd_send_state->ops->send_prepare(p, used,
                                                             &local_err);
                 if (ret != 0) {
@@ -647,28 +806,57 @@ static void *multifd_send_thread(void *opaque)
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
+            p->num_zero_pages += zero_num;
+            p->zero_pages_unaccounted += zero_num;
+            p->zero_num = 0;
             p->pages->used = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            trace_multifd_send(p->id, packet_num, used, zero_num, flags,
                                p->next_packet_size);
 
-            ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                        p->packet_len, &local_err);
-            if (ret != 0) {
-                break;
+            if (migrate_mapped_ram()) {
+                ret = multifd_send_mapped_ram(p, block, used, zero_num,
+                                              &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            } else {
+                ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                            p->packet_len, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+
+                if (used) {
+                    ret = multifd_send_state->ops->send_write(p, used,
+                                                              &local_err);
+                    if (ret != 0) {
+                        break;
+                    }
+                }
             }
 
-            if (used) {
-                ret = multifd_send_state->ops->send_write(p, used, &local_err);
-                if (ret != 0) {
+            /*
+             * The dirty bitmap is only synced after multifd_send_sync_main(),
+             * so waiting here for the zero copy writes of this round means
+             * no page is sent again while the kernel may still read it.
+             */
+            if ((flags & MULTIFD_FLAG_SYNC) &&
+                (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY)) {
+                ret = qio_channel_flush(p->c, &local_err);
+                if (ret < 0) {
                     break;
                 }
             }
 
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
+            if (ret == 1) {
+                p->zero_copy_missed++;
+                ret = 0;
+            }
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
@@ -704,7 +892,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -716,7 +905,17 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     Error *local_err = NULL;
 
     trace_multifd_new_send_channel_async(p->id);
-    if (qio_task_propagate_error(task, &local_err)) {
+    if (!qio_task_propagate_error(task, &local_err) &&
+        migrate_use_zero_copy_send()) {
+        if (!object_dynamic_cast(OBJECT(sioc), TYPE_QIO_CHANNEL_SOCKET)) {
+            error_setg(&local_err, "multifd %d: zero copy send is not "
+                       "supported by the migration channel", p->id);
+        } else if (qio_channel_socket_enable_zero_copy(
+                       QIO_CHANNEL_SOCKET(sioc), &local_err) == 0) {
+            p->write_flags |= QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+        }
+    }
+    if (local_err) {
         migrate_set_error(migrate_get_current(), local_err);
         /* Error happen, we need to tell who pay attention to me */
         qemu_sem_post(&multifd_send_state->channels_ready);
@@ -728,7 +927,7 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
          */
         p->quit = true;
     } else {
-        p->c = QIO_CHANNEL(sioc);
+        p->c = QIO_CHANNEL(object_ref(OBJECT(sioc)));
         qio_channel_set_delay(p->c, false);
         p->running = true;
         qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
@@ -769,7 +968,10 @@ int multifd_save_setup(Error **errp)
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
         p->name = g_strdup_printf("multifdsend_%d", i);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        if (migrate_mapped_ram()) {
+            /* Packets are still filled in, but never written or counted */
+            p->packet_len = 0;
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -783,9 +985,32 @@ int multifd_save_setup(Error **errp)
             return ret;
         }
     }
+
+    /*
+     * File channels are ready at once and start their thread right
+     * away, so only create the channels once the methods are set up.
+     */
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (migrate_mapped_ram()) {
+            file_send_channel_create(multifd_new_send_channel_async, p);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
+    }
     return 0;
 }
 
+/*
+ * With mapped-ram, ram_load reads the pages from the file itself and
+ * the destination has no multifd channels at all.
+ */
+static bool multifd_recv_use_channels(void)
+{
+    return migrate_use_multifd() && !migrate_mapped_ram();
+}
+
 struct {
     MultiFDRecvParams *params;
     /* number of created threads */
@@ -836,7 +1061,7 @@ int multifd_load_cleanup(Error **errp)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return 0;
     }
     multifd_recv_terminate_threads(NULL);
@@ -882,7 +1107,7 @@ void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -905,6 +1130,27 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_zero_pages: clear the zero pages of the current packet
+ *
+ * Pages that are already zero are left alone, so we don't allocate
+ * memory for pages the guest never touched.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    uint32_t i;
+
+    for (i = p->pages->used; i < p->pages->used + p->zero_num; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+
+        if (!buffer_is_zero(iov->iov_base, iov->iov_len)) {
+            memset(iov->iov_base, 0, iov->iov_len);
+        }
+    }
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -916,6 +1162,7 @@ static void *multifd_recv_thread(void *opaque)
 
     while (true) {
         uint32_t used;
+        uint32_t zero_num;
         uint32_t flags;
 
         if (p->quit) {
@@ -939,13 +1186,15 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        zero_num = p->zero_num;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, used, zero_num, flags,
                            p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
+        p->num_zero_pages += zero_num;
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
@@ -955,6 +1204,10 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (zero_num) {
+            multifd_recv_zero_pages(p);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -969,7 +1222,8 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -980,7 +1234,7 @@ int multifd_load_setup(Error **errp)
     uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     uint8_t i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return 0;
     }
     thread_count = migrate_multifd_channels();
@@ -1022,7 +1276,7 @@ bool multifd_recv_all_channels_created(void)
 {
     int thread_count = migrate_multifd_channels();
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return true;
     }
 
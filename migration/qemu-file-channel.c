@@ -160,6 +160,40 @@ static QEMUFile *channel_get_output_return_path(void *opaque)
     return qemu_fopen_channel_input(ioc);
 }
 
+static int channel_seek(void *opaque, int64_t pos, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (qio_channel_io_seek(ioc, pos, SEEK_SET, errp) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int channel_put_buffer_at(void *opaque, const uint8_t *buf,
+                                 size_t size, int64_t pos, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+
+    if (qio_channel_pwritev_all(ioc, &iov, 1, pos, errp) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int channel_get_buffer_at(void *opaque, uint8_t *buf,
+                                 size_t size, int64_t pos, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+
+    if (qio_channel_preadv_all(ioc, &iov, 1, pos, errp) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
 static const QEMUFileOps channel_input_ops = {
     .get_buffer = channel_get_buffer,
     .close = channel_close,
@@ -178,14 +212,43 @@ static const QEMUFileOps channel_output_ops = {
 };
 
 
+/* Files on seekable storage also allow the stream to be repositioned */
+static const QEMUFileOps channel_seekable_input_ops = {
+    .get_buffer = channel_get_buffer,
+    .close = channel_close,
+    .shut_down = channel_shutdown,
+    .set_blocking = channel_set_blocking,
+    .get_return_path = channel_get_input_return_path,
+    .seek = channel_seek,
+    .get_buffer_at = channel_get_buffer_at,
+};
+
+
+static const QEMUFileOps channel_seekable_output_ops = {
+    .writev_buffer = channel_writev_buffer,
+    .close = channel_close,
+    .shut_down = channel_shutdown,
+    .set_blocking = channel_set_blocking,
+    .get_return_path = channel_get_output_return_path,
+    .seek = channel_seek,
+    .put_buffer_at = channel_put_buffer_at,
+};
+
+
 QEMUFile *qemu_fopen_channel_input(QIOChannel *ioc)
 {
     object_ref(OBJECT(ioc));
+    if (qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        return qemu_fopen_ops(ioc, &channel_seekable_input_ops);
+    }
     return qemu_fopen_ops(ioc, &channel_input_ops);
 }
 
 QEMUFile *qemu_fopen_channel_output(QIOChannel *ioc)
 {
     object_ref(OBJECT(ioc));
+    if (qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        return qemu_fopen_ops(ioc, &channel_seekable_output_ops);
+    }
     return qemu_fopen_ops(ioc, &channel_output_ops);
 }
@@ -43,6 +43,7 @@ struct QEMUFile {
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
+    int64_t skipped; /* moved over by qemu_file_seek(), not transferred */
     int buf_index;
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
@@ -173,6 +174,74 @@ bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer;
 }
 
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->ops->seek;
+}
+
+/*
+ * Continue the stream at @pos.  Data buffered for writing is flushed
+ * first; data already read ahead is dropped.
+ *
+ * Returns 0 on success, negative error otherwise; the error is also
+ * recorded in the file.
+ */
+int qemu_file_seek(QEMUFile *f, int64_t pos)
+{
+    Error *local_error = NULL;
+    int ret;
+
+    if (!qemu_file_is_seekable(f)) {
+        qemu_file_set_error(f, -ESPIPE);
+        return -ESPIPE;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->seek(f->opaque, pos, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, ret, local_error);
+        return ret;
+    }
+    f->skipped += pos - f->pos;
+    f->pos = pos;
+    return 0;
+}
+
+/*
+ * Positioned I/O on seekable files.  Unlike the stream functions these
+ * report errors through @errp only, so that several threads may use
+ * them at the same time.
+ */
+int qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                       int64_t pos, Error **errp)
+{
+    if (!f->ops->put_buffer_at) {
+        error_setg(errp, "Migration stream does not support random access");
+        return -ESPIPE;
+    }
+    return f->ops->put_buffer_at(f->opaque, buf, size, pos, errp);
+}
+
+int qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                       int64_t pos, Error **errp)
+{
+    if (!f->ops->get_buffer_at) {
+        error_setg(errp, "Migration stream does not support random access");
+        return -ESPIPE;
+    }
+    return f->ops->get_buffer_at(f->opaque, buf, size, pos, errp);
+}
+
 static void qemu_iovec_release_ram(QEMUFile *f)
 {
     struct iovec iov;
@@ -657,6 +726,16 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Like qemu_ftell(), but only counts the bytes that went through the
+ * stream, not the ones skipped over with qemu_file_seek().
+ */
+int64_t qemu_file_transferred(QEMUFile *f)
+{
+    qemu_fflush(f);
+    return f->pos - f->skipped;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
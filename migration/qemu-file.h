@@ -103,6 +103,26 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr,
                                    Error **errp);
 
+/*
+ * Move the stream position of the underlying transport to @pos.
+ * Only backends on seekable storage provide this.
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFileSeekFunc)(void *opaque, int64_t pos, Error **errp);
+
+/*
+ * Write or read exactly @size bytes at @pos without moving the stream
+ * position.  Provided together with seek; must be safe to call from
+ * several threads at once.
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFilePutBufferAtFunc)(void *opaque, const uint8_t *buf,
+                                      size_t size, int64_t pos,
+                                      Error **errp);
+typedef int (QEMUFileGetBufferAtFunc)(void *opaque, uint8_t *buf,
+                                      size_t size, int64_t pos,
+                                      Error **errp);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -110,6 +130,9 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileSeekFunc *seek;
+    QEMUFilePutBufferAtFunc *put_buffer_at;
+    QEMUFileGetBufferAtFunc *get_buffer_at;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -125,6 +148,7 @@ int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 int64_t qemu_ftell_fast(QEMUFile *f);
+int64_t qemu_file_transferred(QEMUFile *f);
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
@@ -133,6 +157,12 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size,
                            bool may_free);
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
+bool qemu_file_is_seekable(QEMUFile *f);
+int qemu_file_seek(QEMUFile *f, int64_t pos);
+int qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                       int64_t pos, Error **errp);
+int qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                       int64_t pos, Error **errp);
 
 #include "migration/qemu-file-types.h"
 
@@ -29,6 +29,7 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -55,6 +56,8 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "sysemu/kvm.h"
+#include "hw/boards.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -75,6 +78,37 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/*
+ * mapped-ram file layout: after the usual description of each RAMBlock
+ * in the MEM_SIZE section comes a header giving the file offsets of
+ * the block's page bitmap and of its page data.  The page data starts
+ * at a multiple of MAPPED_RAM_FILE_ALIGN, and the stream resumes right
+ * after it.  Pages live at pages_offset + their offset in the block,
+ * and the bitmap (little endian, written when the migration completes)
+ * tells which of them hold data; the others are zero.
+ */
+#define MAPPED_RAM_VERSION     1
+#define MAPPED_RAM_HDR_SIZE    (4 + 3 * 8)
+#define MAPPED_RAM_FILE_ALIGN  (1 * MiB)
+/* don't start a load thread for less than this many pages */
+#define MAPPED_RAM_LOAD_MIN_PAGES 4096
+
+/*
+ * The layout only applies to seekable migration files.  Snapshots saved
+ * into an image by savevm keep the streaming format even with the
+ * capability set, and so does loadvm.
+ */
+static bool ram_use_mapped_ram(QEMUFile *f)
+{
+    return migrate_mapped_ram() && qemu_file_is_seekable(f);
+}
+
+/* Same on every host, whatever the size of a long */
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    return DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS, 64) * 8;
+}
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -152,6 +186,10 @@ int xbzrle_cache_resize(int64_t new_size, Error **errp)
         cache_fini(XBZRLE.cache);
         XBZRLE.cache = new_cache;
     }
+
+    if (multifd_xbzrle_cache_resize(new_size, errp) < 0) {
+        ret = -1;
+    }
 out:
     XBZRLE_cache_unlock();
     return ret;
@@ -296,6 +334,8 @@ struct RAMSrcPageRequest {
     RAMBlock *rb;
     hwaddr    offset;
     hwaddr    len;
+    /* When the request was received, in microseconds */
+    int64_t   time_us;
 
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
@@ -349,6 +389,27 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* The RAMBlock and host page of the last request taken off the queue */
+    RAMBlock *last_fault_rb;
+    ram_addr_t last_fault_offset;
+    /* Distance between the last two requests, if in the same RAMBlock */
+    int64_t last_fault_stride;
+    /*
+     * Pages the postcopy prefetcher predicts will be requested next:
+     * prefetch_left host pages of prefetch_rb, starting at
+     * prefetch_offset and prefetch_stride bytes apart.  prefetch_rb holds
+     * a reference to its memory region while it is set.
+     */
+    RAMBlock *prefetch_rb;
+    ram_addr_t prefetch_offset;
+    int64_t prefetch_stride;
+    unsigned int prefetch_left;
+    /* Pages each vCPU had dirtied at the last per-vCPU throttle decision */
+    unsigned long *vcpu_dirty_pages;
+    /* Pages go through the multifd channels */
+    bool multifd;
+    /* Pages are stored at fixed offsets of the migration file */
+    bool mapped_ram;
 };
 typedef struct RAMState RAMState;
 
@@ -410,6 +471,54 @@ typedef struct PageSearchStatus PageSearchStatus;
 
 CompressionStats compression_counters;
 
+#define POSTCOPY_LATENCY_BUCKETS 24
+
+/* Host pages prefetched along a detected pattern */
+#define POSTCOPY_PREFETCH_DEPTH 16
+/* Host pages prefetched on either side of a request without a pattern */
+#define POSTCOPY_PREFETCH_NEIGHBOURS 4
+/* Longest stride, in host pages, that is still taken as a pattern */
+#define POSTCOPY_PREFETCH_MAX_STRIDE 64
+
+static struct {
+    uint64_t sequential;
+    uint64_t strided;
+    uint64_t prefetch_pages;
+    /* log2 histogram of the request latencies, in microseconds */
+    uint64_t latency[POSTCOPY_LATENCY_BUCKETS];
+} postcopy_fault_counters;
+
+PostcopyFaultStats *ram_postcopy_fault_stats(void)
+{
+    PostcopyFaultStats *stats = g_new0(PostcopyFaultStats, 1);
+    uint64List **tail = &stats->latency;
+    int i;
+
+    stats->sequential = postcopy_fault_counters.sequential;
+    stats->strided = postcopy_fault_counters.strided;
+    stats->prefetch_pages = postcopy_fault_counters.prefetch_pages;
+    for (i = 0; i < POSTCOPY_LATENCY_BUCKETS; i++) {
+        uint64List *entry = g_new0(uint64List, 1);
+
+        entry->value = postcopy_fault_counters.latency[i];
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return stats;
+}
+
+static void postcopy_account_latency(int64_t time_us)
+{
+    int64_t delta = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - time_us;
+    int bucket = 0;
+
+    if (delta > 1) {
+        bucket = MIN(63 - clz64(delta), POSTCOPY_LATENCY_BUCKETS - 1);
+    }
+    postcopy_fault_counters.latency[bucket]++;
+}
+
 struct CompressParam {
     bool done;
     bool quit;
@@ -633,6 +742,208 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+/* Last decision of mig_throttle_guest_adaptive(), for query-migrate */
+static struct {
+    bool valid;
+    AdaptiveThrottleInfo info;
+} adaptive_throttle;
+
+AdaptiveThrottleInfo *ram_adaptive_throttle_info(void)
+{
+    AdaptiveThrottleInfo *info;
+
+    if (!adaptive_throttle.valid) {
+        return NULL;
+    }
+
+    info = g_new(AdaptiveThrottleInfo, 1);
+    *info = adaptive_throttle.info;
+    return info;
+}
+
+/*
+ * Highest dirty rate, in bytes per second, at which the memory dirtied
+ * while sending @remaining bytes can still be sent within the downtime
+ * limit.  @remaining must not be zero.
+ */
+static double mig_throttle_target_rate(double bandwidth, uint64_t remaining)
+{
+    MigrationState *s = migrate_get_current();
+    double downtime = s->parameters.downtime_limit / 1000.0;
+
+    return bandwidth * bandwidth * downtime / remaining;
+}
+
+/**
+ * mig_throttle_guest_adaptive: throttle the guest from the measured rates
+ *
+ * Sending the remaining dirty memory takes remaining / bandwidth seconds,
+ * and what the guest dirties meanwhile must be sent within the downtime
+ * limit.  That bounds the dirty rate the guest can be allowed; assuming
+ * the dirty rate is proportional to the CPU time the guest gets, pick the
+ * smallest throttle that keeps the guest below that bound.  The throttle
+ * is raised at once, but lowered by at most cpu-throttle-increment per
+ * period so that one quiet period does not make it oscillate.
+ *
+ * @rs: current RAM state
+ * @period: length of the period the rates are measured over, in ms
+ */
+static void mig_throttle_guest_adaptive(RAMState *rs, int64_t period)
+{
+    MigrationState *s = migrate_get_current();
+    int pct_max = s->parameters.max_cpu_throttle;
+    int pct_decrement = s->parameters.cpu_throttle_increment;
+    int pct_cur = cpu_throttle_active() ? cpu_throttle_get_percentage() : 0;
+    uint64_t bytes_xfer_period = ram_counters.transferred - rs->bytes_xfer_prev;
+    uint64_t bytes_dirty_period = rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
+    uint64_t remaining = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
+    double bandwidth, dirty_rate, unthrottled_rate, target_rate;
+    AdaptiveThrottleInfo *info = &adaptive_throttle.info;
+    int pct = 0;
+
+    if (period <= 0 || !bytes_xfer_period) {
+        return;
+    }
+
+    bandwidth = (double)bytes_xfer_period * 1000 / period;
+    dirty_rate = (double)bytes_dirty_period * 1000 / period;
+    unthrottled_rate = dirty_rate * 100 / (100 - pct_cur);
+    if (remaining) {
+        target_rate = mig_throttle_target_rate(bandwidth, remaining);
+    } else {
+        target_rate = unthrottled_rate;
+    }
+
+    if (unthrottled_rate > target_rate) {
+        pct = MIN(100 - (int)(100 * target_rate / unthrottled_rate), pct_max);
+    }
+    if (pct < pct_cur) {
+        pct = MAX(pct, pct_cur - pct_decrement);
+    }
+
+    if (pct != pct_cur) {
+        if (pct) {
+            cpu_throttle_set(pct);
+        } else {
+            cpu_throttle_stop();
+        }
+        info->adjustments++;
+    }
+
+    adaptive_throttle.valid = true;
+    info->dirty_rate = dirty_rate;
+    info->unthrottled_dirty_rate = unthrottled_rate;
+    info->bandwidth = bandwidth;
+    info->target_dirty_rate = target_rate;
+    info->percentage = pct;
+
+    trace_migration_throttle_adaptive(info->dirty_rate,
+                                      info->unthrottled_dirty_rate,
+                                      info->bandwidth, info->target_dirty_rate,
+                                      remaining, pct_cur, pct);
+}
+
+typedef struct {
+    CPUState *cpu;
+    /* Estimated bytes per second the vCPU would dirty unthrottled */
+    double rate;
+} VcpuDirtyRate;
+
+static int vcpu_dirty_rate_cmp(const void *a, const void *b)
+{
+    const VcpuDirtyRate *ra = a, *rb = b;
+
+    return ra->rate < rb->rate ? -1 : ra->rate > rb->rate;
+}
+
+/**
+ * mig_throttle_vcpus: throttle only the vCPUs that dirty memory the fastest
+ *
+ * Uses the pages each vCPU dirtied according to the KVM dirty ring.  The
+ * allowed dirty rate is the one computed by the adaptive throttle, or
+ * throttle-trigger-threshold percent of the bandwidth otherwise.  It is
+ * shared out from the slowest vCPU up: vCPUs that dirty less than an equal
+ * share of what is left run unthrottled, and the others are all throttled
+ * down to that share.  As with the adaptive throttle, a vCPU's throttle is
+ * lowered by at most cpu-throttle-increment per period.
+ *
+ * @rs: current RAM state
+ * @period: length of the period the rates are measured over, in ms
+ */
+static void mig_throttle_vcpus(RAMState *rs, int64_t period)
+{
+    MigrationState *s = migrate_get_current();
+    MachineState *ms = MACHINE(qdev_get_machine());
+    int pct_max = s->parameters.max_cpu_throttle;
+    int pct_decrement = s->parameters.cpu_throttle_increment;
+    uint64_t bytes_xfer_period = ram_counters.transferred - rs->bytes_xfer_prev;
+    uint64_t remaining = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
+    double bandwidth, total = 0, budget;
+    VcpuDirtyRate *rates;
+    CPUState *cpu;
+    bool first = !rs->vcpu_dirty_pages;
+    int i, n = 0;
+
+    if (first) {
+        rs->vcpu_dirty_pages = g_new0(unsigned long, ms->smp.max_cpus);
+    }
+
+    rates = g_new0(VcpuDirtyRate, ms->smp.max_cpus);
+    CPU_FOREACH(cpu) {
+        unsigned long dirty = atomic_read(&cpu->dirty_pages);
+        unsigned long *prev = &rs->vcpu_dirty_pages[cpu->cpu_index];
+        int pct = cpu_throttle_get_vcpu_percentage(cpu);
+
+        if (period > 0) {
+            rates[n].rate = (double)(dirty - *prev) * TARGET_PAGE_SIZE *
+                            1000 / period * 100 / (100 - pct);
+        }
+        rates[n].cpu = cpu;
+        *prev = dirty;
+        total += rates[n].rate;
+        n++;
+    }
+
+    /* Only the first period gives no rate to go by */
+    if (first || period <= 0 || !bytes_xfer_period) {
+        g_free(rates);
+        return;
+    }
+
+    bandwidth = (double)bytes_xfer_period * 1000 / period;
+    if (!s->parameters.cpu_throttle_adaptive) {
+        budget = bandwidth * s->parameters.throttle_trigger_threshold / 100;
+    } else if (remaining) {
+        budget = mig_throttle_target_rate(bandwidth, remaining);
+    } else {
+        budget = total;
+    }
+
+    qsort(rates, n, sizeof(*rates), vcpu_dirty_rate_cmp);
+    for (i = 0; i < n; i++) {
+        double share = budget / (n - i);
+        int pct_cur = cpu_throttle_get_vcpu_percentage(rates[i].cpu);
+        int pct = 0;
+
+        if (rates[i].rate > share) {
+            pct = MIN(100 - (int)(100 * share / rates[i].rate), pct_max);
+            budget -= share;
+        } else {
+            budget -= rates[i].rate;
+        }
+        if (pct < pct_cur) {
+            pct = MAX(pct, pct_cur - pct_decrement);
+        }
+        if (pct != pct_cur) {
+            cpu_throttle_set_vcpu(rates[i].cpu, pct);
+        }
+        trace_migration_throttle_vcpu(rates[i].cpu->cpu_index,
+                                      rates[i].rate, share, pct_cur, pct);
+    }
+
+    g_free(rates);
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -896,7 +1207,7 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
     }
 }
 
-static void migration_trigger_throttle(RAMState *rs)
+static void migration_trigger_throttle(RAMState *rs, int64_t end_time)
 {
     MigrationState *s = migrate_get_current();
     uint64_t threshold = s->parameters.throttle_trigger_threshold;
@@ -909,6 +1220,18 @@ static void migration_trigger_throttle(RAMState *rs)
      * that ram migration makes no progress. Avoid this by disabling the
      * throttling logic during the bulk phase of block migration. */
     if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+        int64_t period = end_time - rs->time_last_bitmap_sync;
+
+        if (s->parameters.cpu_throttle_per_vcpu && kvm_dirty_ring_enabled()) {
+            mig_throttle_vcpus(rs, period);
+            return;
+        }
+
+        if (s->parameters.cpu_throttle_adaptive) {
+            mig_throttle_guest_adaptive(rs, period);
+            return;
+        }
+
         /* The following detection logic can be refined later. For now:
            Check to see if the ratio between dirtied bytes and the approx.
            amount of bytes that just got transferred since the last time
@@ -954,7 +1277,7 @@ static void migration_bitmap_sync(RAMState *rs)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > rs->time_last_bitmap_sync + 1000) {
-        migration_trigger_throttle(rs);
+        migration_trigger_throttle(rs, end_time);
 
         migration_update_rates(rs, end_time);
 
@@ -1351,6 +1674,99 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
     }
 }
 
+/* Drop the prediction of the postcopy prefetcher */
+static void postcopy_prefetch_clear(RAMState *rs)
+{
+    if (rs->prefetch_rb) {
+        memory_region_unref(rs->prefetch_rb->mr);
+        rs->prefetch_rb = NULL;
+    }
+    rs->prefetch_left = 0;
+}
+
+/**
+ * postcopy_prefetch_update: predict the next postcopy page requests
+ *
+ * If the request continues a run of requests with a constant stride
+ * in the same RAMBlock, the next pages along that stride are predicted;
+ * otherwise the pages on either side of the requested one are.  The new
+ * prediction replaces any older one, since the latest request is the
+ * best hint of where the guest is running.
+ *
+ * @rs: current RAM state
+ * @block: RAMBlock of the request, the caller must hold a reference
+ * @offset: offset of the requested host page within @block
+ */
+static void postcopy_prefetch_update(RAMState *rs, RAMBlock *block,
+                                     ram_addr_t offset)
+{
+    int64_t page_size = qemu_ram_pagesize(block);
+    int64_t stride = 0;
+
+    if (block == rs->last_fault_rb) {
+        stride = (int64_t)(offset - rs->last_fault_offset);
+    }
+
+    memory_region_ref(block->mr);
+    postcopy_prefetch_clear(rs);
+    rs->prefetch_rb = block;
+    if (stride && stride == rs->last_fault_stride &&
+        stride >= -POSTCOPY_PREFETCH_MAX_STRIDE * page_size &&
+        stride <= POSTCOPY_PREFETCH_MAX_STRIDE * page_size) {
+        if (stride == page_size) {
+            postcopy_fault_counters.sequential++;
+        } else {
+            postcopy_fault_counters.strided++;
+        }
+        rs->prefetch_offset = offset + stride;
+        rs->prefetch_stride = stride;
+        rs->prefetch_left = POSTCOPY_PREFETCH_DEPTH;
+    } else {
+        /*
+         * This may start before the block; unqueue_prefetch_page() skips
+         * the offsets that wrapped around.
+         */
+        rs->prefetch_offset = offset - POSTCOPY_PREFETCH_NEIGHBOURS * page_size;
+        rs->prefetch_stride = page_size;
+        rs->prefetch_left = 2 * POSTCOPY_PREFETCH_NEIGHBOURS + 1;
+    }
+
+    rs->last_fault_rb = block;
+    rs->last_fault_offset = offset;
+    rs->last_fault_stride = stride;
+
+    trace_postcopy_prefetch_update(block->idstr, offset, stride,
+                                   rs->prefetch_stride, rs->prefetch_left);
+}
+
+/**
+ * unqueue_prefetch_page: gets a page predicted by the prefetcher
+ *
+ * Helper for 'get_queued_page' - only used when the queue of page
+ * requests is empty
+ *
+ * Returns the block of the page (or NULL if none is left)
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset within the RAMBlock
+ */
+static RAMBlock *unqueue_prefetch_page(RAMState *rs, ram_addr_t *offset)
+{
+    while (rs->prefetch_left) {
+        ram_addr_t next = rs->prefetch_offset;
+
+        rs->prefetch_left--;
+        rs->prefetch_offset += rs->prefetch_stride;
+        if (next < rs->prefetch_rb->used_length) {
+            *offset = next;
+            return rs->prefetch_rb;
+        }
+    }
+
+    postcopy_prefetch_clear(rs);
+    return NULL;
+}
+
 /**
  * unqueue_page: gets a page of the queue
  *
@@ -1364,6 +1780,7 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
 static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
 {
     RAMBlock *block = NULL;
+    bool request_done = false;
 
     if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
         return NULL;
@@ -1380,21 +1797,33 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
             entry->len -= TARGET_PAGE_SIZE;
             entry->offset += TARGET_PAGE_SIZE;
         } else {
-            memory_region_unref(block->mr);
+            postcopy_account_latency(entry->time_us);
+            /* The reference of the request is dropped below */
             QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
             g_free(entry);
             migration_consume_urgent_request();
+            request_done = true;
         }
     }
     qemu_mutex_unlock(&rs->src_page_req_mutex);
 
+    if (request_done) {
+        if (migrate_postcopy_prefetch()) {
+            postcopy_prefetch_update(rs, block,
+                                     QEMU_ALIGN_DOWN(*offset,
+                                                     qemu_ram_pagesize(block)));
+        }
+        memory_region_unref(block->mr);
+    }
+
     return block;
 }
 
 /**
  * get_queued_page: unqueue a page from the postcopy requests
  *
- * Skips pages that are already sent (!dirty)
+ * Pages predicted by the postcopy prefetcher are returned once there are
+ * no outstanding requests.  Skips pages that are already sent (!dirty)
  *
  * Returns true if a queued page is found
  *
@@ -1408,7 +1837,13 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
     bool dirty;
 
     do {
+        bool prefetch = false;
+
         block = unqueue_page(rs, &offset);
+        if (!block) {
+            block = unqueue_prefetch_page(rs, &offset);
+            prefetch = !!block;
+        }
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1423,6 +1858,10 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
             if (!dirty) {
                 trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
                                                 page);
+            } else if (prefetch) {
+                postcopy_fault_counters.prefetch_pages++;
+                trace_get_queued_page_prefetch(block->idstr, (uint64_t)offset,
+                                               page);
             } else {
                 trace_get_queued_page(block->idstr, (uint64_t)offset, page);
             }
@@ -1534,6 +1973,7 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
     new_entry->rb = ramblock;
     new_entry->offset = start;
     new_entry->len = len;
+    new_entry->time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&rs->src_page_req_mutex);
@@ -1610,6 +2050,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    bool use_multifd;
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -1620,6 +2061,25 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    /*
+     * Do not use multifd for:
+     * 1. Compression as the first page in the new block should be posted out
+     *    before sending the compressed page
+     * 2. In postcopy as one whole host page should be placed
+     */
+    use_multifd = !save_page_use_compression(rs) && rs->multifd
+                  && !migration_in_postcopy();
+
+    /*
+     * The multifd channels look for zero pages themselves.  Multifd
+     * xbzrle also has to see the zero pages to keep its cache current,
+     * and with mapped-ram nothing but the channels writes pages.
+     */
+    if (use_multifd && (migrate_multifd_zero_page() || rs->mapped_ram ||
+        migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE)) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -1634,14 +2094,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -1808,9 +2261,11 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        postcopy_prefetch_clear(*rsp);
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        g_free((*rsp)->vcpu_dirty_pages);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -1849,6 +2304,11 @@ static void ram_save_cleanup(void *opaque)
         block->bmap = NULL;
     }
 
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+
     xbzrle_cleanup();
     compress_threads_save_cleanup();
     ram_state_cleanup(rsp);
@@ -2243,6 +2703,8 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    memset(&postcopy_fault_counters, 0, sizeof(postcopy_fault_counters));
+    memset(&adaptive_throttle, 0, sizeof(adaptive_throttle));
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2407,6 +2869,68 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
+/**
+ * mapped_ram_setup_block: reserve the space of a RAMBlock in the file
+ *
+ * Writes the mapped-ram header of @block and moves the stream past the
+ * bitmap and page data, which are written at their fixed offsets later.
+ *
+ * Returns 0 for success or negative error
+ *
+ * @f: QEMUFile where to send the data
+ * @block: RAMBlock to lay out
+ */
+static int mapped_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+    block->bitmap_offset = qemu_ftell(f) + MAPPED_RAM_HDR_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(block),
+                                   MAPPED_RAM_FILE_ALIGN);
+
+    qemu_put_be32(f, MAPPED_RAM_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    trace_mapped_ram_setup_block(block->idstr, block->bitmap_offset,
+                                 block->pages_offset);
+    return qemu_file_seek(f, block->pages_offset + block->used_length);
+}
+
+/**
+ * mapped_ram_write_bitmaps: store the file bitmap of every RAMBlock
+ *
+ * Called once all pages have been written, so that the bitmaps say
+ * which pages of the file hold the final data.
+ *
+ * Returns 0 for success or negative error
+ *
+ * @f: QEMUFile where to send the data
+ */
+static int mapped_ram_write_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        long pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t bitmap_size = mapped_ram_bitmap_size(block);
+        unsigned long *le_bitmap = bitmap_new(bitmap_size * BITS_PER_BYTE);
+        Error *local_err = NULL;
+        int ret;
+
+        bitmap_to_le(le_bitmap, block->file_bmap, pages);
+        ret = qemu_put_buffer_at(f, (uint8_t *)le_bitmap, bitmap_size,
+                                 block->bitmap_offset, &local_err);
+        g_free(le_bitmap);
+        if (ret < 0) {
+            qemu_file_set_error_obj(f, ret, local_err);
+            return ret;
+        }
+    }
+    return 0;
+}
+
 /*
  * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -2426,6 +2950,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    int ret;
 
     if (compress_threads_save_setup()) {
         return -1;
@@ -2439,6 +2964,8 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         }
     }
     (*rsp)->f = f;
+    (*rsp)->mapped_ram = ram_use_mapped_ram(f);
+    (*rsp)->multifd = migrate_use_multifd() && multifd_send_active();
 
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
@@ -2454,6 +2981,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if ((*rsp)->mapped_ram) {
+                ret = mapped_ram_setup_block(f, block);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
         }
     }
 
@@ -2620,6 +3153,14 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     if (ret >= 0) {
         multifd_send_sync_main(rs->f);
+        if (rs->mapped_ram) {
+            WITH_RCU_READ_LOCK_GUARD() {
+                ret = mapped_ram_write_bitmaps(f);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
     }
@@ -2656,25 +3197,35 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
     }
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+static int load_xbzrle_header(QEMUFile *f, unsigned int *xh_len)
 {
-    unsigned int xh_len;
     int xh_flags;
-    uint8_t *loaded_data;
 
     /* extract RLE header */
     xh_flags = qemu_get_byte(f);
-    xh_len = qemu_get_be16(f);
+    *xh_len = qemu_get_be16(f);
 
     if (xh_flags != ENCODING_FLAG_XBZRLE) {
         error_report("Failed to load XBZRLE page - wrong compression!");
         return -1;
     }
 
-    if (xh_len > TARGET_PAGE_SIZE) {
+    if (*xh_len > TARGET_PAGE_SIZE) {
         error_report("Failed to load XBZRLE page - len overflow!");
         return -1;
     }
+
+    return 0;
+}
+
+static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+{
+    unsigned int xh_len;
+    uint8_t *loaded_data;
+
+    if (load_xbzrle_header(f, &xh_len) < 0) {
+        return -1;
+    }
     loaded_data = XBZRLE.decoded_buf;
     /* load data and decode */
     /* it can change loaded_data to point to an internal buffer */
@@ -2970,6 +3521,252 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     qemu_mutex_unlock(&decomp_done_lock);
 }
 
+/*
+ * Incoming page placement threads.
+ *
+ * With load-threads set, ram_load_precopy() only parses the stream: the
+ * payload of plain, zero and XBZRLE pages is copied into a batch owned by
+ * one of the threads, which then writes it to guest memory.  Each aligned
+ * run of LOAD_BATCH_PAGES pages always goes to the same thread and the
+ * batches of a thread are placed in order, so the updates to any given
+ * page are applied in stream order.  Each thread has two batches, one
+ * being filled by the main thread while the other is being placed.
+ */
+#define LOAD_BATCH_SHIFT 6
+#define LOAD_BATCH_PAGES (1 << LOAD_BATCH_SHIFT)
+
+typedef struct {
+    /* RAM_SAVE_FLAG_ZERO, RAM_SAVE_FLAG_PAGE or RAM_SAVE_FLAG_XBZRLE */
+    int flags;
+    /* fill byte of a zero page */
+    uint8_t ch;
+    /* length of the encoded data of an XBZRLE page */
+    unsigned int len;
+    void *host;
+    /* COLO backup of the page, updated after it is placed */
+    void *host_bak;
+    /* page payload, inside the batch buffer */
+    uint8_t *data;
+} LoadPage;
+
+typedef struct {
+    LoadPage pages[LOAD_BATCH_PAGES];
+    unsigned int num;
+    uint8_t *buf;
+} LoadBatch;
+
+struct LoadParam {
+    bool quit;
+    QemuThread thread;
+    QemuMutex mutex;
+    /* signalled when @work is set or on @quit */
+    QemuCond cond;
+    /* signalled when @work has been placed */
+    QemuCond done_cond;
+    /* batch being placed by the thread, NULL when idle */
+    LoadBatch *work;
+    /* first error hit by the thread since the last wait_for_load_done() */
+    int error;
+    /* batch being filled, only used by the incoming migration thread */
+    LoadBatch *fill;
+    LoadBatch batch[2];
+};
+typedef struct LoadParam LoadParam;
+
+static LoadParam *load_param;
+static int load_thread_count;
+
+static int load_batch_place(LoadBatch *batch)
+{
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < batch->num; i++) {
+        LoadPage *page = &batch->pages[i];
+
+        switch (page->flags) {
+        case RAM_SAVE_FLAG_ZERO:
+            ram_handle_compressed(page->host, page->ch, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_PAGE:
+            memcpy(page->host, page->data, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_XBZRLE:
+            if (xbzrle_decode_buffer(page->data, page->len, page->host,
+                                     TARGET_PAGE_SIZE) == -1) {
+                error_report("Failed to load XBZRLE page - decode error!");
+                ret = -EINVAL;
+                continue;
+            }
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        if (page->host_bak) {
+            memcpy(page->host_bak, page->host, TARGET_PAGE_SIZE);
+        }
+    }
+
+    return ret;
+}
+
+static void *do_load_pages(void *opaque)
+{
+    LoadParam *param = opaque;
+    LoadBatch *batch;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->work) {
+            batch = param->work;
+            qemu_mutex_unlock(&param->mutex);
+
+            ret = load_batch_place(batch);
+            batch->num = 0;
+
+            qemu_mutex_lock(&param->mutex);
+            if (ret < 0 && !param->error) {
+                param->error = ret;
+            }
+            param->work = NULL;
+            qemu_cond_signal(&param->done_cond);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+/* Hand the batch being filled to its thread and start filling the other */
+static void load_param_submit(LoadParam *param)
+{
+    qemu_mutex_lock(&param->mutex);
+    while (param->work) {
+        qemu_cond_wait(&param->done_cond, &param->mutex);
+    }
+    param->work = param->fill;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    if (param->fill == &param->batch[0]) {
+        param->fill = &param->batch[1];
+    } else {
+        param->fill = &param->batch[0];
+    }
+}
+
+/**
+ * load_page_queue: queue a page to be placed by a load thread
+ *
+ * Returns the queued page; the caller fills in its payload.  The thread
+ * also takes over the COLO backup copy, so *@host_bak is cleared.
+ *
+ * @flags: RAM_SAVE_FLAG_ZERO, RAM_SAVE_FLAG_PAGE or RAM_SAVE_FLAG_XBZRLE
+ * @host: host address of the page
+ * @host_bak: pointer to the COLO backup address of the page
+ */
+static LoadPage *load_page_queue(int flags, void *host, void **host_bak)
+{
+    uintptr_t run = (uintptr_t)host >> (TARGET_PAGE_BITS + LOAD_BATCH_SHIFT);
+    LoadParam *param = &load_param[run % load_thread_count];
+    LoadBatch *batch = param->fill;
+    LoadPage *page;
+
+    if (batch->num == LOAD_BATCH_PAGES) {
+        load_param_submit(param);
+        batch = param->fill;
+    }
+
+    page = &batch->pages[batch->num];
+    page->flags = flags;
+    page->host = host;
+    page->host_bak = *host_bak;
+    page->data = batch->buf + batch->num * TARGET_PAGE_SIZE;
+    batch->num++;
+    *host_bak = NULL;
+
+    return page;
+}
+
+/* Place every queued page; returns the first error hit, if any */
+static int wait_for_load_done(void)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < load_thread_count; i++) {
+        LoadParam *param = &load_param[i];
+
+        if (param->fill->num) {
+            load_param_submit(param);
+        }
+        qemu_mutex_lock(&param->mutex);
+        while (param->work) {
+            qemu_cond_wait(&param->done_cond, &param->mutex);
+        }
+        if (param->error && !ret) {
+            ret = param->error;
+        }
+        param->error = 0;
+        qemu_mutex_unlock(&param->mutex);
+    }
+
+    return ret;
+}
+
+static void load_threads_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < load_thread_count; i++) {
+        LoadParam *param = &load_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        LoadParam *param = &load_param[i];
+
+        qemu_thread_join(&param->thread);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        qemu_cond_destroy(&param->done_cond);
+        g_free(param->batch[0].buf);
+        g_free(param->batch[1].buf);
+    }
+    g_free(load_param);
+    load_param = NULL;
+    load_thread_count = 0;
+}
+
+static void load_threads_setup(void)
+{
+    int i, thread_count = migrate_load_threads();
+
+    if (!thread_count) {
+        return;
+    }
+
+    load_param = g_new0(LoadParam, thread_count);
+    for (i = 0; i < thread_count; i++) {
+        LoadParam *param = &load_param[i];
+
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_cond_init(&param->done_cond);
+        param->batch[0].buf = g_malloc(LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+        param->batch[1].buf = g_malloc(LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+        param->fill = &param->batch[0];
+        qemu_thread_create(&param->thread, "load_pages", do_load_pages,
+                           param, QEMU_THREAD_JOINABLE);
+    }
+    load_thread_count = thread_count;
+}
+
 /*
  * colo cache: this is for secondary VM, we cache the whole
  * memory of the secondary VM, it is need to hold the global lock
@@ -3075,6 +3872,7 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
         return -1;
     }
 
+    load_threads_setup();
     xbzrle_load_setup();
     ramblock_recv_map_init();
 
@@ -3091,6 +3889,7 @@ static int ram_load_cleanup(void *opaque)
 
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    load_threads_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
@@ -3351,6 +4150,148 @@ static void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+typedef struct {
+    QemuThread thread;
+    QEMUFile *f;
+    RAMBlock *block;
+    unsigned long *bitmap;
+    unsigned long start;
+    unsigned long end;
+    Error *err;
+} MappedRamLoad;
+
+/*
+ * Read the pages in [@load->start, @load->end) that have data in the
+ * file, and zero the others.
+ */
+static void *mapped_ram_load_pages(void *opaque)
+{
+    MappedRamLoad *load = opaque;
+    RAMBlock *block = load->block;
+    unsigned long page = load->start;
+
+    while (page < load->end) {
+        unsigned long data = find_next_bit(load->bitmap, load->end, page);
+        unsigned long hole;
+
+        for (; page < data; page++) {
+            ram_handle_compressed(block->host + (page << TARGET_PAGE_BITS),
+                                  0, TARGET_PAGE_SIZE);
+        }
+        if (data >= load->end) {
+            break;
+        }
+
+        hole = find_next_zero_bit(load->bitmap, load->end, data);
+        if (qemu_get_buffer_at(load->f,
+                               block->host + (data << TARGET_PAGE_BITS),
+                               (hole - data) << TARGET_PAGE_BITS,
+                               block->pages_offset +
+                               (data << TARGET_PAGE_BITS),
+                               &load->err) < 0) {
+            break;
+        }
+        page = hole;
+    }
+    return NULL;
+}
+
+/**
+ * mapped_ram_load_block: load a RAMBlock from its fixed place in the file
+ *
+ * Reads the mapped-ram header of @block, then its pages with one thread
+ * per multifd channel, and moves the stream past the page data.
+ *
+ * Returns 0 for success or negative error
+ *
+ * @f: QEMUFile where to receive the data
+ * @block: RAMBlock to load
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    long pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = mapped_ram_bitmap_size(block);
+    uint32_t version = qemu_get_be32(f);
+    uint64_t page_size = qemu_get_be64(f);
+    unsigned long *le_bitmap, *bitmap;
+    MappedRamLoad *loads;
+    Error *local_err = NULL;
+    int i, threads, ret;
+
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    if (version != MAPPED_RAM_VERSION || page_size != TARGET_PAGE_SIZE) {
+        error_report("Unsupported mapped-ram layout of block %s "
+                     "(version %" PRIu32 ", page size %" PRIu64 ")",
+                     block->idstr, version, page_size);
+        return -EINVAL;
+    }
+    trace_mapped_ram_load_block(block->idstr, block->bitmap_offset,
+                                block->pages_offset);
+
+    /* Shared memory is not in the file and must be left alone */
+    if (ramblock_is_ignored(block)) {
+        return qemu_file_seek(f, block->pages_offset + block->used_length);
+    }
+
+    le_bitmap = bitmap_new(bitmap_size * BITS_PER_BYTE);
+    ret = qemu_get_buffer_at(f, (uint8_t *)le_bitmap, bitmap_size,
+                             block->bitmap_offset, &local_err);
+    if (ret < 0) {
+        error_report_err(local_err);
+        g_free(le_bitmap);
+        return ret;
+    }
+    bitmap = bitmap_new(pages);
+    bitmap_from_le(bitmap, le_bitmap, pages);
+    g_free(le_bitmap);
+
+    threads = MIN(migrate_multifd_channels(),
+                  DIV_ROUND_UP(pages, MAPPED_RAM_LOAD_MIN_PAGES));
+    threads = MAX(threads, 1);
+    loads = g_new0(MappedRamLoad, threads);
+    for (i = 0; i < threads; i++) {
+        MappedRamLoad *load = &loads[i];
+
+        load->f = f;
+        load->block = block;
+        load->bitmap = bitmap;
+        load->start = (uint64_t)pages * i / threads;
+        load->end = (uint64_t)pages * (i + 1) / threads;
+        if (i) {
+            qemu_thread_create(&load->thread, "mapped-ram-load",
+                               mapped_ram_load_pages, load,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+    mapped_ram_load_pages(&loads[0]);
+
+    for (i = 0; i < threads; i++) {
+        if (i) {
+            qemu_thread_join(&loads[i].thread);
+        }
+        if (loads[i].err) {
+            if (!ret) {
+                error_report_err(loads[i].err);
+                ret = -EIO;
+            } else {
+                error_free(loads[i].err);
+            }
+        }
+    }
+    g_free(loads);
+    g_free(bitmap);
+    if (ret) {
+        return ret;
+    }
+
+    return qemu_file_seek(f, block->pages_offset + block->used_length);
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3373,6 +4314,7 @@ static int ram_load_precopy(QEMUFile *f)
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
         void *host = NULL, *host_bak = NULL;
+        LoadPage *page;
         uint8_t ch;
 
         /*
@@ -3490,6 +4432,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && ram_use_mapped_ram(f)) {
+                        ret = mapped_ram_load_block(f, block);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3504,10 +4449,20 @@ static int ram_load_precopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_ZERO:
             ch = qemu_get_byte(f);
+            if (load_param) {
+                page = load_page_queue(RAM_SAVE_FLAG_ZERO, host, &host_bak);
+                page->ch = ch;
+                break;
+            }
             ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
             break;
 
         case RAM_SAVE_FLAG_PAGE:
+            if (load_param) {
+                page = load_page_queue(RAM_SAVE_FLAG_PAGE, host, &host_bak);
+                qemu_get_buffer(f, page->data, TARGET_PAGE_SIZE);
+                break;
+            }
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
             break;
 
@@ -3522,6 +4477,20 @@ static int ram_load_precopy(QEMUFile *f)
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
+            if (load_param) {
+                unsigned int xh_len;
+
+                if (load_xbzrle_header(f, &xh_len) < 0) {
+                    error_report("Failed to decompress XBZRLE page at "
+                                 RAM_ADDR_FMT, addr);
+                    ret = -EINVAL;
+                    break;
+                }
+                page = load_page_queue(RAM_SAVE_FLAG_XBZRLE, host, &host_bak);
+                page->len = xh_len;
+                qemu_get_buffer(f, page->data, xh_len);
+                break;
+            }
             if (load_xbzrle(f, addr, host) < 0) {
                 error_report("Failed to decompress XBZRLE page at "
                              RAM_ADDR_FMT, addr);
@@ -3551,6 +4520,7 @@ static int ram_load_precopy(QEMUFile *f)
     }
 
     ret |= wait_for_decompress_done();
+    ret |= wait_for_load_done();
     return ret;
 }
 
@@ -43,6 +43,8 @@ uint64_t ram_bytes_total(void);
 
 uint64_t ram_pagesize_summary(void);
 int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len);
+PostcopyFaultStats *ram_postcopy_fault_stats(void);
+AdaptiveThrottleInfo *ram_adaptive_throttle_info(void);
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected,
                            unsigned long pages);
@@ -37,6 +37,8 @@ void socket_send_channel_create(QIOTaskFunc f, void *data)
     QIOChannelSocket *sioc = qio_channel_socket_new();
     qio_channel_socket_connect_async(sioc, outgoing_args.saddr,
                                      f, data, NULL, NULL);
+    /* The task holds a reference, @f takes its own */
+    object_unref(OBJECT(sioc));
 }
 
 int socket_send_channel_destroy(QIOChannel *send)
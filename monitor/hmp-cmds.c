@@ -272,6 +272,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->multifd_bytes >> 10);
         monitor_printf(mon, "pages-per-second: %" PRIu64 "\n",
                        info->ram->pages_per_second);
+        if (info->ram->dirty_sync_missed_zero_copy) {
+            monitor_printf(mon,
+                           "Zero-copy-send fallbacks happened: %" PRIu64
+                           " times\n",
+                           info->ram->dirty_sync_missed_zero_copy);
+        }
 
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
@@ -325,6 +331,33 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_adaptive_throttle) {
+        monitor_printf(mon, "throttle dirty rate: %" PRIu64 " bytes/s\n",
+                       info->adaptive_throttle->dirty_rate);
+        monitor_printf(mon, "throttle unthrottled dirty rate: %" PRIu64
+                       " bytes/s\n",
+                       info->adaptive_throttle->unthrottled_dirty_rate);
+        monitor_printf(mon, "throttle bandwidth: %" PRIu64 " bytes/s\n",
+                       info->adaptive_throttle->bandwidth);
+        monitor_printf(mon, "throttle target dirty rate: %" PRIu64
+                       " bytes/s\n",
+                       info->adaptive_throttle->target_dirty_rate);
+        monitor_printf(mon, "throttle chosen percentage: %u\n",
+                       info->adaptive_throttle->percentage);
+        monitor_printf(mon, "throttle adjustments: %" PRIu64 "\n",
+                       info->adaptive_throttle->adjustments);
+    }
+
+    if (info->has_vcpu_throttle_percentage) {
+        uint8List *pct;
+
+        monitor_printf(mon, "vcpu throttle percentage:");
+        for (pct = info->vcpu_throttle_percentage; pct; pct = pct->next) {
+            monitor_printf(mon, " %u", pct->value);
+        }
+        monitor_printf(mon, "\n");
+    }
+
     if (info->has_postcopy_blocktime) {
         monitor_printf(mon, "postcopy blocktime: %u\n",
                        info->postcopy_blocktime);
@@ -340,6 +373,23 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->has_postcopy_faults) {
+        uint64List *bucket;
+
+        monitor_printf(mon, "postcopy sequential faults: %" PRIu64 "\n",
+                       info->postcopy_faults->sequential);
+        monitor_printf(mon, "postcopy strided faults: %" PRIu64 "\n",
+                       info->postcopy_faults->strided);
+        monitor_printf(mon, "postcopy prefetched pages: %" PRIu64 "\n",
+                       info->postcopy_faults->prefetch_pages);
+        monitor_printf(mon, "postcopy fault latency (log2 us buckets):");
+        for (bucket = info->postcopy_faults->latency; bucket;
+             bucket = bucket->next) {
+            monitor_printf(mon, " %" PRIu64, bucket->value);
+        }
+        monitor_printf(mon, "\n");
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -407,6 +457,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_DECOMPRESS_THREADS),
             params->decompress_threads);
+        assert(params->has_load_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_LOAD_THREADS),
+            params->load_threads);
         assert(params->has_throttle_trigger_threshold);
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_THROTTLE_TRIGGER_THRESHOLD),
@@ -419,6 +473,14 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT),
             params->cpu_throttle_increment);
+        assert(params->has_cpu_throttle_adaptive);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_ADAPTIVE),
+            params->cpu_throttle_adaptive ? "on" : "off");
+        assert(params->has_cpu_throttle_per_vcpu);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_PER_VCPU),
+            params->cpu_throttle_per_vcpu ? "on" : "off");
         assert(params->has_max_cpu_throttle);
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_CPU_THROTTLE),
@@ -1271,6 +1333,14 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_cpu_throttle_increment = true;
         visit_type_int(v, param, &p->cpu_throttle_increment, &err);
         break;
+    case MIGRATION_PARAMETER_CPU_THROTTLE_ADAPTIVE:
+        p->has_cpu_throttle_adaptive = true;
+        visit_type_bool(v, param, &p->cpu_throttle_adaptive, &err);
+        break;
+    case MIGRATION_PARAMETER_CPU_THROTTLE_PER_VCPU:
+        p->has_cpu_throttle_per_vcpu = true;
+        visit_type_bool(v, param, &p->cpu_throttle_per_vcpu, &err);
+        break;
     case MIGRATION_PARAMETER_MAX_CPU_THROTTLE:
         p->has_max_cpu_throttle = true;
         visit_type_int(v, param, &p->max_cpu_throttle, &err);
@@ -1339,6 +1409,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_int(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_LOAD_THREADS:
+        p->has_load_threads = true;
+        visit_type_int(v, param, &p->load_threads, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         visit_type_size(v, param, &cache_size, &err);
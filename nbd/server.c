@@ -1817,6 +1817,160 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+#ifdef CONFIG_SENDFILE
+/*
+ * Return whether @size bytes of export data at @offset can be sent without
+ * copying them through userspace.  That needs a plain socket (no TLS), a
+ * BlockBackend that does nothing on reads, and a node that maps the data
+ * onto a host file.
+ */
+static bool nbd_can_zero_copy(NBDClient *client, uint64_t offset, size_t size)
+{
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int64_t host_offset;
+
+    if (!size || client->ioc != QIO_CHANNEL(client->sioc) || !bs ||
+        blk_get_public(exp->blk)->throttle_group_member.throttle_state)
+    {
+        return false;
+    }
+
+    return bdrv_get_host_fd(bs, offset + exp->dev_offset, size,
+                            &host_offset) >= 0;
+}
+
+/*
+ * Send the reply header in @iov followed by @size bytes of export data at
+ * @offset, moved from the image file to the socket with blk_co_sendfile().
+ *
+ * Returns -ENOTSUP without sending anything if this export can't do that;
+ * the caller then reads the data into @data and sends it as usual.  Once
+ * the header is out, errors can no longer be reported to the client, so if
+ * sendfile() stops early the rest is read into @data and written normally.
+ * Returns -EIO if that fails as well, which drops the connection.
+ */
+static int coroutine_fn nbd_co_send_iov_zero_copy(NBDClient *client,
+                                                  uint64_t handle,
+                                                  struct iovec *iov,
+                                                  unsigned niov,
+                                                  uint64_t offset,
+                                                  uint8_t *data,
+                                                  size_t size,
+                                                  Error **errp)
+{
+    NBDExport *exp = client->exp;
+    size_t done = 0;
+    int ret;
+
+    if (!nbd_can_zero_copy(client, offset, size)) {
+        return -ENOTSUP;
+    }
+
+    trace_nbd_co_send_read_zero_copy(handle, offset, size);
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    qio_channel_set_cork(client->ioc, true);
+
+    if (qio_channel_writev_all(client->ioc, iov, niov, errp) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    ret = 0;
+    while (done < size) {
+        /*
+         * The node may have been reopened or replaced while we were
+         * waiting; blk_co_sendfile() waits for that to finish and looks up
+         * the host file again.
+         */
+        ret = blk_co_sendfile(exp->blk, offset + done + exp->dev_offset,
+                              size - done, client->sioc->fd);
+        if (ret > 0) {
+            done += ret;
+        } else if (ret == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+        } else {
+            /* A short host file reads as zeroes in the block layer */
+            break;
+        }
+    }
+
+    if (done < size) {
+        trace_nbd_co_send_read_zero_copy_fallback(handle, done, size, ret);
+        ret = blk_pread(exp->blk, offset + done + exp->dev_offset,
+                        data + done, size - done);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "reading from file failed");
+            ret = -EIO;
+            goto out;
+        }
+        if (qio_channel_write_all(client->ioc, (char *)data + done,
+                                  size - done, errp) < 0)
+        {
+            ret = -EIO;
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
+/*
+ * Send a successful read reply for @size bytes of export data at @offset
+ * straight from the image file: a simple reply, or an
+ * NBD_REPLY_TYPE_OFFSET_DATA chunk if structured replies were negotiated.
+ * See nbd_co_send_iov_zero_copy() for the return value.
+ */
+static int coroutine_fn nbd_co_send_read_zero_copy(NBDClient *client,
+                                                   uint64_t handle,
+                                                   uint64_t offset,
+                                                   uint8_t *data,
+                                                   size_t size,
+                                                   bool final,
+                                                   Error **errp)
+{
+    NBDSimpleReply reply;
+    NBDStructuredReadData chunk;
+    struct iovec iov;
+
+    if (client->structured_reply) {
+        set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                     NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                     sizeof(chunk) - sizeof(chunk.h) + size);
+        stq_be_p(&chunk.offset, offset);
+        iov.iov_base = &chunk;
+        iov.iov_len = sizeof(chunk);
+    } else {
+        set_be_simple_reply(&reply, 0, handle);
+        iov.iov_base = &reply;
+        iov.iov_len = sizeof(reply);
+    }
+
+    return nbd_co_send_iov_zero_copy(client, handle, &iov, 1, offset, data,
+                                     size, errp);
+}
+#else
+static int coroutine_fn nbd_co_send_read_zero_copy(NBDClient *client,
+                                                   uint64_t handle,
+                                                   uint64_t offset,
+                                                   uint8_t *data,
+                                                   size_t size,
+                                                   bool final,
+                                                   Error **errp)
+{
+    return -ENOTSUP;
+}
+#endif
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
                                                      uint32_t error,
@@ -1890,15 +2044,21 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
-                            data + progress, pnum);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_send_read_zero_copy(client, handle, offset + progress,
+                                             data + progress, pnum, final,
+                                             errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
+                                data + progress, pnum);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  offset + progress,
+                                                  data + progress, pnum, final,
+                                                  errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -2265,6 +2425,12 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    ret = nbd_co_send_read_zero_copy(client, request->handle, request->from,
+                                     data, request->len, true, errp);
+    if (ret != -ENOTSUP) {
+        return ret;
+    }
+
     ret = blk_pread(exp->blk, request->from + exp->dev_offset, data,
                     request->len);
     if (ret < 0) {
@@ -71,6 +71,7 @@ enum {
     OPTION_SHRINK = 266,
     OPTION_SALVAGE = 267,
     OPTION_TARGET_IS_ZERO = 268,
+    OPTION_SKIP_IDENTICAL = 269,
 };
 
 typedef enum OutputFormat {
@@ -1236,6 +1237,34 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
     return res;
 }
 
+/*
+ * Returns the length of the prefix of @bytes bytes at @offset1 in @bs1 that
+ * is known to hold the same data as @bs2 at @offset2, going by the hashes
+ * recorded by content-hash filter nodes.  Returns 0 if nothing is known,
+ * e.g. because the images do not record hashes.
+ */
+static int64_t content_hash_identical(BlockDriverState *bs1, int64_t offset1,
+                                      BlockDriverState *bs2, int64_t offset2,
+                                      int64_t bytes)
+{
+    int64_t done = 0;
+
+    while (done < bytes) {
+        uint8_t hash1[BDRV_CONTENT_HASH_SIZE], hash2[BDRV_CONTENT_HASH_SIZE];
+        int64_t pnum1, pnum2;
+
+        if (bdrv_get_content_hash(bs1, offset1 + done, hash1, &pnum1) < 0 ||
+            bdrv_get_content_hash(bs2, offset2 + done, hash2, &pnum2) < 0 ||
+            pnum1 != pnum2 || memcmp(hash1, hash2, sizeof(hash1)))
+        {
+            break;
+        }
+        done += pnum1;
+    }
+
+    return MIN(done, bytes);
+}
+
 #define IO_BUF_SIZE (2 * MiB)
 
 /*
@@ -1439,6 +1468,7 @@ static int img_compare(int argc, char **argv)
 
     while (offset < total_size) {
         int status1, status2;
+        int64_t same = 0;
 
         status1 = bdrv_block_status_above(bs1, NULL, offset,
                                           total_size1 - offset, &pnum1, NULL,
@@ -1471,8 +1501,15 @@ static int img_compare(int argc, char **argv)
                 goto out;
             }
         }
+        if (allocated1 || allocated2) {
+            same = content_hash_identical(bs1, offset, bs2, offset,
+                                          MIN(chunk, IO_BUF_SIZE));
+        }
         if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
             /* nothing to do */
+        } else if (same) {
+            /* The hashes say it is the same, no need to read it */
+            chunk = same;
         } else if (allocated1 == allocated2) {
             if (allocated1) {
                 int64_t pnum;
@@ -1579,6 +1616,15 @@ enum ImgConvertBlockStatus {
 
 #define MAX_COROUTINES 16
 
+/* Number of block status extents looked up ahead of the copy coroutines */
+#define MAX_STATUS_PREFETCH 64
+
+typedef struct ImgConvertExtent {
+    int64_t sector_num;
+    int nb_sectors;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1593,8 +1639,10 @@ typedef struct ImgConvertState {
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
+    bool compressed_multi_cluster;
     bool unallocated_blocks_are_zero;
     bool target_is_new;
+    bool skip_identical;
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
     bool wr_in_order;
@@ -1611,6 +1659,16 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+
+    /* Block status looked up by convert_co_prefetch_status(), under lock */
+    bool status_prefetch;
+    Coroutine *status_co;
+    ImgConvertExtent status_queue[MAX_STATUS_PREFETCH];
+    int status_head;
+    int status_count;
+    int status_ret;
+    CoQueue status_ready;
+    CoQueue status_space;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1625,11 +1683,19 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
-static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+/*
+ * Look up the allocation status of the source at @sector_num and store it
+ * in @status.  Returns the number of sectors that share that status, or
+ * -errno.
+ */
+static int convert_block_status(ImgConvertState *s, int64_t sector_num,
+                                enum ImgConvertBlockStatus *status)
 {
     int64_t src_cur_offset;
     int ret, n, src_cur;
     bool post_backing_zero = false;
+    uint64_t offset;
+    int64_t count;
 
     convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
 
@@ -1646,56 +1712,155 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
-        uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
-        int64_t count;
-
-        do {
-            count = n * BDRV_SECTOR_SIZE;
+    offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
+    do {
+        count = n * BDRV_SECTOR_SIZE;
 
-            if (s->target_has_backing) {
-                ret = bdrv_block_status(blk_bs(s->src[src_cur]), offset,
-                                        count, &count, NULL, NULL);
-            } else {
-                ret = bdrv_block_status_above(blk_bs(s->src[src_cur]), NULL,
-                                              offset, count, &count, NULL,
-                                              NULL);
-            }
+        if (s->target_has_backing) {
+            ret = bdrv_block_status(blk_bs(s->src[src_cur]), offset,
+                                    count, &count, NULL, NULL);
+        } else {
+            ret = bdrv_block_status_above(blk_bs(s->src[src_cur]), NULL,
+                                          offset, count, &count, NULL,
+                                          NULL);
+        }
 
-            if (ret < 0) {
-                if (s->salvage) {
-                    if (n == 1) {
-                        if (!s->quiet) {
-                            warn_report("error while reading block status at "
-                                        "offset %" PRIu64 ": %s", offset,
-                                        strerror(-ret));
-                        }
-                        /* Just try to read the data, then */
-                        ret = BDRV_BLOCK_DATA;
-                        count = BDRV_SECTOR_SIZE;
-                    } else {
-                        /* Retry on a shorter range */
-                        n = DIV_ROUND_UP(n, 4);
+        if (ret < 0) {
+            if (s->salvage) {
+                if (n == 1) {
+                    if (!s->quiet) {
+                        warn_report("error while reading block status at "
+                                    "offset %" PRIu64 ": %s", offset,
+                                    strerror(-ret));
                     }
+                    /* Just try to read the data, then */
+                    ret = BDRV_BLOCK_DATA;
+                    count = BDRV_SECTOR_SIZE;
                 } else {
-                    error_report("error while reading block status at offset "
-                                 "%" PRIu64 ": %s", offset, strerror(-ret));
-                    return ret;
+                    /* Retry on a shorter range */
+                    n = DIV_ROUND_UP(n, 4);
                 }
+            } else {
+                error_report("error while reading block status at offset "
+                             "%" PRIu64 ": %s", offset, strerror(-ret));
+                return ret;
             }
-        } while (ret < 0);
+        }
+    } while (ret < 0);
 
-        n = DIV_ROUND_UP(count, BDRV_SECTOR_SIZE);
+    if (ret & BDRV_BLOCK_ZERO) {
+        *status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
+    } else if (ret & BDRV_BLOCK_DATA) {
+        *status = BLK_DATA;
+    } else {
+        *status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
+    }
 
-        if (ret & BDRV_BLOCK_ZERO) {
-            s->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
-        } else if (ret & BDRV_BLOCK_DATA) {
-            s->status = BLK_DATA;
-        } else {
-            s->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
+    return DIV_ROUND_UP(count, BDRV_SECTOR_SIZE);
+}
+
+/*
+ * Walk the source ahead of the copy coroutines, so that they never have
+ * to wait for block status lookups while holding s->lock.  The queue is
+ * bounded, so this stays at most MAX_STATUS_PREFETCH extents ahead.
+ */
+static void coroutine_fn convert_co_prefetch_status(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    int64_t sector_num = 0;
+
+    while (sector_num < s->total_sectors) {
+        enum ImgConvertBlockStatus status;
+        ImgConvertExtent *e;
+        int n;
+
+        n = convert_block_status(s, sector_num, &status);
+
+        qemu_co_mutex_lock(&s->lock);
+        if (n < 0) {
+            s->status_ret = n;
+            qemu_co_queue_restart_all(&s->status_ready);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        while (s->status_count == MAX_STATUS_PREFETCH &&
+               s->ret == -EINPROGRESS) {
+            qemu_co_queue_wait(&s->status_space, &s->lock);
         }
+        if (s->ret != -EINPROGRESS) {
+            /* Copying failed; don't leave anyone waiting for us */
+            s->status_ret = s->ret;
+            qemu_co_queue_restart_all(&s->status_ready);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        e = &s->status_queue[(s->status_head + s->status_count) %
+                             MAX_STATUS_PREFETCH];
+        e->sector_num = sector_num;
+        e->nb_sectors = n;
+        e->status = status;
+        s->status_count++;
+        qemu_co_queue_restart_all(&s->status_ready);
+        qemu_co_mutex_unlock(&s->lock);
 
-        s->sector_next_status = sector_num + n;
+        sector_num += n;
+    }
+
+    s->status_co = NULL;
+}
+
+/*
+ * Take the status of @sector_num from the prefetch queue, waiting for
+ * convert_co_prefetch_status() if it hasn't got there yet.  Called with
+ * s->lock held.
+ */
+static int coroutine_fn convert_co_next_status(ImgConvertState *s,
+                                               int64_t sector_num)
+{
+    while (true) {
+        while (s->status_count) {
+            ImgConvertExtent *e = &s->status_queue[s->status_head];
+
+            if (e->sector_num + e->nb_sectors > sector_num) {
+                assert(e->sector_num <= sector_num);
+                s->status = e->status;
+                s->sector_next_status = e->sector_num + e->nb_sectors;
+                return 0;
+            }
+
+            /* Skipped over, e.g. by cluster alignment for compression */
+            s->status_head = (s->status_head + 1) % MAX_STATUS_PREFETCH;
+            s->status_count--;
+            qemu_co_queue_next(&s->status_space);
+        }
+
+        if (s->status_ret < 0) {
+            return s->status_ret;
+        }
+        qemu_co_queue_wait(&s->status_ready, &s->lock);
+    }
+}
+
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int ret, n;
+
+    assert(s->total_sectors > sector_num);
+    n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
+
+    if (s->sector_next_status <= sector_num) {
+        if (s->status_prefetch) {
+            ret = convert_co_next_status(s, sector_num);
+        } else {
+            ret = convert_block_status(s, sector_num, &s->status);
+            if (ret > 0) {
+                s->sector_next_status = sector_num + ret;
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
@@ -1772,6 +1937,31 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+/*
+ * Return true if the first cluster of @buf contains non-zero data, and set
+ * @pnum to the number of sectors in the run of whole clusters that are
+ * all zero or all non-zero, like is_allocated_sectors() does for sectors.
+ */
+static bool convert_compressed_is_allocated(ImgConvertState *s,
+                                            const uint8_t *buf, int n,
+                                            int *pnum)
+{
+    int len = MIN(n, s->cluster_sectors);
+    bool is_allocated = !buffer_is_zero(buf, len * BDRV_SECTOR_SIZE);
+    int i;
+
+    for (i = len; i < n; i += len) {
+        len = MIN(n - i, s->cluster_sectors);
+        if (is_allocated == buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                           len * BDRV_SECTOR_SIZE)) {
+            break;
+        }
+    }
+
+    *pnum = i;
+    return is_allocated;
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
@@ -1795,14 +1985,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write for completely zeroed
+             * clusters. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 convert_compressed_is_allocated(s, buf, n, &n)))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
@@ -1867,6 +2057,35 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Returns the number of sectors at @sector_num, up to @nb_sectors, that the
+ * target is known to hold already according to the content hashes of source
+ * and target.  Only used with --skip-identical.
+ */
+static int convert_identical_sectors(ImgConvertState *s, int64_t sector_num,
+                                     int nb_sectors)
+{
+    int src_cur;
+    int64_t src_cur_offset, same;
+
+    if (!s->skip_identical) {
+        return 0;
+    }
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    nb_sectors = MIN(nb_sectors, s->src_sectors[src_cur] -
+                                 (sector_num - src_cur_offset));
+
+    same = content_hash_identical(blk_bs(s->src[src_cur]),
+                                  (sector_num - src_cur_offset) <<
+                                  BDRV_SECTOR_BITS,
+                                  blk_bs(s->target),
+                                  sector_num << BDRV_SECTOR_BITS,
+                                  (int64_t)nb_sectors << BDRV_SECTOR_BITS);
+
+    return same >> BDRV_SECTOR_BITS;
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1886,7 +2105,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     while (1) {
-        int n;
+        int n, skip;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
         bool copy_range;
@@ -1921,11 +2140,18 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
 retry:
         copy_range = s->copy_range && s->status == BLK_DATA;
+        skip = 0;
         if (status == BLK_DATA && !copy_range) {
-            ret = convert_co_read(s, sector_num, n, buf);
+            /* Data that the target already has needs neither read nor write */
+            skip = convert_identical_sectors(s, sector_num, n);
+            ret = 0;
+            if (skip < n) {
+                ret = convert_co_read(s, sector_num + skip, n - skip, buf);
+            }
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
-                             sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
+                             (sector_num + skip) * BDRV_SECTOR_SIZE,
+                             strerror(-ret));
                 s->ret = ret;
             }
         } else if (!s->min_sparse && status == BLK_ZERO) {
@@ -1949,12 +2175,14 @@ retry:
                     s->copy_range = false;
                     goto retry;
                 }
-            } else {
-                ret = convert_co_write(s, sector_num, n, buf, status);
+            } else if (skip < n) {
+                ret = convert_co_write(s, sector_num + skip, n - skip, buf,
+                                       status);
             }
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
-                             sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
+                             (sector_num + skip) * BDRV_SECTOR_SIZE,
+                             strerror(-ret));
                 s->ret = ret;
             }
         }
@@ -1980,6 +2208,8 @@ retry:
     qemu_vfree(buf);
     s->co[index] = NULL;
     s->running_coroutines--;
+    /* Let the prefetcher notice if we stopped early */
+    qemu_co_queue_restart_all(&s->status_space);
     if (!s->running_coroutines && s->ret == -EINPROGRESS) {
         /* the convert job finished successfully */
         s->ret = 0;
@@ -2006,14 +2236,20 @@ static int convert_do_copy(ImgConvertState *s)
         }
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, only whole
+     * clusters can be copied, and only one at a time unless the driver
+     * compresses multi-cluster writes in parallel. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        if (s->compressed_multi_cluster) {
+            s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors,
+                                             s->cluster_sectors);
+        } else {
+            s->buf_sectors = s->cluster_sectors;
+        }
     }
 
     while (sector_num < s->total_sectors) {
@@ -2033,13 +2269,19 @@ static int convert_do_copy(ImgConvertState *s)
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->status_ready);
+    qemu_co_queue_init(&s->status_space);
+    s->status_prefetch = true;
+    s->status_co = qemu_coroutine_create(convert_co_prefetch_status, s);
+    qemu_coroutine_enter(s->status_co);
+
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
         s->wait_sector_num[i] = -1;
         qemu_coroutine_enter(s->co[i]);
     }
 
-    while (s->running_coroutines) {
+    while (s->running_coroutines || s->status_co) {
         main_loop_wait(false);
     }
 
@@ -2094,6 +2336,7 @@ static int img_convert(int argc, char **argv)
             {"target-image-opts", no_argument, 0, OPTION_TARGET_IMAGE_OPTS},
             {"salvage", no_argument, 0, OPTION_SALVAGE},
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
+            {"skip-identical", no_argument, 0, OPTION_SKIP_IDENTICAL},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WU",
@@ -2225,6 +2468,9 @@ static int img_convert(int argc, char **argv)
              */
             s.has_zero_init = true;
             break;
+        case OPTION_SKIP_IDENTICAL:
+            s.skip_identical = true;
+            break;
         }
     }
 
@@ -2268,6 +2514,11 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (s.skip_identical && !skip_create) {
+        error_report("--skip-identical requires use of -n flag");
+        goto fail_getopt;
+    }
+
     s.src_num = argc - optind - 1;
     out_filename = s.src_num >= 1 ? argv[argc - 1] : NULL;
 
@@ -2475,7 +2726,19 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    if (skip_create) {
+    /*
+     * Compressing or encrypting a whole image can keep every host CPU busy,
+     * unlike the guest I/O that qcow2 limits its threads for by default
+     */
+    if (!tgt_image_opts && !strcmp(out_fmt, "qcow2")) {
+        if (!open_opts) {
+            open_opts = qdict_new();
+        }
+        qdict_put_int(open_opts, "threads",
+                      MAX(sysconf(_SC_NPROCESSORS_ONLN), 1));
+    }
+
+    if (skip_create && tgt_image_opts) {
         s.target = img_open(tgt_image_opts, out_filename, out_fmt,
                             flags, writethrough, s.quiet, false);
     } else {
@@ -2548,10 +2811,19 @@ static int img_convert(int argc, char **argv)
         }
     } else {
         s.compressed = s.compressed || bdi.needs_compressed_writes;
+        s.compressed_multi_cluster = bdi.compressed_writes_multi_cluster;
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
         s.unallocated_blocks_are_zero = bdi.unallocated_blocks_are_zero;
     }
 
+    /* Compressed clusters can only be written as a whole */
+    if (s.skip_identical && s.compressed) {
+        error_report("--skip-identical cannot be used with compressed "
+                     "targets");
+        ret = -1;
+        goto out;
+    }
+
     ret = convert_do_copy(&s);
 out:
     if (!ret) {
@@ -3577,6 +3849,26 @@ static int img_rebase(int argc, char **argv)
                 }
             }
 
+            /*
+             * If the hashes say that the old and new backing file hold the
+             * same data, we don't need to read it
+             */
+            if (blk_new_backing && offset < old_backing_size &&
+                offset < new_backing_size)
+            {
+                int64_t same;
+
+                same = content_hash_identical(blk_bs(blk_old_backing), offset,
+                                              blk_bs(blk_new_backing), offset,
+                                              MIN(n, MIN(old_backing_size,
+                                                         new_backing_size) -
+                                                     offset));
+                if (same) {
+                    n = same;
+                    continue;
+                }
+            }
+
             /*
              * Read old and new backing file and take into consideration that
              * backing files may be smaller than the COW image.
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+#
+# Benchmark the NBD client with requests spread across multiple connections
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+
+import simplebench
+
+
+def bench_nbd_read(qemu_img, qemu_nbd, image, multi_conn, buf_size, depth,
+                   count):
+    """Benchmark reads from a read-only qemu-nbd export with qemu-img bench
+
+    qemu-nbd advertises NBD_FLAG_CAN_MULTI_CONN for read-only exports that
+    allow more than one client, so the client opens @multi_conn
+    connections.
+
+    Returns {'seconds': float} on success and {'error': str} on failure,
+    which is compatible with simplebench lib.
+    """
+
+    sock_dir = tempfile.mkdtemp()
+    sock = os.path.join(sock_dir, 'nbd.sock')
+    nbd = subprocess.Popen([qemu_nbd, '-r', '-e', '16', '-t', '-f', 'raw',
+                            '-k', sock, image])
+
+    try:
+        for _ in range(100):
+            if os.path.exists(sock):
+                break
+            time.sleep(0.1)
+        else:
+            return {'error': 'qemu-nbd did not create ' + sock}
+
+        opts = 'driver=nbd,server.type=unix,server.path={},multi-conn={}'
+        start = time.time()
+        res = subprocess.run([qemu_img, 'bench', '--image-opts',
+                              '-c', str(count), '-d', str(depth),
+                              '-s', str(buf_size),
+                              opts.format(sock, multi_conn)],
+                             stdout=subprocess.DEVNULL,
+                             stderr=subprocess.PIPE,
+                             universal_newlines=True)
+        seconds = time.time() - start
+    finally:
+        nbd.terminate()
+        nbd.wait()
+        shutil.rmtree(sock_dir)
+
+    if res.returncode != 0:
+        return {'error': res.stderr}
+
+    return {'seconds': seconds}
+
+
+def bench_func(env, case):
+    """ Handle one "cell" of benchmarking table. """
+    return bench_nbd_read(qemu_img, qemu_nbd, image, env['multi-conn'],
+                          case['buf-size'], case['depth'], case['count'])
+
+
+# Set these to the binaries to test and a raw image of at least 1 GiB,
+# preferably on fast storage so that the connection is the bottleneck.
+qemu_img = '/path-to-qemu-img'
+qemu_nbd = '/path-to-qemu-nbd'
+image = '/path-to-raw-image'
+
+# Test-cases are "rows" in benchmark resulting table, 'id' is a caption for
+# the row, other fields are handled by bench_func.
+test_cases = [
+    {'id': '4k, depth 64', 'buf-size': 4096, 'depth': 64, 'count': 262144},
+    {'id': '64k, depth 16', 'buf-size': 65536, 'depth': 16, 'count': 16384},
+    {'id': '1M, depth 4', 'buf-size': 1048576, 'depth': 4, 'count': 1024},
+]
+
+# Test-envs are "columns" in benchmark resulting table, 'id is a caption for
+# the column, other fields are handled by bench_func.
+test_envs = [
+    {'id': 'multi-conn=1', 'multi-conn': 1},
+    {'id': 'multi-conn=2', 'multi-conn': 2},
+    {'id': 'multi-conn=4', 'multi-conn': 4},
+]
+
+result = simplebench.bench(bench_func, test_envs, test_cases, count=3)
+print(simplebench.ascii(result))
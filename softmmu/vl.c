@@ -4499,6 +4499,9 @@ void qemu_cleanup(void)
 
     /* No more vcpu or device emulation activity beyond this point */
     vm_shutdown();
+    if (kvm_enabled()) {
+        kvm_cleanup();
+    }
     replay_finish();
 
     job_cancel_sync_all();
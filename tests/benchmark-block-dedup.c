@@ -0,0 +1,123 @@
+/*
+ * Deduplicating block driver write speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+#include "crypto/init.h"
+
+typedef struct DedupBenchParams {
+    const char *name;
+    size_t cluster_size;
+    bool dedup;
+    bool unique;
+} DedupBenchParams;
+
+static BlockBackend *open_bench_blk(const DedupBenchParams *p)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk;
+    QDict *options = qdict_new();
+
+    if (p->dedup) {
+        qdict_put_str(options, "driver", "dedup");
+        qdict_put_int(options, "cluster-size", p->cluster_size);
+        qdict_put_str(options, "file.driver", "null-co");
+        qdict_put_str(options, "file.read-zeroes", "on");
+        qdict_put_str(options, "map-file.driver", "null-co");
+        qdict_put_str(options, "map-file.read-zeroes", "on");
+    } else {
+        qdict_put_str(options, "driver", "null-co");
+        qdict_put_str(options, "read-zeroes", "on");
+    }
+
+    bs = bdrv_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+    blk = blk_new(qemu_get_aio_context(), BLK_PERM_ALL, BLK_PERM_ALL);
+    blk_insert_bs(blk, bs, &error_abort);
+    bdrv_unref(bs);
+
+    return blk;
+}
+
+static void test_dedup_write_speed(const void *opaque)
+{
+    const DedupBenchParams *p = opaque;
+    const size_t total = 256 * MiB;
+    BlockBackend *blk;
+    uint8_t *buf;
+    uint64_t offset;
+    int ret;
+
+    blk = open_bench_blk(p);
+    buf = blk_blockalign(blk, p->cluster_size);
+    memset(buf, 0x5a, p->cluster_size);
+
+    g_test_timer_start();
+    for (offset = 0; offset < total; offset += p->cluster_size) {
+        if (p->unique) {
+            memcpy(buf, &offset, sizeof(offset));
+        }
+        ret = blk_pwrite(blk, offset, buf, p->cluster_size, 0);
+        g_assert(ret >= 0);
+    }
+    ret = blk_flush(blk);
+    g_assert(ret == 0);
+    g_test_timer_elapsed();
+
+    g_print("%s: ", p->name);
+    g_print("Write %zu MB chunk size %zu bytes ", total / MiB,
+            p->cluster_size);
+    g_print("%.2f MB/sec ", (double)total / MiB / g_test_timer_last());
+
+    qemu_vfree(buf);
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        bool dedup;
+        bool unique;
+    } modes[] = {
+        { "null-co",         false, false },
+        { "dedup-unique",    true,  true  },
+        { "dedup-duplicate", true,  false },
+    };
+    size_t i, cluster_size;
+    char name[64];
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+    g_assert(qcrypto_init(NULL) == 0);
+
+    for (cluster_size = 4 * KiB; cluster_size <= 1 * MiB; cluster_size *= 16) {
+        for (i = 0; i < ARRAY_SIZE(modes); i++) {
+            DedupBenchParams *p = g_new(DedupBenchParams, 1);
+
+            *p = (DedupBenchParams) {
+                .name           = modes[i].name,
+                .cluster_size   = cluster_size,
+                .dedup          = modes[i].dedup,
+                .unique         = modes[i].unique,
+            };
+            snprintf(name, sizeof(name), "/block/dedup/speed-%s-%zu",
+                     modes[i].name, cluster_size);
+            g_test_add_data_func_full(name, p, test_dedup_write_speed,
+                                      g_free);
+        }
+    }
+
+    return g_test_run();
+}
@@ -14,10 +14,13 @@
 
 #include "libqtest.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
 #include "qemu/sockets.h"
+#include "qemu/units.h"
 #include "chardev/char.h"
 #include "qapi/qapi-visit-sockets.h"
 #include "qapi/qobject-input-visitor.h"
@@ -36,6 +39,7 @@ static bool uffd_feature_thread_id;
 #if defined(__linux__)
 #include <sys/syscall.h>
 #include <sys/vfs.h>
+#include <sys/resource.h>
 #endif
 
 #if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
@@ -392,6 +396,32 @@ static void migrate_set_parameter_str(QTestState *who, const char *parameter,
     migrate_check_parameter_str(who, parameter, value);
 }
 
+static bool migrate_get_parameter_bool(QTestState *who,
+                                       const char *parameter)
+{
+    QDict *rsp;
+    bool result;
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate-parameters' }");
+    result = qdict_get_bool(rsp, parameter);
+    qobject_unref(rsp);
+    return result;
+}
+
+static void migrate_set_parameter_bool(QTestState *who, const char *parameter,
+                                       bool value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %i } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+    g_assert(migrate_get_parameter_bool(who, parameter) == value);
+}
+
 static void migrate_pause(QTestState *who)
 {
     QDict *rsp;
@@ -647,6 +677,7 @@ static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
 
     cleanup("bootsect");
     cleanup("migsocket");
+    cleanup("migfile");
     cleanup("src_serial");
     cleanup("dest_serial");
 }
@@ -700,7 +731,8 @@ static void test_deprecated(void)
 
 static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     QTestState **to_ptr,
-                                    MigrateStart *args)
+                                    MigrateStart *args,
+                                    bool prefetch)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
@@ -712,6 +744,9 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(from, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
+    if (prefetch) {
+        migrate_set_capability(from, "postcopy-prefetch", true);
+    }
 
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -748,15 +783,71 @@ static void migrate_postcopy_complete(QTestState *from, QTestState *to)
     test_migrate_end(from, to, true);
 }
 
+/*
+ * Check the postcopy request statistics of a completed migration.  The
+ * guest keeps touching pages that were not sent yet, so the destination
+ * must have requested at least one page.
+ */
+static void check_postcopy_faults(QTestState *from, bool prefetch)
+{
+    QDict *rsp_return, *faults;
+    QList *latency;
+    QListEntry *entry;
+    uint64_t requests = 0, patterns;
+    int buckets = 0;
+
+    rsp_return = migrate_query(from);
+    faults = qdict_get_qdict(rsp_return, "postcopy-faults");
+    g_assert(faults);
+
+    latency = qdict_get_qlist(faults, "latency");
+    g_assert(latency);
+    QLIST_FOREACH_ENTRY(latency, entry) {
+        requests += qnum_get_uint(qobject_to(QNum, qlist_entry_obj(entry)));
+        buckets++;
+    }
+    g_assert_cmpint(buckets, ==, 24);
+    g_assert_cmpint(requests, >, 0);
+
+    patterns = qdict_get_int(faults, "sequential") +
+               qdict_get_int(faults, "strided");
+    if (prefetch) {
+        /* The first request can't continue a run */
+        g_assert_cmpint(patterns, <, requests);
+        g_assert_cmpint(qdict_get_int(faults, "prefetch-pages"), >, 0);
+    } else {
+        g_assert_cmpint(patterns, ==, 0);
+        g_assert_cmpint(qdict_get_int(faults, "prefetch-pages"), ==, 0);
+    }
+
+    qobject_unref(rsp_return);
+}
+
 static void test_postcopy(void)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
 
-    if (migrate_postcopy_prepare(&from, &to, args)) {
+    if (migrate_postcopy_prepare(&from, &to, args, false)) {
         return;
     }
     migrate_postcopy_start(from, to);
+    wait_for_migration_complete(from);
+    check_postcopy_faults(from, false);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_prefetch(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, args, true)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    wait_for_migration_complete(from);
+    check_postcopy_faults(from, true);
     migrate_postcopy_complete(from, to);
 }
 
@@ -768,7 +859,7 @@ static void test_postcopy_recovery(void)
 
     args->hide_stderr = true;
 
-    if (migrate_postcopy_prepare(&from, &to, args)) {
+    if (migrate_postcopy_prepare(&from, &to, args, false)) {
         return;
     }
 
@@ -918,7 +1009,7 @@ static void test_ignore_shared(void)
 }
 #endif
 
-static void test_xbzrle(const char *uri)
+static void test_xbzrle(const char *uri, int load_threads)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -941,6 +1032,10 @@ static void test_xbzrle(const char *uri)
 
     migrate_set_capability(from, "xbzrle", "true");
     migrate_set_capability(to, "xbzrle", "true");
+
+    if (load_threads) {
+        migrate_set_parameter_int(to, "load-threads", load_threads);
+    }
     /* Wait for the first serial output from the source */
     wait_for_serial("src_serial");
 
@@ -966,7 +1061,15 @@ static void test_xbzrle_unix(void)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
 
-    test_xbzrle(uri);
+    test_xbzrle(uri, 0);
+    g_free(uri);
+}
+
+static void test_xbzrle_unix_load_threads(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+
+    test_xbzrle(uri, 4);
     g_free(uri);
 }
 
@@ -1260,7 +1363,69 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+static void test_migrate_auto_converge_adaptive(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp_return, *throttle;
+    int64_t percentage;
+
+    const int64_t max_pct = 95;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "auto-converge", true);
+    migrate_set_parameter_bool(from, "cpu-throttle-adaptive", true);
+    migrate_set_parameter_int(from, "max-cpu-throttle", max_pct);
+
+    /*
+     * With ~1Mb/s and a 1ms downtime limit, no dirty rate of the guest
+     * can be allowed, so the controller has to throttle.
+     */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000); /* ~1Mb/s */
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* Wait for throttling begins */
+    percentage = 0;
+    while (percentage == 0) {
+        percentage = read_migrate_property_int(from, "cpu-throttle-percentage");
+        usleep(100);
+        g_assert_false(got_stop);
+    }
+    g_assert_cmpint(percentage, <=, max_pct);
+
+    rsp_return = migrate_query(from);
+    throttle = qdict_get_qdict(rsp_return, "adaptive-throttle");
+    g_assert(throttle);
+    g_assert_cmpint(qdict_get_int(throttle, "bandwidth"), >, 0);
+    g_assert_cmpint(qdict_get_int(throttle, "percentage"), <=, max_pct);
+    g_assert_cmpint(qdict_get_int(throttle, "adjustments"), >=, 1);
+    qobject_unref(rsp_return);
+
+    /* Now, when we tested that throttling works, let it converge */
+    migrate_set_parameter_int(from, "downtime-limit", 250);
+    migrate_set_parameter_int(from, "max-bandwidth", 400000000);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    g_free(uri);
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_multifd_tcp(const char *method, bool zero_page,
+                             bool zero_copy)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1290,6 +1455,15 @@ static void test_multifd_tcp(const char *method)
     migrate_set_capability(from, "multifd", "true");
     migrate_set_capability(to, "multifd", "true");
 
+    if (zero_page) {
+        migrate_set_capability(from, "multifd-zero-page", "true");
+        migrate_set_capability(to, "multifd-zero-page", "true");
+    }
+
+    if (zero_copy) {
+        migrate_set_capability(from, "zero-copy-send", "true");
+    }
+
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
                            "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
@@ -1318,20 +1492,108 @@ static void test_multifd_tcp(const char *method)
     g_free(uri);
 }
 
+/*
+ * Save the whole guest to a file, then start the destination from it
+ * once the source has stopped.  Mapped-ram writes the pages from the
+ * multifd channels.
+ */
+static void test_migrate_file(bool mapped_ram)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    if (mapped_ram) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", "true");
+        migrate_set_capability(to, "multifd", "true");
+        migrate_set_capability(from, "mapped-ram", "true");
+        migrate_set_capability(to, "mapped-ram", "true");
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_precopy_file(void)
+{
+    test_migrate_file(false);
+}
+
+static void test_multifd_file_mapped_ram(void)
+{
+    test_migrate_file(true);
+}
+
 static void test_multifd_tcp_none(void)
 {
-    test_multifd_tcp("none");
+    test_multifd_tcp("none", false, false);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp("none", true, false);
 }
 
 static void test_multifd_tcp_zlib(void)
 {
-    test_multifd_tcp("zlib");
+    test_multifd_tcp("zlib", false, false);
 }
 
+static void test_multifd_tcp_xbzrle(void)
+{
+    test_multifd_tcp("xbzrle", false, false);
+}
+
+#ifdef CONFIG_LINUX
+static void test_multifd_tcp_zero_copy(void)
+{
+    struct rlimit rlim;
+
+    /*
+     * Pages stay pinned and accounted as locked memory until the kernel
+     * reports the write as complete, which can be a socket buffer's worth
+     * for each of the 16 channels.
+     */
+    if (getrlimit(RLIMIT_MEMLOCK, &rlim) == 0 &&
+        rlim.rlim_cur != RLIM_INFINITY && rlim.rlim_cur < 256 * MiB) {
+        g_test_skip("RLIMIT_MEMLOCK too low for zero copy send");
+        return;
+    }
+    test_multifd_tcp("none", false, true);
+}
+#endif
+
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
-    test_multifd_tcp("zstd");
+    test_multifd_tcp("zstd", false, false);
 }
 #endif
 
@@ -1481,12 +1743,16 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/prefetch", test_postcopy_prefetch);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/precopy/file", test_precopy_file);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/xbzrle/unix/load-threads",
+                   test_xbzrle_unix_load_threads);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
@@ -1496,9 +1762,20 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/auto_converge/adaptive",
+                   test_migrate_auto_converge_adaptive);
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
+    qtest_add_func("/migration/multifd/file/mapped-ram",
+                   test_multifd_file_mapped_ram);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+    qtest_add_func("/migration/multifd/tcp/xbzrle", test_multifd_tcp_xbzrle);
+#ifdef CONFIG_LINUX
+    qtest_add_func("/migration/multifd/tcp/zero-copy",
+                   test_multifd_tcp_zero_copy);
+#endif
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
@@ -766,6 +766,124 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+/*
+ * Add a 512 byte read or write of @sector to @vq without kicking it.  Writes
+ * store "TEST<sector>".  Returns the address of the request.
+ */
+static uint64_t multi_iothread_add_req(QTestState *qts, QVirtioDevice *dev,
+                                       QVirtQueue *vq, QGuestAllocator *alloc,
+                                       uint32_t type, uint64_t sector,
+                                       uint32_t *free_head)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (type == VIRTIO_BLK_T_OUT) {
+        sprintf(req.data, "TEST%" PRIu64, sector);
+    }
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    *free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, type == VIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+    return req_addr;
+}
+
+/*
+ * Each of the two virtqueues is served by its own IOThread.  Keep requests
+ * in flight on both queues at the same time, so that they complete in two
+ * different AioContexts and notify the guest from both.
+ */
+static void multi_iothread(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioPCIDevice *pdev = &blk->pci_vdev;
+    QVirtioDevice *dev = &pdev->vdev;
+    QOSGraphObject *blk_object = obj;
+    QPCIDevice *pci_dev = blk_object->get_driver(blk_object, "pci-device");
+    QTestState *qts = global_qtest;
+    QVirtQueue *vq[2];
+    uint64_t req_addr[2];
+    uint32_t free_head[2];
+    uint64_t features;
+    char data[512];
+    char expected[16];
+    int i;
+
+    if (qpci_check_buggy_msi(pci_dev)) {
+        return;
+    }
+
+    /* One vector per queue, so that completions can be told apart */
+    qpci_msix_enable(pdev->pdev);
+    qvirtio_pci_set_msix_configuration_vector(pdev, t_alloc, 0);
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    for (i = 0; i < 2; i++) {
+        vq[i] = qvirtqueue_setup(dev, t_alloc, i);
+        qvirtqueue_pci_msix_setup(pdev, (QVirtQueuePCI *)vq[i], t_alloc,
+                                  i + 1);
+    }
+    qvirtio_set_driver_ok(dev);
+
+    /* Write sector i through queue i */
+    for (i = 0; i < 2; i++) {
+        req_addr[i] = multi_iothread_add_req(qts, dev, vq[i], t_alloc,
+                                             VIRTIO_BLK_T_OUT, i,
+                                             &free_head[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        qvirtqueue_kick(qts, dev, vq[i], free_head[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        qvirtio_wait_used_elem(qts, dev, vq[i], free_head[i], NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    /* Read each sector back through the other queue */
+    for (i = 0; i < 2; i++) {
+        req_addr[i] = multi_iothread_add_req(qts, dev, vq[i], t_alloc,
+                                             VIRTIO_BLK_T_IN, 1 - i,
+                                             &free_head[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        qvirtqueue_kick(qts, dev, vq[i], free_head[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        qvirtio_wait_used_elem(qts, dev, vq[i], free_head[i], NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+
+        memread(req_addr[i] + 16, data, 512);
+        snprintf(expected, sizeof(expected), "TEST%d", 1 - i);
+        g_assert_cmpstr(data, ==, expected);
+
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    /* End test */
+    qpci_msix_disable(pdev->pdev);
+    for (i = 0; i < 2; i++) {
+        qvirtqueue_cleanup(dev->bus, vq[i], t_alloc);
+    }
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -780,6 +898,14 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_test_setup_iothreads(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=thread0"
+                    " -object iothread,id=thread1");
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -797,6 +923,12 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.before = virtio_blk_test_setup_iothreads;
+    opts.edge = (QOSGraphEdgeOptions) {
+        .extra_device_opts = "num-queues=2,iothreads=thread0:thread1",
+    };
+    qos_add_test("multi-iothread", "virtio-blk-pci", multi_iothread, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -0,0 +1,127 @@
+/*
+ * Test per-node block latency histograms
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "block/accounting.h"
+
+static void test_bucket_small_values(void)
+{
+    unsigned i;
+
+    for (i = 0; i < 2 * BLOCK_LAT_SUB_BUCKETS; i++) {
+        g_assert_cmpuint(block_latency_log_bucket(i), ==, i);
+        g_assert_cmpuint(block_latency_log_bucket_upper(i), ==, i);
+    }
+}
+
+static void test_bucket_bounds(void)
+{
+    uint64_t v;
+
+    /* Every value must fall into a bucket whose range contains it */
+    for (v = 1; v < (1ULL << (BLOCK_LAT_MAX_BITS + 1)); v = v * 3 + 1) {
+        unsigned idx = block_latency_log_bucket(v);
+        uint64_t upper = block_latency_log_bucket_upper(idx);
+
+        g_assert_cmpuint(idx, <, BLOCK_LAT_NR_BUCKETS);
+        g_assert_cmpuint(v, <=, upper);
+        g_assert_cmpuint(upper - v, <=, v / BLOCK_LAT_SUB_BUCKETS);
+        if (idx > 0) {
+            g_assert_cmpuint(v, >, block_latency_log_bucket_upper(idx - 1));
+        }
+    }
+}
+
+static void test_bucket_monotonic(void)
+{
+    unsigned i;
+
+    for (i = 1; i < BLOCK_LAT_NR_BUCKETS; i++) {
+        uint64_t upper = block_latency_log_bucket_upper(i);
+
+        g_assert_cmpuint(upper, >, block_latency_log_bucket_upper(i - 1));
+        g_assert_cmpuint(block_latency_log_bucket(upper), ==, i);
+        g_assert_cmpuint(block_latency_log_bucket(upper + 1), ==,
+                         MIN(i + 1, BLOCK_LAT_NR_BUCKETS - 1));
+    }
+}
+
+static void test_bucket_clamp(void)
+{
+    g_assert_cmpuint(block_latency_log_bucket(UINT64_MAX), ==,
+                     BLOCK_LAT_NR_BUCKETS - 1);
+    g_assert_cmpuint(block_latency_log_bucket(1ULL << 50), ==,
+                     BLOCK_LAT_NR_BUCKETS - 1);
+}
+
+static void test_percentiles(void)
+{
+    BlockNodeLatencyStats *stats = block_node_latency_stats_new();
+    BlockLatencyLogHistogram hist;
+    uint64_t p50, p99, p999;
+    unsigned i;
+
+    /* 1000 requests taking 1..1000 us */
+    for (i = 1; i <= 1000; i++) {
+        block_node_latency_account(stats, BLOCK_ACCT_READ, i * 1000);
+    }
+    block_node_latency_account(stats, BLOCK_ACCT_WRITE, 42);
+
+    block_node_latency_snapshot(stats, BLOCK_ACCT_READ, &hist);
+    g_assert_cmpuint(hist.count, ==, 1000);
+    g_assert_cmpuint(hist.min_ns, ==, 1000);
+    g_assert_cmpuint(hist.max_ns, ==, 1000000);
+    g_assert_cmpuint(hist.sum_ns, ==, 500500000);
+
+    p50 = block_latency_log_percentile(&hist, 500);
+    p99 = block_latency_log_percentile(&hist, 990);
+    p999 = block_latency_log_percentile(&hist, 999);
+
+    g_assert_cmpuint(p50, >=, 500000);
+    g_assert_cmpuint(p50, <=, 500000 + 500000 / BLOCK_LAT_SUB_BUCKETS);
+    g_assert_cmpuint(p99, >=, 990000);
+    g_assert_cmpuint(p99, <=, 1000000);
+    g_assert_cmpuint(p999, >=, 999000);
+    g_assert_cmpuint(p999, <=, 1000000);
+    g_assert_cmpuint(block_latency_log_percentile(&hist, 0), >=, 1000);
+    g_assert_cmpuint(block_latency_log_percentile(&hist, 0), <=,
+                     1000 + 1000 / BLOCK_LAT_SUB_BUCKETS);
+    g_assert_cmpuint(block_latency_log_percentile(&hist, 1000), ==, 1000000);
+
+    block_node_latency_snapshot(stats, BLOCK_ACCT_WRITE, &hist);
+    g_assert_cmpuint(hist.count, ==, 1);
+    g_assert_cmpuint(block_latency_log_percentile(&hist, 500), ==, 42);
+    g_assert_cmpuint(block_latency_log_percentile(&hist, 999), ==, 42);
+
+    block_node_latency_snapshot(stats, BLOCK_ACCT_FLUSH, &hist);
+    g_assert_cmpuint(hist.count, ==, 0);
+    g_assert_cmpuint(block_latency_log_percentile(&hist, 500), ==, 0);
+
+    block_node_latency_stats_free(stats);
+}
+
+static void test_disabled(void)
+{
+    g_assert_cmpint(block_node_latency_start(NULL), ==, 0);
+    /* Must not crash */
+    block_node_latency_done(NULL, BLOCK_ACCT_READ, 0);
+    block_node_latency_stats_free(NULL);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/block-latency/bucket/small-values",
+                    test_bucket_small_values);
+    g_test_add_func("/block-latency/bucket/bounds", test_bucket_bounds);
+    g_test_add_func("/block-latency/bucket/monotonic", test_bucket_monotonic);
+    g_test_add_func("/block-latency/bucket/clamp", test_bucket_clamp);
+    g_test_add_func("/block-latency/percentiles", test_percentiles);
+    g_test_add_func("/block-latency/disabled", test_disabled);
+    return g_test_run();
+}
@@ -92,6 +92,55 @@ static void test_io_channel_fd(void)
 }
 
 
+#ifdef CONFIG_PREADV
+static void test_io_channel_file_pio(void)
+{
+    QIOChannel *ioc;
+    char head[] = "head", tail[] = "tail", buf[8];
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = 4 },
+        { .iov_base = buf + 4, .iov_len = 4 },
+    };
+    Error *err = NULL;
+
+    unlink(TEST_FILE);
+    ioc = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_RDWR | O_CREAT | O_TRUNC | O_BINARY, TEST_MASK,
+                          &error_abort));
+    g_assert(qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE));
+
+    /* Out of order writes, leaving a hole at the start */
+    iov[0].iov_base = tail;
+    g_assert_cmpint(qio_channel_pwritev_all(ioc, iov, 1, 8192,
+                                            &error_abort), ==, 0);
+    iov[0].iov_base = head;
+    g_assert_cmpint(qio_channel_pwritev_all(ioc, iov, 1, 4096,
+                                            &error_abort), ==, 0);
+    iov[0].iov_base = buf;
+
+    /* Positioned I/O leaves the stream position alone */
+    g_assert_cmpint(qio_channel_io_seek(ioc, 0, SEEK_CUR, &error_abort),
+                    ==, 0);
+
+    g_assert_cmpint(qio_channel_preadv_all(ioc, iov, 1, 4096,
+                                           &error_abort), ==, 0);
+    g_assert(memcmp(buf, head, 4) == 0);
+    g_assert_cmpint(qio_channel_preadv_all(ioc, iov, 2, 8188,
+                                           &error_abort), ==, 0);
+    g_assert(memcmp(buf, "\0\0\0\0tail", 8) == 0);
+
+    /* Short reads past the end of the file are an error */
+    g_assert_cmpint(qio_channel_preadv_all(ioc, iov, 2, 8192, &err), ==, -1);
+    g_assert(err);
+    error_free(err);
+
+    unlink(TEST_FILE);
+    object_unref(OBJECT(ioc));
+}
+#endif
+
+
 #ifndef _WIN32
 static void test_io_channel_pipe(bool async)
 {
@@ -106,6 +155,7 @@ static void test_io_channel_pipe(bool async)
 
     src = QIO_CHANNEL(qio_channel_file_new_fd(fd[1]));
     dst = QIO_CHANNEL(qio_channel_file_new_fd(fd[0]));
+    g_assert(!qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_SEEKABLE));
 
     test = qio_channel_test_new();
     qio_channel_test_run_threads(test, async, src, dst);
@@ -137,6 +187,9 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/file", test_io_channel_file);
     g_test_add_func("/io/channel/file/rdwr", test_io_channel_file_rdwr);
     g_test_add_func("/io/channel/file/fd", test_io_channel_fd);
+#ifdef CONFIG_PREADV
+    g_test_add_func("/io/channel/file/pio", test_io_channel_file_pio);
+#endif
 #ifndef _WIN32
     g_test_add_func("/io/channel/pipe/sync", test_io_channel_pipe_sync);
     g_test_add_func("/io/channel/pipe/async", test_io_channel_pipe_async);
@@ -22,6 +22,7 @@
 #include "qemu/module.h"
 #include "block/throttle-groups.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/qtest.h"
 
 static AioContext     *ctx;
 static LeakyBucket    bkt;
@@ -30,6 +31,14 @@ static ThrottleGroupMember tgm;
 static ThrottleState  ts;
 static ThrottleTimers *tt;
 
+/* This is the clock for QEMU_CLOCK_VIRTUAL */
+static int64_t virtual_clock_ns;
+
+int64_t cpu_get_clock(void)
+{
+    return virtual_clock_ns;
+}
+
 /* useful function */
 static bool double_cmp(double x, double y)
 {
@@ -738,6 +747,169 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+typedef struct FairShareWorker {
+    ThrottleGroupMember tgm;
+    unsigned int bytes;
+    bool is_write;
+    uint64_t ops;
+    bool done;
+} FairShareWorker;
+
+static bool fair_share_stop;
+
+static void coroutine_fn fair_share_worker_entry(void *opaque)
+{
+    FairShareWorker *w = opaque;
+
+    /* An infinitely fast device with a queue depth of one */
+    while (!fair_share_stop) {
+        throttle_group_co_io_limits_intercept(&w->tgm, w->bytes, w->is_write);
+        w->ops++;
+    }
+    w->done = true;
+}
+
+/*
+ * Run everything that is ready, then advance the virtual clock to the next
+ * timer, but not beyond @deadline
+ */
+static void fair_share_step(int64_t deadline)
+{
+    int64_t now, next;
+
+    while (aio_poll(ctx, false)) {
+        /* Do nothing */
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    next = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL, QEMU_TIMER_ATTR_ALL);
+    if (next >= 0) {
+        deadline = MIN(deadline, now + next);
+    }
+    virtual_clock_ns = MAX(deadline, now);
+}
+
+static void fair_share_run_until(int64_t deadline)
+{
+    while (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) < deadline) {
+        fair_share_step(deadline);
+    }
+}
+
+/*
+ * Run @n workers in a throttle group limited by @cfg for @ms milliseconds of
+ * virtual time and return the number of operations each of them completed
+ * in @ops, not counting a warm-up period in which the initial burst allowed
+ * by the empty leaky bucket is spent.
+ */
+static void fair_share_run(bool fair_share, ThrottleConfig *cfg,
+                           const unsigned *weights,
+                           const unsigned int *bytes, int n, int ms,
+                           uint64_t *ops)
+{
+    FairShareWorker *w = g_new0(FairShareWorker, n);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    Object *group;
+    bool done;
+    int i;
+
+    group = object_new_with_props(TYPE_THROTTLE_GROUP,
+                                  object_get_objects_root(), "fair",
+                                  &error_abort,
+                                  "fair-share", fair_share ? "on" : "off",
+                                  NULL);
+
+    for (i = 0; i < n; i++) {
+        throttle_group_register_tgm(&w[i].tgm, "fair", ctx);
+        throttle_group_set_weight(&w[i].tgm, weights[i]);
+        w[i].bytes = bytes[i];
+    }
+    throttle_group_config(&w[0].tgm, cfg);
+
+    fair_share_stop = false;
+    for (i = 0; i < n; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(fair_share_worker_entry,
+                                                   &w[i]));
+    }
+
+    fair_share_run_until(now + ms * SCALE_MS / 5);
+    for (i = 0; i < n; i++) {
+        ops[i] = w[i].ops;
+    }
+    fair_share_run_until(now + ms * SCALE_MS);
+    for (i = 0; i < n; i++) {
+        ops[i] = w[i].ops - ops[i];
+    }
+
+    /* Let every worker finish its last request */
+    fair_share_stop = true;
+    do {
+        fair_share_step(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + SCALE_MS);
+        done = true;
+        for (i = 0; i < n; i++) {
+            done &= w[i].done;
+        }
+    } while (!done);
+
+    for (i = 0; i < n; i++) {
+        throttle_group_unregister_tgm(&w[i].tgm);
+    }
+    object_unparent(group);
+    g_free(w);
+}
+
+static void test_fair_share_weights(void)
+{
+    const unsigned weights[] = { 300, 100 };
+    const unsigned int bytes[] = { 4096, 4096 };
+    uint64_t ops[2];
+    double ratio;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 4000;
+
+    fair_share_run(true, &cfg, weights, bytes, 2, 2000, ops);
+    ratio = (double)ops[0] / MAX(ops[1], 1);
+    g_test_message("weights 300:100, ops %" PRIu64 ":%" PRIu64
+                   " (ratio %.2f)", ops[0], ops[1], ratio);
+
+    g_assert_cmpfloat(ratio, >, 2.0);
+    g_assert_cmpfloat(ratio, <, 4.0);
+}
+
+static void test_fair_share_cost(void)
+{
+    /* A large sequential reader and a small random reader */
+    const unsigned weights[] = { 100, 100 };
+    const unsigned int bytes[] = { 1024 * 1024, 4096 };
+    uint64_t rr[2], fair[2];
+    double rr_share, fair_share;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 64 * 1024 * 1024;
+
+    fair_share_run(false, &cfg, weights, bytes, 2, 2000, rr);
+    fair_share_run(true, &cfg, weights, bytes, 2, 2000, fair);
+
+    /* Share of the transferred bytes that went to the small reader */
+    rr_share = (double)rr[1] * bytes[1] /
+               (rr[0] * bytes[0] + rr[1] * bytes[1]);
+    fair_share = (double)fair[1] * bytes[1] /
+                 (fair[0] * bytes[0] + fair[1] * bytes[1]);
+    g_test_message("small reader: round-robin %" PRIu64 " ops (%.1f%%), "
+                   "fair-share %" PRIu64 " ops (%.1f%%)",
+                   rr[1], rr_share * 100, fair[1], fair_share * 100);
+
+    /*
+     * With equal weights both readers are charged the same cost, and the
+     * cost of a 4k request is half overhead, so the small reader should get
+     * about a third of the bytes.
+     */
+    g_assert_cmpfloat(fair_share, >, 0.2);
+    g_assert_cmpfloat(fair_share, <, 0.5);
+    g_assert_cmpfloat(fair_share, >, rr_share * 10);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -747,6 +919,9 @@ int main(int argc, char **argv)
 
     do {} while (g_main_context_iteration(NULL, false));
 
+    /* Make throttle groups use QEMU_CLOCK_VIRTUAL, which the tests drive */
+    qtest_allowed = true;
+
     /* tests in the same order as the header function declarations */
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/throttle/leak_bucket",        test_leak_bucket);
@@ -765,6 +940,10 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/fair_share/weights",
+                    test_fair_share_weights);
+    g_test_add_func("/throttle/groups/fair_share/cost",
+                    test_fair_share_cost);
     return g_test_run();
 }
 
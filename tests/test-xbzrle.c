@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "../migration/xbzrle.h"
 
 #define PAGE_SIZE 4096
@@ -174,6 +175,134 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_TEST_PAGES 256
+
+/*
+ * Fill @new with a copy of @old in which runs of bytes have been changed.
+ * Run lengths are random but biased to be short, so that run boundaries
+ * fall both inside and across vector-sized chunks.
+ */
+static void fill_modified_page(uint8_t *old, uint8_t *new, int max_gap,
+                               int max_run)
+{
+    int i = g_test_rand_int_range(0, max_gap);
+
+    memcpy(new, old, PAGE_SIZE);
+    while (i < PAGE_SIZE) {
+        int run = g_test_rand_int_range(1, max_run + 1);
+
+        for (; run && i < PAGE_SIZE; run--, i++) {
+            new[i] = old[i] ^ g_test_rand_int_range(1, 256);
+        }
+        i += g_test_rand_int_range(1, max_gap + 1);
+    }
+}
+
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE * ACCEL_TEST_PAGES);
+    uint8_t *new = g_malloc(PAGE_SIZE * ACCEL_TEST_PAGES);
+    uint8_t *ref = g_malloc(PAGE_SIZE * ACCEL_TEST_PAGES);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int ref_len[ACCEL_TEST_PAGES], dlen[ACCEL_TEST_PAGES];
+    bool first = true;
+    int i, j, rc;
+
+    for (i = 0; i < ACCEL_TEST_PAGES; i++) {
+        uint8_t *o = old + i * PAGE_SIZE;
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            o[j] = g_test_rand_int();
+        }
+        fill_modified_page(o, new + i * PAGE_SIZE,
+                           g_test_rand_int_range(1, 512),
+                           g_test_rand_int_range(1, 128));
+        /* a quarter of the pages also exercise the overflow paths */
+        dlen[i] = i % 4 ? PAGE_SIZE : g_test_rand_int_range(0, PAGE_SIZE);
+    }
+
+    /* Every implementation must produce exactly the same stream.  */
+    do {
+        for (i = 0; i < ACCEL_TEST_PAGES; i++) {
+            rc = xbzrle_encode_buffer(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                                      PAGE_SIZE, compressed, dlen[i]);
+            if (first) {
+                ref_len[i] = rc;
+                if (rc > 0) {
+                    memcpy(ref + i * PAGE_SIZE, compressed, rc);
+                }
+            } else {
+                g_assert_cmpint(rc, ==, ref_len[i]);
+                if (rc > 0) {
+                    g_assert(memcmp(ref + i * PAGE_SIZE, compressed, rc) == 0);
+                }
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+}
+
+static void encode_perf_one(const char *desc, uint8_t *old, uint8_t *new)
+{
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    size_t total = 4 * GiB;
+    size_t done;
+    int i = 0;
+
+    g_test_timer_start();
+    for (done = 0; done < total; done += PAGE_SIZE) {
+        xbzrle_encode_buffer(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                             PAGE_SIZE, compressed, PAGE_SIZE);
+        i = (i + 1) % ACCEL_TEST_PAGES;
+    }
+    g_test_timer_elapsed();
+
+    g_print("%s: %.2f MB/sec ", desc,
+            (double)total / MiB / g_test_timer_last());
+    g_free(compressed);
+}
+
+static void test_encode_perf(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE * ACCEL_TEST_PAGES);
+    uint8_t *same = g_malloc(PAGE_SIZE * ACCEL_TEST_PAGES);
+    uint8_t *sparse = g_malloc(PAGE_SIZE * ACCEL_TEST_PAGES);
+    uint8_t *dense = g_malloc(PAGE_SIZE * ACCEL_TEST_PAGES);
+    int level = 0;
+    int i, j;
+
+    for (i = 0; i < ACCEL_TEST_PAGES; i++) {
+        uint8_t *o = old + i * PAGE_SIZE;
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            o[j] = g_test_rand_int();
+        }
+        memcpy(same + i * PAGE_SIZE, o, PAGE_SIZE);
+        /* a handful of updated fields per page */
+        fill_modified_page(o, sparse + i * PAGE_SIZE, 1024, 8);
+        /* small changes all over the page, still compressible */
+        fill_modified_page(o, dense + i * PAGE_SIZE, 64, 8);
+    }
+
+    do {
+        g_print("\nimplementation %d: ", level++);
+        encode_perf_one("unchanged", old, same);
+        encode_perf_one("sparse", old, sparse);
+        encode_perf_one("dense", old, dense);
+    } while (test_xbzrle_encode_next_accel());
+    g_print("(last one is scalar)\n");
+
+    g_free(old);
+    g_free(same);
+    g_free(sparse);
+    g_free(dense);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +315,12 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* both of these walk through every encoder implementation */
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/encode_perf", test_encode_perf);
+    } else {
+        g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    }
 
     return g_test_run();
 }
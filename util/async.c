@@ -400,7 +400,7 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(ctx->linux_io_uring_sqpoll, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -416,6 +416,13 @@ LuringState *aio_get_linux_io_uring(AioContext *ctx)
 }
 #endif
 
+void aio_context_set_io_uring_sqpoll(AioContext *ctx, bool sqpoll)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    ctx->linux_io_uring_sqpoll = sqpoll;
+#endif
+}
+
 void aio_notify(AioContext *ctx)
 {
     /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs